@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2025 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+/** @file
+ *  @brief NUS central for the bridge benchmark
+ *
+ *  Connects to the peripheral_uart sample running with its UART looped
+ *  back, writes numbered frames and times each one until it comes back
+ *  as a notification. The results of the run are printed as a single
+ *  nus_central line, see bench/run_bsim.sh.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/printk.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/gatt.h>
+
+#include <bluetooth/gatt_dm.h>
+#include <bluetooth/scan.h>
+#include <bluetooth/services/nus.h>
+#include <bluetooth/services/nus_client.h>
+
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(nus_central, LOG_LEVEL_INF);
+
+/* Frame layout: magic, sequence number, cycle count when written, filler.
+ * The first byte is not the command prefix and the last one is not '\r',
+ * so the peripheral passes the frame to its UART unchanged.
+ */
+#define FRAME_MAGIC0 0xA5
+#define FRAME_MAGIC1 0x5A
+#define FRAME_SEQ_POS 2
+#define FRAME_STAMP_POS 6
+#define FRAME_FILL 'U'
+
+#define FRAME_LEN CONFIG_NUS_CENTRAL_PAYLOAD
+
+/* A frame not back within this time ends the run */
+#define STALL_TIMEOUT K_SECONDS(1)
+
+static struct bt_conn *default_conn;
+static struct bt_nus_client nus_client;
+
+static K_SEM_DEFINE(ready_sem, 0, 1);
+static K_SEM_DEFINE(window_sem, CONFIG_NUS_CENTRAL_WINDOW, CONFIG_NUS_CENTRAL_WINDOW);
+
+static uint32_t tx_seq;
+
+/* Receive side, only touched from the notification callback until the
+ * run has ended
+ */
+static uint8_t rx_frame[FRAME_LEN];
+static uint16_t rx_fill;
+static uint32_t rx_expected_seq;
+static uint32_t frames_rx;
+static uint64_t rtt_sum_us;
+static uint32_t rtt_max_us;
+static uint32_t rtt[CONFIG_NUS_CENTRAL_MAX_SAMPLES];
+static uint32_t rtt_count;
+
+static void frame_received(void)
+{
+	uint32_t seq = sys_get_le32(&rx_frame[FRAME_SEQ_POS]);
+	uint32_t stamp = sys_get_le32(&rx_frame[FRAME_STAMP_POS]);
+	uint32_t rtt_us = k_cyc_to_us_floor32(k_cycle_get_32() - stamp);
+
+	/* A frame assembled after a false magic match */
+	if (seq < rx_expected_seq || seq > tx_seq) {
+		return;
+	}
+
+	/* Frames skipped over are lost, their window slots come back too */
+	for (uint32_t i = rx_expected_seq; i <= seq; i++) {
+		k_sem_give(&window_sem);
+	}
+	rx_expected_seq = seq + 1;
+
+	frames_rx++;
+	rtt_sum_us += rtt_us;
+	rtt_max_us = MAX(rtt_max_us, rtt_us);
+	if (rtt_count < ARRAY_SIZE(rtt)) {
+		rtt[rtt_count++] = rtt_us;
+	}
+}
+
+/* The UART splits frames at arbitrary points, so they are reassembled from
+ * the byte stream
+ */
+static uint8_t ble_data_received(struct bt_nus_client *nus, const uint8_t *data, uint16_t len)
+{
+	for (uint16_t i = 0; i < len; i++) {
+		uint8_t c = data[i];
+
+		if ((rx_fill == 0 && c != FRAME_MAGIC0) ||
+		    (rx_fill == 1 && c != FRAME_MAGIC1)) {
+			rx_fill = (c == FRAME_MAGIC0) ? 1 : 0;
+			rx_frame[0] = FRAME_MAGIC0;
+			continue;
+		}
+
+		rx_frame[rx_fill++] = c;
+		if (rx_fill == FRAME_LEN) {
+			frame_received();
+			rx_fill = 0;
+		}
+	}
+
+	return BT_GATT_ITER_CONTINUE;
+}
+
+static void discovery_complete(struct bt_gatt_dm *dm, void *context)
+{
+	int err;
+
+	bt_nus_handles_assign(dm, &nus_client);
+
+	err = bt_nus_subscribe_receive(&nus_client);
+	if (err) {
+		LOG_ERR("Subscribe failed (err %d)", err);
+	}
+
+	bt_gatt_dm_data_release(dm);
+
+	if (!err) {
+		k_sem_give(&ready_sem);
+	}
+}
+
+static void discovery_service_not_found(struct bt_conn *conn, void *context)
+{
+	LOG_ERR("NUS not found");
+}
+
+static void discovery_error(struct bt_conn *conn, int err, void *context)
+{
+	LOG_ERR("Discovery failed (err %d)", err);
+}
+
+static const struct bt_gatt_dm_cb discovery_cb = {
+	.completed = discovery_complete,
+	.service_not_found = discovery_service_not_found,
+	.error_found = discovery_error,
+};
+
+static void exchange_func(struct bt_conn *conn, uint8_t err,
+			  struct bt_gatt_exchange_params *params)
+{
+	if (err) {
+		LOG_WRN("MTU exchange failed (err %u)", err);
+	}
+}
+
+static void connected(struct bt_conn *conn, uint8_t conn_err)
+{
+	static struct bt_gatt_exchange_params exchange_params = {
+		.func = exchange_func,
+	};
+	struct bt_conn_le_phy_param phy = {
+		.options = BT_CONN_LE_PHY_OPT_NONE,
+		.pref_tx_phy = IS_ENABLED(CONFIG_NUS_CENTRAL_PHY_2M) ?
+			       BT_GAP_LE_PHY_2M : BT_GAP_LE_PHY_1M,
+		.pref_rx_phy = IS_ENABLED(CONFIG_NUS_CENTRAL_PHY_2M) ?
+			       BT_GAP_LE_PHY_2M : BT_GAP_LE_PHY_1M,
+	};
+	int err;
+
+	if (conn_err) {
+		LOG_ERR("Connection failed (err 0x%02x)", conn_err);
+		bt_scan_start(BT_SCAN_TYPE_SCAN_ACTIVE);
+		return;
+	}
+
+	default_conn = bt_conn_ref(conn);
+
+	/* Pinning the PHY preference also holds it against the peripheral's
+	 * own update request
+	 */
+	err = bt_conn_le_phy_update(conn, &phy);
+	if (err) {
+		LOG_WRN("PHY update failed (err %d)", err);
+	}
+
+	err = bt_conn_le_data_len_update(conn, BT_LE_DATA_LEN_PARAM_MAX);
+	if (err) {
+		LOG_WRN("Data length update failed (err %d)", err);
+	}
+
+	err = bt_gatt_exchange_mtu(conn, &exchange_params);
+	if (err) {
+		LOG_WRN("MTU exchange failed (err %d)", err);
+	}
+
+	err = bt_gatt_dm_start(conn, BT_UUID_NUS_SERVICE, &discovery_cb, NULL);
+	if (err) {
+		LOG_ERR("Discovery failed to start (err %d)", err);
+	}
+}
+
+static void disconnected(struct bt_conn *conn, uint8_t reason)
+{
+	LOG_WRN("Disconnected (reason 0x%02x)", reason);
+
+	if (default_conn == conn) {
+		bt_conn_unref(default_conn);
+		default_conn = NULL;
+	}
+}
+
+/* The connection interval is a parameter of the run */
+static bool le_param_req(struct bt_conn *conn, struct bt_le_conn_param *param)
+{
+	return false;
+}
+
+BT_CONN_CB_DEFINE(conn_callbacks) = {
+	.connected = connected,
+	.disconnected = disconnected,
+	.le_param_req = le_param_req,
+};
+
+static void scan_connecting_error(struct bt_scan_device_info *device_info)
+{
+	LOG_WRN("Connecting failed");
+}
+
+BT_SCAN_CB_INIT(scan_cb, NULL, NULL, scan_connecting_error, NULL);
+
+static int scan_init(void)
+{
+	struct bt_scan_init_param param = {
+		.connect_if_match = true,
+		.conn_param = BT_LE_CONN_PARAM(CONFIG_NUS_CENTRAL_CONN_INTERVAL,
+					       CONFIG_NUS_CENTRAL_CONN_INTERVAL, 0, 400),
+	};
+	int err;
+
+	bt_scan_init(&param);
+	bt_scan_cb_register(&scan_cb);
+
+	err = bt_scan_filter_add(BT_SCAN_FILTER_TYPE_UUID, BT_UUID_NUS_SERVICE);
+	if (err) {
+		return err;
+	}
+
+	return bt_scan_filter_enable(BT_SCAN_UUID_FILTER, false);
+}
+
+static int write_frame(const uint8_t *frame)
+{
+	int err;
+
+	/* Write commands are paced by the ACL buffers */
+	for (;;) {
+		err = bt_gatt_write_without_response(default_conn, nus_client.handles.rx,
+						     frame, FRAME_LEN, false);
+		if (err != -ENOMEM && err != -ENOBUFS) {
+			return err;
+		}
+		k_sleep(K_MSEC(1));
+	}
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint32_t rtt_percentile(uint32_t per_mille)
+{
+	if (rtt_count == 0) {
+		return 0;
+	}
+	return rtt[MIN((uint64_t)rtt_count * per_mille / 1000, rtt_count - 1)];
+}
+
+static void report(uint32_t duration_ms, bool stalled)
+{
+	struct bt_conn_info info = {0};
+	uint16_t mtu = 0;
+
+	if (default_conn && !bt_conn_get_info(default_conn, &info)) {
+		mtu = bt_gatt_get_mtu(default_conn);
+	}
+
+	qsort(rtt, rtt_count, sizeof(rtt[0]), compare_u32);
+
+	printk("nus_central,phy=%u,interval_us=%u,mtu=%u,payload=%u,window=%u,duration_ms=%u,"
+	       "frames_tx=%u,frames_rx=%u,lost=%u,stalled=%d,bps=%u,rtt_us_mean=%u,"
+	       "rtt_us_p50=%u,rtt_us_p99=%u,rtt_us_max=%u\n",
+	       info.le.phy ? info.le.phy->tx_phy : 0, info.le.interval * 1250, mtu,
+	       FRAME_LEN, CONFIG_NUS_CENTRAL_WINDOW, duration_ms, tx_seq, frames_rx,
+	       tx_seq - frames_rx, stalled,
+	       duration_ms ? (uint32_t)((uint64_t)frames_rx * FRAME_LEN * 8 *
+					MSEC_PER_SEC / duration_ms) : 0,
+	       frames_rx ? (uint32_t)(rtt_sum_us / frames_rx) : 0,
+	       rtt_percentile(500), rtt_percentile(990), rtt_max_us);
+	printk("NUS_CENTRAL DONE\n");
+}
+
+static void run(void)
+{
+	static uint8_t frame[FRAME_LEN];
+	k_timepoint_t end = sys_timepoint_calc(K_SECONDS(CONFIG_NUS_CENTRAL_DURATION_S));
+	int64_t start = k_uptime_get();
+	bool stalled = false;
+
+	memset(frame, FRAME_FILL, sizeof(frame));
+	frame[0] = FRAME_MAGIC0;
+	frame[1] = FRAME_MAGIC1;
+	frame[FRAME_LEN - 1] = 0;
+
+	while (!sys_timepoint_expired(end)) {
+		if (k_sem_take(&window_sem, STALL_TIMEOUT)) {
+			stalled = true;
+			break;
+		}
+
+		sys_put_le32(tx_seq, &frame[FRAME_SEQ_POS]);
+		sys_put_le32(k_cycle_get_32(), &frame[FRAME_STAMP_POS]);
+
+		int err = write_frame(frame);
+
+		if (err) {
+			LOG_ERR("Write failed (err %d)", err);
+			stalled = true;
+			break;
+		}
+		tx_seq++;
+	}
+
+	uint32_t duration_ms = k_uptime_get() - start;
+
+	/* Frames still in flight get a last chance to come back */
+	k_sleep(STALL_TIMEOUT);
+	report(duration_ms, stalled);
+}
+
+int main(void)
+{
+	struct bt_nus_client_init_param init = {
+		.cb = {
+			.received = ble_data_received,
+		},
+	};
+	int err;
+
+	err = bt_nus_client_init(&nus_client, &init);
+	if (err) {
+		LOG_ERR("NUS client init failed (err %d)", err);
+		return 0;
+	}
+
+	err = bt_enable(NULL);
+	if (err) {
+		LOG_ERR("Bluetooth init failed (err %d)", err);
+		return 0;
+	}
+
+	err = scan_init();
+	if (err) {
+		LOG_ERR("Scan init failed (err %d)", err);
+		return 0;
+	}
+
+	err = bt_scan_start(BT_SCAN_TYPE_SCAN_ACTIVE);
+	if (err) {
+		LOG_ERR("Scanning failed to start (err %d)", err);
+		return 0;
+	}
+
+	k_sem_take(&ready_sem, K_FOREVER);
+
+	/* Let the PHY, data length and MTU procedures settle first */
+	k_sleep(K_SECONDS(1));
+	run();
+
+	return 0;
+}
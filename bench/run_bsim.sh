@@ -0,0 +1,101 @@
+#!/usr/bin/env bash
+#
+# Copyright (c) 2025 Nordic Semiconductor
+#
+# SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+#
+# NUS bridge benchmark on BabbleSim. The peripheral_uart sample runs with
+# its UART looped back, bench/nus_central writes frames and times them on
+# their way back. Every run adds the central's nus_central line and the
+# peripheral's busiest nus_bench line per direction to the results file.
+#
+# Needs ZEPHYR_BASE, BSIM_OUT_PATH and BSIM_COMPONENTS_PATH set up as for
+# the Zephyr bsim tests. The sweep can be narrowed through the environment:
+#
+#   PHYS="2" INTERVALS="6 12" MTUS="247" ./bench/run_bsim.sh
+
+set -eu
+
+APP_DIR=$(cd "$(dirname "$0")/.." && pwd)
+OUT=${OUT:-${APP_DIR}/build_bsim_bench}
+RESULTS=${RESULTS:-${OUT}/results.txt}
+BOARD=nrf5340bsim/nrf5340/cpuapp
+
+PHYS=${PHYS:-"1 2"}
+# Connection interval in 1.25 ms units
+INTERVALS=${INTERVALS:-"6 12 24 80"}
+MTUS=${MTUS:-"23 65 247"}
+DURATION_S=${DURATION_S:-10}
+WINDOW=${WINDOW:-8}
+
+: "${BSIM_OUT_PATH:?BSIM_OUT_PATH is not set}"
+
+mkdir -p "${OUT}"
+: > "${RESULTS}"
+
+# The sysbuild image of an application is named after its directory
+exe() {
+	echo "$1/$(basename "$2")/zephyr/zephyr.exe"
+}
+
+# The peripheral report window with the highest rate in one direction
+busiest() {
+	awk -v dir="dir=$1" -F, '
+		$1 == "nus_bench" && $2 == dir {
+			for (i = 3; i <= NF; i++) {
+				if ($i ~ /^bps=/) {
+					bps = substr($i, 5) + 0
+				}
+			}
+			if (!found || bps > best) {
+				best = bps; line = $0; found = 1
+			}
+		}
+		END { if (found) print line }' "$2"
+}
+
+west build -p -b "${BOARD}" --sysbuild -d "${OUT}/peripheral" "${APP_DIR}" \
+	-- -DFILE_SUFFIX=throughput
+PERIPHERAL=$(exe "${OUT}/peripheral" "${APP_DIR}")
+
+sim_id=0
+for phy in ${PHYS}; do
+for interval in ${INTERVALS}; do
+for mtu in ${MTUS}; do
+	run="phy${phy}_ci${interval}_mtu${mtu}"
+	build="${OUT}/central_${run}"
+	phy_2m=$([ "${phy}" = 2 ] && echo y || echo n)
+
+	west build -p -b "${BOARD}" --sysbuild -d "${build}" "${APP_DIR}/bench/nus_central" \
+		-- -DCONFIG_NUS_CENTRAL_PHY_2M=${phy_2m} \
+		-DCONFIG_NUS_CENTRAL_CONN_INTERVAL=${interval} \
+		-DCONFIG_NUS_CENTRAL_PAYLOAD=$((mtu - 3)) \
+		-DCONFIG_NUS_CENTRAL_WINDOW=${WINDOW} \
+		-DCONFIG_NUS_CENTRAL_DURATION_S=${DURATION_S} \
+		-DCONFIG_BT_L2CAP_TX_MTU=${mtu}
+	CENTRAL=$(exe "${build}" "${APP_DIR}/bench/nus_central")
+
+	sim_id=$((sim_id + 1))
+	id="nus_bench_${sim_id}"
+	# Connection setup, the run and its drain fit in 15 s of simulated time
+	length_us=$(((DURATION_S + 15) * 1000000))
+
+	(cd "${BSIM_OUT_PATH}/bin" &&
+		./bs_2G4_phy_v1 -s="${id}" -D=2 -sim_length="${length_us}") &
+	# -uart0_loopback wires the app core UARTE TXD to RXD and RTS to CTS
+	# in the nRF hardware models
+	"${PERIPHERAL}" -s="${id}" -d=0 -uart0_loopback > "${build}/peripheral.log" 2>&1 &
+	"${CENTRAL}" -s="${id}" -d=1 > "${build}/central.log" 2>&1 &
+	wait
+
+	{
+		echo "run=${run}"
+		grep '^nus_central,' "${build}/central.log" || echo "nus_central,run=${run},failed=1"
+		busiest u2b "${build}/peripheral.log"
+		busiest b2u "${build}/peripheral.log"
+	} >> "${RESULTS}"
+done
+done
+done
+
+echo "Results in ${RESULTS}"
@@ -19,12 +19,16 @@
 #include <dk_buttons_and_leds.h>
 
 #include <zephyr/settings/settings.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/ring_buffer.h>
 
 #include <stdio.h>
 #include <string.h>
 
 #include <zephyr/logging/log.h>
 #include "BLE.h"
+#include "command.h"
+#include "nus_bench.h"
 
 LOG_MODULE_REGISTER(LOG_MODULE_NAME);
 K_SEM_DEFINE(ble_init_ok, 0, 1);
@@ -42,24 +46,346 @@ const size_t sd_len = ARRAY_SIZE(sd);
 struct k_work adv_work;
 struct bt_conn *current_conn;
 struct bt_conn *auth_conn;
-static K_FIFO_DEFINE(fifo_uart_tx_data);
+/* Guards current_conn for the threads that send on it, see current_conn_get */
+static struct k_spinlock current_conn_lock;
 static K_FIFO_DEFINE(fifo_uart_rx_data);
 
+/* BLE writes are copied here by the NUS receive callback, which runs in
+ * the Bluetooth RX thread and must not wait, and moved on to the UART TX
+ * ring by uart_write_thread. Its free space is the central's credit, see
+ * the bridge flow service.
+ */
+RING_BUF_DECLARE(ble_rx_ring, CONFIG_BT_NUS_BLE_RX_RING_SIZE);
+static struct k_spinlock ble_rx_lock;
+static K_SEM_DEFINE(ble_rx_sem, 0, 1);
+static void ble_rx_credit_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(ble_rx_credit_work, ble_rx_credit_work_handler);
+
+/* BLE writes are appended here and drained by the UART, one DMA transfer
+ * per contiguous span. uart_tx_len is the length of the span in flight,
+ * zero while the UART is idle.
+ */
+RING_BUF_DECLARE(uart_tx_ring, CONFIG_BT_NUS_UART_TX_RING_SIZE);
+static struct k_spinlock uart_tx_lock;
+static uint32_t uart_tx_len;
+
+/* UART RX buffers travel from the UART driver to ble_write_thread by
+ * reference and go back to the slab once sent.
+ */
+K_MEM_SLAB_DEFINE_STATIC(uart_rx_slab, sizeof(struct uart_data_t),
+			 CONFIG_BT_NUS_UART_RX_BUF_COUNT, 4);
+static atomic_t uart_rx_high_water;
+static atomic_t uart_rx_alloc_failures;
+
+/* Flow control. The RX pool is the UART's credit: with no free buffer the
+ * UARTE stops and deasserts RTS until ble_write_thread returns one.
+ * The free staging ring space is the central's credit, notified as the
+ * ring drains. A BLE write goes into the ring whole or is dropped whole,
+ * and the staged data waits for TX ring space in uart_write_thread.
+ */
+static atomic_t uart_rx_stalled;
+static atomic_t uart_rx_stalls;
+static atomic_t uart_tx_stalls;
+static atomic_t uart_tx_dropped;
+static atomic_t ble_tx_stalls;
+static atomic_t ble_tx_dropped;
+static K_SEM_DEFINE(uart_tx_space_sem, 0, 1);
+
+static atomic_t nus_tx_bytes;
+static uint32_t nus_tx_rate;
+static void nus_rate_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(nus_rate_work, nus_rate_work_handler);
+
+#ifdef CONFIG_BT_NUS_THROUGHPUT_MODE
+/* One token per notification that may be queued in the stack, returned by
+ * the NUS sent callback.
+ */
+static K_SEM_DEFINE(nus_tx_sem, CONFIG_BT_NUS_TX_PIPELINE_DEPTH,
+		    CONFIG_BT_NUS_TX_PIPELINE_DEPTH);
+static struct bt_conn *throughput_conn;
+static void throughput_work_handler(struct k_work *work);
+static K_WORK_DEFINE(throughput_work, throughput_work_handler);
+#endif /* CONFIG_BT_NUS_THROUGHPUT_MODE */
+
+static struct uart_data_t *uart_rx_buf_alloc(void)
+{
+	struct uart_data_t *buf;
+	atomic_val_t used;
+	atomic_val_t high;
+
+	if (k_mem_slab_alloc(&uart_rx_slab, (void **)&buf, K_NO_WAIT)) {
+		atomic_inc(&uart_rx_alloc_failures);
+		if (!atomic_set(&uart_rx_stalled, 1)) {
+			atomic_inc(&uart_rx_stalls);
+		}
+		return NULL;
+	}
+
+	buf->len = 0;
+
+	used = k_mem_slab_num_used_get(&uart_rx_slab);
+	do {
+		high = atomic_get(&uart_rx_high_water);
+	} while (used > high && !atomic_cas(&uart_rx_high_water, high, used));
+
+	return buf;
+}
+
+static void uart_rx_buf_free(struct uart_data_t *buf)
+{
+	k_mem_slab_free(&uart_rx_slab, buf);
+
+	/* Resume reception as soon as a credit is back */
+	if (atomic_cas(&uart_rx_stalled, 1, 0)) {
+		k_work_reschedule(&uart_work, K_NO_WAIT);
+	}
+}
+
+void uart_rx_pool_stats_get(struct uart_rx_pool_stats *stats)
+{
+	stats->used = k_mem_slab_num_used_get(&uart_rx_slab);
+	stats->high_water = atomic_get(&uart_rx_high_water);
+	stats->alloc_failures = atomic_get(&uart_rx_alloc_failures);
+}
+
+void bridge_flow_stats_get(struct bridge_flow_stats *stats)
+{
+	stats->uart_rx_stalls = atomic_get(&uart_rx_stalls);
+	stats->uart_tx_stalls = atomic_get(&uart_tx_stalls);
+	stats->uart_tx_dropped = atomic_get(&uart_tx_dropped);
+	stats->ble_tx_stalls = atomic_get(&ble_tx_stalls);
+	stats->ble_tx_dropped = atomic_get(&ble_tx_dropped);
+}
+
+/* Start the largest contiguous span waiting in the ring, if the UART is
+ * idle. Called with uart_tx_lock held.
+ */
+static void uart_tx_kick(void)
+{
+	uint8_t *data;
+
+	if (uart_tx_len) {
+		return;
+	}
+
+	uart_tx_len = ring_buf_get_claim(&uart_tx_ring, &data,
+					 CONFIG_BT_NUS_UART_TX_RING_SIZE);
+	if (!uart_tx_len) {
+		return;
+	}
+
+	if (uart_tx(uart, data, uart_tx_len, SYS_FOREVER_MS)) {
+		LOG_WRN("Failed to send data over UART");
+		ring_buf_get_finish(&uart_tx_ring, 0);
+		uart_tx_len = 0;
+	}
+}
+
+static void uart_tx_done(size_t sent)
+{
+	k_spinlock_key_t key = k_spin_lock(&uart_tx_lock);
+
+	/* An aborted transfer finishes only what went out, the rest is
+	 * claimed again by the next span.
+	 */
+	ring_buf_get_finish(&uart_tx_ring, MIN(sent, uart_tx_len));
+	nus_bench_b2u_drained(MIN(sent, uart_tx_len));
+	uart_tx_len = 0;
+	uart_tx_kick();
+
+	k_spin_unlock(&uart_tx_lock, key);
+
+	k_sem_give(&uart_tx_space_sem);
+}
+
+/* Append to the TX ring, waiting up to BT_NUS_STALL_TIMEOUT_MS for the UART
+ * to drain when it is full. Must not be called from an ISR.
+ */
+static uint32_t uart_tx_enqueue(const uint8_t *data, uint32_t len)
+{
+	k_timepoint_t deadline = sys_timepoint_calc(K_MSEC(CONFIG_BT_NUS_STALL_TIMEOUT_MS));
+	uint32_t put = 0;
+	bool stalled = false;
+
+	for (;;) {
+		k_spinlock_key_t key = k_spin_lock(&uart_tx_lock);
+
+		put += ring_buf_put(&uart_tx_ring, &data[put], len - put);
+		uart_tx_kick();
+
+		k_spin_unlock(&uart_tx_lock, key);
+
+		if (put == len) {
+			return put;
+		}
+
+		if (!stalled) {
+			stalled = true;
+			atomic_inc(&uart_tx_stalls);
+		}
+
+		if (k_sem_take(&uart_tx_space_sem, sys_timepoint_timeout(deadline))) {
+			break;
+		}
+	}
+
+	atomic_add(&uart_tx_dropped, len - put);
+	LOG_WRN("UART TX ring full, %u bytes dropped", len - put);
+
+	return put;
+}
+
+static uint16_t ble_rx_credit_get(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&ble_rx_lock);
+	uint32_t space = ring_buf_space_get(&ble_rx_ring);
+
+	k_spin_unlock(&ble_rx_lock, key);
+
+	return space;
+}
+
+static ssize_t ble_rx_credit_read(struct bt_conn *conn,
+				  const struct bt_gatt_attr *attr, void *buf,
+				  uint16_t len, uint16_t offset)
+{
+	uint16_t credit = sys_cpu_to_le16(ble_rx_credit_get());
+
+	return bt_gatt_attr_read(conn, attr, buf, len, offset, &credit,
+				 sizeof(credit));
+}
+
+#ifdef CONFIG_BT_NUS_SECURITY_ENABLED
+#define BRIDGE_FLOW_PERM_READ BT_GATT_PERM_READ_AUTHEN
+#define BRIDGE_FLOW_PERM_WRITE BT_GATT_PERM_WRITE_AUTHEN
+#else
+#define BRIDGE_FLOW_PERM_READ BT_GATT_PERM_READ
+#define BRIDGE_FLOW_PERM_WRITE BT_GATT_PERM_WRITE
+#endif /* CONFIG_BT_NUS_SECURITY_ENABLED */
+
+/* Attribute index of the credit value */
+#define BRIDGE_FLOW_CREDIT_ATTR 2
+
+BT_GATT_SERVICE_DEFINE(bridge_flow_svc,
+	BT_GATT_PRIMARY_SERVICE(BT_UUID_DECLARE_128(BRIDGE_FLOW_UUID_SERVICE_VAL)),
+	BT_GATT_CHARACTERISTIC(BT_UUID_DECLARE_128(BRIDGE_FLOW_UUID_CREDIT_VAL),
+			       BT_GATT_CHRC_READ | BT_GATT_CHRC_NOTIFY,
+			       BRIDGE_FLOW_PERM_READ, ble_rx_credit_read, NULL,
+			       NULL),
+	BT_GATT_CCC(NULL, BRIDGE_FLOW_PERM_READ | BRIDGE_FLOW_PERM_WRITE),
+);
+
+static void ble_rx_credit_work_handler(struct k_work *work)
+{
+	const struct bt_gatt_attr *attr =
+		&bridge_flow_svc.attrs[BRIDGE_FLOW_CREDIT_ATTR];
+	struct bt_conn *conn = current_conn_get();
+	uint16_t credit;
+
+	if (!conn) {
+		return;
+	}
+
+	if (bt_gatt_is_subscribed(conn, attr, BT_GATT_CCC_NOTIFY)) {
+		credit = sys_cpu_to_le16(ble_rx_credit_get());
+
+		/* Out of buffers. The ring may already be empty and never
+		 * drain again, so retry rather than wait for the next span.
+		 */
+		if (bt_gatt_notify(conn, attr, &credit, sizeof(credit))) {
+			k_work_reschedule(&ble_rx_credit_work,
+					  BRIDGE_FLOW_RETRY_DELAY);
+		}
+	}
+
+	bt_conn_unref(conn);
+}
+
+/* Called from the Bluetooth RX thread, never waits. The write goes into
+ * the staging ring whole, with the LF a trailing CR gets, or not at all,
+ * so a write past the credit never leaves a partial line behind.
+ */
+static void ble_rx_put(const uint8_t *data, uint16_t len)
+{
+	static const uint8_t lf = '\n';
+	/* Append the LF character when the CR character triggered
+	 * transmission from the peer.
+	 */
+	uint32_t need = len + (data[len - 1] == '\r');
+	k_spinlock_key_t key = k_spin_lock(&ble_rx_lock);
+	bool fits = ring_buf_space_get(&ble_rx_ring) >= need;
+
+	if (fits) {
+		ring_buf_put(&ble_rx_ring, data, len);
+		if (need > len) {
+			ring_buf_put(&ble_rx_ring, &lf, 1);
+		}
+	}
+
+	k_spin_unlock(&ble_rx_lock, key);
+
+	if (!fits) {
+		atomic_add(&uart_tx_dropped, len);
+		LOG_WRN("BLE RX ring full, %u byte write dropped", len);
+		/* Tell the central where it stands */
+		k_work_reschedule(&ble_rx_credit_work, K_NO_WAIT);
+		return;
+	}
+
+	nus_bench_b2u_queued(need);
+	k_sem_give(&ble_rx_sem);
+}
+
+void uart_write_thread(void)
+{
+	for (;;) {
+		uint8_t *data;
+		uint32_t len;
+
+		k_sem_take(&ble_rx_sem, K_FOREVER);
+
+		/* The claimed span stays put while this thread waits for the
+		 * UART, new writes go in behind it
+		 */
+		for (;;) {
+			k_spinlock_key_t key = k_spin_lock(&ble_rx_lock);
+
+			len = ring_buf_get_claim(&ble_rx_ring, &data,
+						 CONFIG_BT_NUS_BLE_RX_RING_SIZE);
+			k_spin_unlock(&ble_rx_lock, key);
+
+			if (!len) {
+				break;
+			}
+
+			uart_tx_enqueue(data, len);
+
+			key = k_spin_lock(&ble_rx_lock);
+			ring_buf_get_finish(&ble_rx_ring, len);
+			k_spin_unlock(&ble_rx_lock, key);
+
+			k_work_reschedule(&ble_rx_credit_work, K_NO_WAIT);
+		}
+	}
+}
 
 void uart_work_handler(struct k_work *item)
 {
 	struct uart_data_t *buf;
 
-	buf = k_malloc(sizeof(*buf));
-	if (buf) {
-		buf->len = 0;
-	} else {
+	buf = uart_rx_buf_alloc();
+	if (!buf) {
 		LOG_WRN("Not able to allocate UART receive buffer");
 		k_work_reschedule(&uart_work, UART_WAIT_FOR_BUF_DELAY);
 		return;
 	}
 
-	uart_rx_enable(uart, buf->data, sizeof(buf->data), UART_WAIT_FOR_RX);
+	/* Reception may still be winding down after a stall, in which case
+	 * UART_RX_DISABLED picks up a buffer again.
+	 */
+	if (uart_rx_enable(uart, buf->data, sizeof(buf->data), UART_WAIT_FOR_RX)) {
+		uart_rx_buf_free(buf);
+	}
 }
 
 bool uart_test_async_api(const struct device *dev)
@@ -87,6 +413,68 @@ void advertising_start(void)
 	k_work_submit(&adv_work);
 }
 
+struct bt_conn *current_conn_get(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&current_conn_lock);
+	struct bt_conn *conn = current_conn ? bt_conn_ref(current_conn) : NULL;
+
+	k_spin_unlock(&current_conn_lock, key);
+
+	return conn;
+}
+
+#ifdef CONFIG_BT_NUS_THROUGHPUT_MODE
+static void mtu_exchange_cb(struct bt_conn *conn, uint8_t err,
+			    struct bt_gatt_exchange_params *params)
+{
+	LOG_INF("MTU exchange %s, NUS payload %u", err ? "failed" : "done",
+		bt_nus_get_mtu(conn));
+}
+
+/* Runs from the system workqueue, the HCI commands below wait for their
+ * completion and must not block the Bluetooth RX thread.
+ */
+static void throughput_work_handler(struct k_work *work)
+{
+	static struct bt_gatt_exchange_params exchange_params = {
+		.func = mtu_exchange_cb,
+	};
+	struct bt_conn *conn = throughput_conn;
+	int err;
+
+	if (!conn) {
+		return;
+	}
+
+	err = bt_conn_le_data_len_update(conn, BT_LE_DATA_LEN_PARAM_MAX);
+	if (err) {
+		LOG_WRN("Data length update failed (err %d)", err);
+	}
+
+	err = bt_conn_le_phy_update(conn, BT_CONN_LE_PHY_PARAM_2M);
+	if (err) {
+		LOG_WRN("PHY update failed (err %d)", err);
+	}
+
+	err = bt_conn_le_param_update(conn, BT_LE_CONN_PARAM(CONFIG_BT_NUS_CONN_INTERVAL,
+							     CONFIG_BT_NUS_CONN_INTERVAL,
+							     0, 400));
+	if (err) {
+		LOG_WRN("Connection parameter update failed (err %d)", err);
+	}
+
+	if (IS_ENABLED(CONFIG_BT_GATT_CLIENT)) {
+		err = bt_gatt_exchange_mtu(conn, &exchange_params);
+		if (err) {
+			LOG_WRN("MTU exchange failed (err %d)", err);
+		}
+	}
+
+	bt_conn_unref(conn);
+	throughput_conn = NULL;
+}
+#endif /* CONFIG_BT_NUS_THROUGHPUT_MODE */
+
 void connected(struct bt_conn *conn, uint8_t err)
 {
 	char addr[BT_ADDR_LE_STR_LEN];
@@ -99,9 +487,18 @@ void connected(struct bt_conn *conn, uint8_t err)
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 	LOG_INF("Connected %s", addr);
 
+	k_spinlock_key_t key = k_spin_lock(&current_conn_lock);
+
 	current_conn = bt_conn_ref(conn);
+	k_spin_unlock(&current_conn_lock, key);
+	nus_bench_reset();
 
 	dk_set_led_on(CON_STATUS_LED);
+
+#ifdef CONFIG_BT_NUS_THROUGHPUT_MODE
+	throughput_conn = bt_conn_ref(conn);
+	k_work_submit(&throughput_work);
+#endif /* CONFIG_BT_NUS_THROUGHPUT_MODE */
 }
 
 void disconnected(struct bt_conn *conn, uint8_t reason)
@@ -117,11 +514,23 @@ void disconnected(struct bt_conn *conn, uint8_t reason)
 		auth_conn = NULL;
 	}
 
-	if (current_conn) {
-		bt_conn_unref(current_conn);
-		current_conn = NULL;
+	k_spinlock_key_t key = k_spin_lock(&current_conn_lock);
+	struct bt_conn *old = current_conn;
+
+	current_conn = NULL;
+	k_spin_unlock(&current_conn_lock, key);
+
+	if (old) {
+		bt_conn_unref(old);
 		dk_set_led_off(CON_STATUS_LED);
 	}
+
+#ifdef CONFIG_BT_NUS_THROUGHPUT_MODE
+	/* Notifications still queued on the link never report as sent */
+	for (int i = 0; i < CONFIG_BT_NUS_TX_PIPELINE_DEPTH; i++) {
+		k_sem_give(&nus_tx_sem);
+	}
+#endif /* CONFIG_BT_NUS_THROUGHPUT_MODE */
 }
 
 void recycled_cb(void)
@@ -281,56 +690,28 @@ void error(void)
 void bt_receive_cb(struct bt_conn *conn, const uint8_t *const data,
 			  uint16_t len)
 {
-	int err;
 	char addr[BT_ADDR_LE_STR_LEN] = {0};
 
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, ARRAY_SIZE(addr));
 
 	LOG_INF("Received data from: %s", addr);
 
-	for (uint16_t pos = 0; pos != len;) {
-		struct uart_data_t *tx = k_malloc(sizeof(*tx));
-
-		if (!tx) {
-			LOG_WRN("Not able to allocate UART send data buffer");
-			return;
-		}
-
-		/* Keep the last byte of TX buffer for potential LF char. */
-		size_t tx_data_size = sizeof(tx->data) - 1;
-
-		if ((len - pos) > tx_data_size) {
-			tx->len = tx_data_size;
-		} else {
-			tx->len = (len - pos);
-		}
-
-		memcpy(tx->data, &data[pos], tx->len);
-
-		pos += tx->len;
-
-		/* Append the LF character when the CR character triggered
-		 * transmission from the peer.
-		 */
-		if ((pos == len) && (data[len - 1] == '\r')) {
-			tx->data[tx->len] = '\n';
-			tx->len++;
-		}
+	if (command_handle(conn, data, len)) {
+		return;
+	}
 
-		err = uart_tx(uart, tx->data, tx->len, SYS_FOREVER_MS);
-		if (err) {
-			k_fifo_put(&fifo_uart_tx_data, tx);
-		}
+	if (!len) {
+		return;
 	}
+
+	ble_rx_put(data, len);
 }
 
 void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data)
 {
 	ARG_UNUSED(dev);
 
-	static size_t aborted_len;
 	struct uart_data_t *buf;
-	static uint8_t *aborted_buf;
 	static bool disable_req;
 
 	switch (evt->type) {
@@ -341,26 +722,7 @@ void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data)
 			return;
 		}
 
-		if (aborted_buf) {
-			buf = CONTAINER_OF(aborted_buf, struct uart_data_t,
-					   data[0]);
-			aborted_buf = NULL;
-			aborted_len = 0;
-		} else {
-			buf = CONTAINER_OF(evt->data.tx.buf, struct uart_data_t,
-					   data[0]);
-		}
-
-		k_free(buf);
-
-		buf = k_fifo_get(&fifo_uart_tx_data, K_NO_WAIT);
-		if (!buf) {
-			return;
-		}
-
-		if (uart_tx(uart, buf->data, buf->len, SYS_FOREVER_MS)) {
-			LOG_WRN("Failed to send data over UART");
-		}
+		uart_tx_done(evt->data.tx.len);
 
 		break;
 
@@ -373,8 +735,20 @@ void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data)
 			return;
 		}
 
-		if ((evt->data.rx.buf[buf->len - 1] == '\n') ||
-		    (evt->data.rx.buf[buf->len - 1] == '\r')) {
+		/* In throughput mode a buffer is not flushed per line, it fills
+		 * up to a full notification. A short RX_RDY means the line went
+		 * idle for UART_WAIT_FOR_RX, so that tail is flushed instead.
+		 */
+		bool flush;
+
+		if (IS_ENABLED(CONFIG_BT_NUS_THROUGHPUT_MODE)) {
+			flush = buf->len < sizeof(buf->data);
+		} else {
+			flush = (evt->data.rx.buf[buf->len - 1] == '\n') ||
+				(evt->data.rx.buf[buf->len - 1] == '\r');
+		}
+
+		if (flush) {
 			disable_req = true;
 			uart_rx_disable(uart);
 		}
@@ -385,10 +759,8 @@ void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data)
 		LOG_DBG("UART_RX_DISABLED");
 		disable_req = false;
 
-		buf = k_malloc(sizeof(*buf));
-		if (buf) {
-			buf->len = 0;
-		} else {
+		buf = uart_rx_buf_alloc();
+		if (!buf) {
 			LOG_WRN("Not able to allocate UART receive buffer");
 			k_work_reschedule(&uart_work, UART_WAIT_FOR_BUF_DELAY);
 			return;
@@ -401,9 +773,8 @@ void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data)
 
 	case UART_RX_BUF_REQUEST:
 		LOG_DBG("UART_RX_BUF_REQUEST");
-		buf = k_malloc(sizeof(*buf));
+		buf = uart_rx_buf_alloc();
 		if (buf) {
-			buf->len = 0;
 			uart_rx_buf_rsp(uart, buf->data, sizeof(buf->data));
 		} else {
 			LOG_WRN("Not able to allocate UART receive buffer");
@@ -417,25 +788,19 @@ void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data)
 				   data[0]);
 
 		if (buf->len > 0) {
+#ifdef CONFIG_BT_NUS_BENCH
+			buf->stamp = k_cycle_get_32();
+#endif /* CONFIG_BT_NUS_BENCH */
 			k_fifo_put(&fifo_uart_rx_data, buf);
 		} else {
-			k_free(buf);
+			uart_rx_buf_free(buf);
 		}
 
 		break;
 
 	case UART_TX_ABORTED:
 		LOG_DBG("UART_TX_ABORTED");
-		if (!aborted_buf) {
-			aborted_buf = (uint8_t *)evt->data.tx.buf;
-		}
-
-		aborted_len += evt->data.tx.len;
-		buf = CONTAINER_OF((void *)aborted_buf, struct uart_data_t,
-				   data);
-
-		uart_tx(uart, &buf->data[aborted_len],
-			buf->len - aborted_len, SYS_FOREVER_MS);
+		uart_tx_done(evt->data.tx.len);
 
 		break;
 
@@ -447,9 +812,8 @@ void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data)
 int uart_init(void)
 {
 	int err;
-	int pos;
 	struct uart_data_t *rx;
-	struct uart_data_t *tx;
+	static const uint8_t welcome[] = "Starting Nordic UART service sample\r\n";
 
 	if (!device_is_ready(uart)) {
 		return -ENODEV;
@@ -463,10 +827,8 @@ int uart_init(void)
 		}
 	}
 
-	rx = k_malloc(sizeof(*rx));
-	if (rx) {
-		rx->len = 0;
-	} else {
+	rx = uart_rx_buf_alloc();
+	if (!rx) {
 		return -ENOMEM;
 	}
 
@@ -481,7 +843,7 @@ int uart_init(void)
 
 	err = uart_callback_set(uart, uart_cb, NULL);
 	if (err) {
-		k_free(rx);
+		uart_rx_buf_free(rx);
 		LOG_ERR("Cannot initialize UART callback");
 		return err;
 	}
@@ -509,76 +871,148 @@ int uart_init(void)
 		}
 	}
 
-	tx = k_malloc(sizeof(*tx));
+	if (uart_tx_enqueue(welcome, sizeof(welcome) - 1) != sizeof(welcome) - 1) {
+		uart_rx_buf_free(rx);
+		LOG_ERR("Cannot display welcome message");
+		return -ENOMEM;
+	}
 
-	if (tx) {
-		pos = snprintf(tx->data, sizeof(tx->data),
-			       "Starting Nordic UART service sample\r\n");
+	err = uart_rx_enable(uart, rx->data, sizeof(rx->data), UART_WAIT_FOR_RX);
+	if (err) {
+		LOG_ERR("Cannot enable uart reception (err: %d)", err);
+		uart_rx_buf_free(rx);
+	}
 
-		if ((pos < 0) || (pos >= sizeof(tx->data))) {
-			k_free(rx);
-			k_free(tx);
-			LOG_ERR("snprintf returned %d", pos);
-			return -ENOMEM;
-		}
+	return err;
+}
 
-		tx->len = pos;
-	} else {
-		k_free(rx);
-		return -ENOMEM;
+void bt_sent_cb(struct bt_conn *conn)
+{
+	nus_bench_u2b_sent();
+
+#ifdef CONFIG_BT_NUS_THROUGHPUT_MODE
+	k_sem_give(&nus_tx_sem);
+#endif /* CONFIG_BT_NUS_THROUGHPUT_MODE */
+}
+
+/* stamp is the cycle count at which the data became available, used for
+ * the benchmark latency.
+ */
+static int nus_send_stamped(const uint8_t *data, uint16_t len, k_timeout_t timeout,
+			    uint32_t stamp)
+{
+	int err;
+
+#ifdef CONFIG_BT_NUS_THROUGHPUT_MODE
+	if (k_sem_take(&nus_tx_sem, timeout)) {
+		return -EAGAIN;
 	}
+#endif /* CONFIG_BT_NUS_THROUGHPUT_MODE */
+
+	/* The sent callback may run before bt_nus_send() returns */
+	nus_bench_u2b_queued(stamp, len);
 
-	err = uart_tx(uart, tx->data, tx->len, SYS_FOREVER_MS);
+	err = bt_nus_send(NULL, data, len);
 	if (err) {
-		k_free(rx);
-		k_free(tx);
-		LOG_ERR("Cannot display welcome message (err: %d)", err);
+		nus_bench_u2b_cancel();
+#ifdef CONFIG_BT_NUS_THROUGHPUT_MODE
+		k_sem_give(&nus_tx_sem);
+#endif /* CONFIG_BT_NUS_THROUGHPUT_MODE */
 		return err;
 	}
 
-	err = uart_rx_enable(uart, rx->data, sizeof(rx->data), UART_WAIT_FOR_RX);
-	if (err) {
-		LOG_ERR("Cannot enable uart reception (err: %d)", err);
-		/* Free the rx buffer only because the tx buffer will be handled in the callback */
-		k_free(rx);
+	atomic_add(&nus_tx_bytes, len);
+	return 0;
+}
+
+int nus_send(const uint8_t *data, uint16_t len, k_timeout_t timeout)
+{
+	return nus_send_stamped(data, len, timeout, k_cycle_get_32());
+}
+
+uint32_t nus_tx_rate_get(void)
+{
+	return nus_tx_rate;
+}
+
+static void nus_rate_work_handler(struct k_work *work)
+{
+	nus_tx_rate = atomic_clear(&nus_tx_bytes) * 8 * MSEC_PER_SEC / NUS_RATE_INTERVAL_MS;
+	k_work_reschedule(&nus_rate_work, K_MSEC(NUS_RATE_INTERVAL_MS));
+}
+
+/* Retry while the stack is out of buffers. Meanwhile the UART RX pool
+ * fills up and throttles the UART sender.
+ */
+static int nus_send_paced(const uint8_t *data, uint16_t len, uint32_t stamp)
+{
+	k_timepoint_t deadline = sys_timepoint_calc(K_MSEC(CONFIG_BT_NUS_STALL_TIMEOUT_MS));
+	bool stalled = false;
+	int err;
+
+	for (;;) {
+		err = nus_send_stamped(data, len, sys_timepoint_timeout(deadline), stamp);
+		if ((err != -ENOMEM) || sys_timepoint_expired(deadline)) {
+			return err;
+		}
+
+		if (!stalled) {
+			stalled = true;
+			atomic_inc(&ble_tx_stalls);
+		}
+
+		k_sleep(K_MSEC(1));
 	}
+}
 
-	return err;
+/* Largest notification payload for the current link */
+static uint16_t nus_tx_max_len(void)
+{
+	struct bt_conn *conn = current_conn_get();
+	uint16_t max = UART_BUF_SIZE;
+
+	if (conn) {
+		max = bt_nus_get_mtu(conn);
+		bt_conn_unref(conn);
+	}
+
+	return max;
 }
 
 void ble_write_thread(void)
 {
 	/* Don't go any further until BLE is initialized */
 	k_sem_take(&ble_init_ok, K_FOREVER);
-	struct uart_data_t nus_data = {
-		.len = 0,
-	};
+
+	k_work_reschedule(&nus_rate_work, K_MSEC(NUS_RATE_INTERVAL_MS));
 
 	for (;;) {
 		/* Wait indefinitely for data to be sent over bluetooth */
 		struct uart_data_t *buf = k_fifo_get(&fifo_uart_rx_data,
 						     K_FOREVER);
+		uint16_t max = nus_tx_max_len();
 
-		int plen = MIN(sizeof(nus_data.data) - nus_data.len, buf->len);
-		int loc = 0;
-
-		while (plen > 0) {
-			memcpy(&nus_data.data[nus_data.len], &buf->data[loc], plen);
-			nus_data.len += plen;
-			loc += plen;
-
-			if (nus_data.len >= sizeof(nus_data.data) ||
-			   (nus_data.data[nus_data.len - 1] == '\n') ||
-			   (nus_data.data[nus_data.len - 1] == '\r')) {
-				if (bt_nus_send(NULL, nus_data.data, nus_data.len)) {
-					LOG_WRN("Failed to send data over BLE connection");
-				}
-				nus_data.len = 0;
-			}
+		/* The UART releases a buffer when it is full, goes idle or,
+		 * outside throughput mode, ends a line, so it is sent as is.
+		 * bt_nus_send() copies into a stack buffer, which lets the slab
+		 * buffer go back right after.
+		 */
+		for (uint16_t pos = 0; pos < buf->len; pos += max) {
+			uint16_t plen = MIN(max, buf->len - pos);
 
-			plen = MIN(sizeof(nus_data.data), buf->len - loc);
+#ifdef CONFIG_BT_NUS_BENCH
+			uint32_t stamp = buf->stamp;
+#else
+			uint32_t stamp = 0;
+#endif /* CONFIG_BT_NUS_BENCH */
+
+			if (nus_send_paced(&buf->data[pos], plen, stamp)) {
+				LOG_WRN("Failed to send data over BLE connection");
+				atomic_add(&ble_tx_dropped, buf->len - pos);
+				break;
+			}
 		}
 
-		k_free(buf);
+		uart_rx_buf_free(buf);
 	}
 }
\ No newline at end of file
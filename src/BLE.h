@@ -24,6 +24,20 @@
 #define UART_WAIT_FOR_BUF_DELAY K_MSEC(50)
 #define UART_WAIT_FOR_RX CONFIG_BT_NUS_UART_RX_WAIT_TIME
 
+#define NUS_RATE_INTERVAL_MS 1000
+
+/* Bridge flow service, next to the NUS UUIDs. The credit characteristic
+ * (read, notify) is a little endian uint16_t with the bytes the central
+ * may write to the NUS RX characteristic before it has to wait for the
+ * next notification. A write ending in CR costs one more byte. A write
+ * past the credit is dropped whole and counted in uart_tx_dropped.
+ */
+#define BRIDGE_FLOW_UUID_SERVICE_VAL \
+	BT_UUID_128_ENCODE(0x6e400010, 0xb5a3, 0xf393, 0xe0a9, 0xe50e24dcca9e)
+#define BRIDGE_FLOW_UUID_CREDIT_VAL \
+	BT_UUID_128_ENCODE(0x6e400011, 0xb5a3, 0xf393, 0xe0a9, 0xe50e24dcca9e)
+#define BRIDGE_FLOW_RETRY_DELAY K_MSEC(50)
+
 #ifdef CONFIG_UART_ASYNC_ADAPTER
 UART_ASYNC_ADAPTER_INST_DEFINE(async_adapter);
 #else
@@ -44,12 +58,34 @@ struct uart_data_t {
     void *fifo_reserved;
     uint8_t data[UART_BUF_SIZE];
     uint16_t len;
+#ifdef CONFIG_BT_NUS_BENCH
+    uint32_t stamp;         // cycle count when the UART released the buffer
+#endif
+};
+
+struct uart_rx_pool_stats {
+    uint32_t used;              // buffers currently held by the UART or queued for BLE
+    uint32_t high_water;        // most buffers in use at once since boot
+    uint32_t alloc_failures;    // RX buffer requests that found the pool empty
+};
+
+struct bridge_flow_stats {
+    uint32_t uart_rx_stalls;    // times UART reception paused for lack of RX buffers
+    uint32_t uart_tx_stalls;    // BLE writes that waited for UART TX ring space
+    uint32_t uart_tx_dropped;   // BLE bytes dropped, writes past the credit or BT_NUS_STALL_TIMEOUT_MS
+    uint32_t ble_tx_stalls;     // notifications that waited for stack buffers
+    uint32_t ble_tx_dropped;    // UART bytes that could not be notified
 };
 
 void uart_work_handler(struct k_work *item);
 bool uart_test_async_api(const struct device *dev);
 void adv_work_handler(struct k_work *work);
 void advertising_start(void);
+/* current_conn with a reference the caller drops with bt_conn_unref, or
+ * NULL. Threads other than the Bluetooth ones use this instead of reading
+ * current_conn, which disconnected() can release under them.
+ */
+struct bt_conn *current_conn_get(void);
 void connected(struct bt_conn *conn, uint8_t err);
 void disconnected(struct bt_conn *conn, uint8_t reason);
 void recycled_cb(void);
@@ -60,6 +96,12 @@ void bt_receive_cb(struct bt_conn *conn, const uint8_t *const data,
 void uart_cb(const struct device *dev, struct uart_event *evt, void *user_data);
 int uart_init(void);
 void ble_write_thread(void);
+void uart_write_thread(void);
+void bt_sent_cb(struct bt_conn *conn);
+int nus_send(const uint8_t *data, uint16_t len, k_timeout_t timeout);
+uint32_t nus_tx_rate_get(void);
+void uart_rx_pool_stats_get(struct uart_rx_pool_stats *stats);
+void bridge_flow_stats_get(struct bridge_flow_stats *stats);
 
 #ifdef CONFIG_BT_NUS_SECURITY_ENABLED
 void security_changed(struct bt_conn *conn, bt_security_t level,
@@ -0,0 +1,270 @@
+#include <nrfx_timer.h>
+#include <nrfx_saadc.h>
+#include <helpers/nrfx_gppi.h>
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/conn.h>
+#include <bluetooth/services/nus.h>
+#include <zephyr/sys/byteorder.h>
+#include <string.h>
+#include "acq.h"
+#include "timer.h"
+#include "BLE.h"
+
+// Evoked response acquisition.
+//
+// A window of ACQ_SAMPLES samples is taken ACQ_DELAY_US after every
+// COMPARE0 clear of the stimulation timer, i.e. after the first pulse of
+// each period:
+//
+//   stim COMPARE5     -> ch_start  -> acq timer START, capture measurement CC3
+//   acq COMPARE0      -> ch_sample -> SAADC SAMPLE
+//   SAADC END         -> ch_stop   -> acq timer STOP and CLEAR
+//
+// The acq timer runs on the same 16 MHz clock as the stimulation timer,
+// so the sample phase relative to the compare is fixed to the tick. The
+// SAADC writes each window into its own buffer with EasyDMA and restarts
+// on the next one through the END->START short, the CPU only supplies
+// the next buffer and hands the full one to the stream thread, once per
+// window.
+
+#define ACQ_FRAME_MAX 244       // largest NUS payload with a 247 byte ATT MTU
+
+BUILD_ASSERT((ACQ_BUFFERS & (ACQ_BUFFERS - 1)) == 0, "Acquisition buffer count must be a power of two");
+BUILD_ASSERT(sizeof(struct acq_frame_header) + sizeof(struct acq_window) <= ACQ_FRAME_MAX,
+             "Acquisition window does not fit a notification");
+
+static nrfx_timer_t acq_timer = NRFX_TIMER_INSTANCE(ACQ_TIMER_INST_IDX);
+static nrfx_timer_t *meas;
+
+// A window as the SAADC fills it. The samples are a naturally aligned
+// array for EasyDMA, the packed struct acq_window only exists in the
+// notification frames built by acq_thread.
+struct acq_buffer {
+    int16_t sample[ACQ_SAMPLES];
+    uint32_t number;
+    uint64_t tick;
+};
+
+// Single producer, single consumer. The SAADC handler hands out buffers
+// in order and moves acq_head when one is full, only the stream thread
+// moves acq_tail. If the thread falls behind the SAADC gets the discard
+// buffer and the window is counted as dropped.
+static struct acq_buffer acq_ring[ACQ_BUFFERS];
+static struct acq_buffer acq_discard;
+static uint32_t acq_req;            // buffers handed to the SAADC
+static atomic_t acq_head;
+static atomic_t acq_tail;
+static atomic_t acq_lost;
+static uint32_t acq_number;
+static K_SEM_DEFINE(acq_ready, 0, 1);
+
+static void acq_buffer_next(void) {
+    struct acq_buffer *w = &acq_discard;
+
+    if (acq_req - atomic_get(&acq_tail) < ACQ_BUFFERS) {
+        w = &acq_ring[acq_req & (ACQ_BUFFERS - 1)];
+        acq_req++;
+    }
+    nrfx_saadc_buffer_set(w->sample, ACQ_SAMPLES);
+}
+
+static void saadc_handler(nrfx_saadc_evt_t const *evt) {
+    switch (evt->type) {
+    case NRFX_SAADC_EVT_BUF_REQ:
+        acq_buffer_next();
+        break;
+    case NRFX_SAADC_EVT_DONE: {
+        struct acq_buffer *w = CONTAINER_OF((int16_t *)evt->data.done.p_buffer,
+                                            struct acq_buffer, sample);
+        uint32_t number = acq_number++;
+
+        if (w == &acq_discard) {
+            atomic_inc(&acq_lost);
+            break;
+        }
+        // The next trigger is a period away, CC3 still holds this one
+        w->number = number;
+        w->tick = timer_extend(nrfx_timer_capture_get(meas, NRF_TIMER_CC_CHANNEL3));
+        atomic_inc(&acq_head);
+        k_sem_give(&acq_ready);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+#define ACQ_SAMPLE_TICKS (STIM_TIMER_FREQ_HZ / ACQ_SAMPLE_RATE_HZ)
+// Ticks from the period start to the last sample
+#define ACQ_WINDOW_END_TICKS \
+    (STIM_US_TO_TICKS(ACQ_DELAY_US) + (uint64_t)(ACQ_SAMPLES + 1) * ACQ_SAMPLE_TICKS)
+
+bool acq_fits_period(uint64_t period_ticks) {
+    return ACQ_WINDOW_END_TICKS < period_ticks;
+}
+
+int acq_init(nrfx_timer_t *stim_timer, nrfx_timer_t *meas_timer) {
+    stim_schedule sched;
+    uint8_t ch_start, ch_sample, ch_stop;
+
+    meas = meas_timer;
+
+    // The window has to be over before the next period starts
+    stim_schedule_get(&sched);
+    if (!acq_fits_period(STIM_US_TO_TICKS(sched.period_us))) {
+        printf("Acquisition window longer than the stimulation period\n");
+        return -EINVAL;
+    }
+
+    nrfx_timer_config_t config = NRFX_TIMER_DEFAULT_CONFIG(STIM_TIMER_FREQ_HZ);
+    config.bit_width = NRF_TIMER_BIT_WIDTH_32;
+    nrfx_err_t status = nrfx_timer_init(&acq_timer, &config, NULL);
+    if (status != NRFX_SUCCESS) {
+        printf("Acquisition timer initialization failed with error: %d\n", status);
+        return -EIO;
+    }
+    nrfx_timer_extended_compare(&acq_timer, NRF_TIMER_CC_CHANNEL0, ACQ_SAMPLE_TICKS,
+                                NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, false);
+
+    nrfx_saadc_channel_t channel = NRFX_SAADC_DEFAULT_CHANNEL_SE(
+        NRF_SAADC_INPUT_AIN0 + CONFIG_STIM_ACQ_AIN, 0);
+    nrfx_saadc_adv_config_t adv_config = NRFX_SAADC_DEFAULT_ADV_CONFIG;
+    // Sampled from DPPI, one buffer per window
+    adv_config.internal_timer_cc = 0;
+    adv_config.start_on_end = true;
+
+    status = nrfx_saadc_init(NRFX_SAADC_DEFAULT_CONFIG_IRQ_PRIORITY);
+    status = status != NRFX_SUCCESS ? status : nrfx_saadc_channel_config(&channel);
+    status = status != NRFX_SUCCESS ? status : nrfx_saadc_offset_calibrate(NULL);
+    status = status != NRFX_SUCCESS ? status :
+             nrfx_saadc_advanced_mode_set(BIT(0), NRF_SAADC_RESOLUTION_12BIT, &adv_config, saadc_handler);
+    if (status != NRFX_SUCCESS) {
+        printf("SAADC initialization failed with error: %d\n", status);
+        return -EIO;
+    }
+
+    if (nrfx_gppi_channel_alloc(&ch_start) != NRFX_SUCCESS ||
+        nrfx_gppi_channel_alloc(&ch_sample) != NRFX_SUCCESS ||
+        nrfx_gppi_channel_alloc(&ch_stop) != NRFX_SUCCESS) {
+        printf("DPPI channel allocation failed\n");
+        return -ENOMEM;
+    }
+
+    nrfx_gppi_event_endpoint_setup(ch_start,
+        nrfx_timer_compare_event_address_get(stim_timer, NRF_TIMER_CC_CHANNEL5));
+    nrfx_gppi_task_endpoint_setup(ch_start, nrfx_timer_task_address_get(&acq_timer, NRF_TIMER_TASK_START));
+    nrfx_gppi_task_endpoint_setup(ch_start,
+        nrfx_timer_capture_task_address_get(meas_timer, NRF_TIMER_CC_CHANNEL3));
+
+    nrfx_gppi_event_endpoint_setup(ch_sample,
+        nrfx_timer_compare_event_address_get(&acq_timer, NRF_TIMER_CC_CHANNEL0));
+    nrfx_gppi_task_endpoint_setup(ch_sample, nrf_saadc_task_address_get(NRF_SAADC, NRF_SAADC_TASK_SAMPLE));
+
+    nrfx_gppi_event_endpoint_setup(ch_stop, nrf_saadc_event_address_get(NRF_SAADC, NRF_SAADC_EVENT_END));
+    nrfx_gppi_task_endpoint_setup(ch_stop, nrfx_timer_task_address_get(&acq_timer, NRF_TIMER_TASK_STOP));
+    nrfx_gppi_task_endpoint_setup(ch_stop, nrfx_timer_task_address_get(&acq_timer, NRF_TIMER_TASK_CLEAR));
+
+    // Two buffers up front, the handler supplies the rest on BUF_REQ
+    acq_buffer_next();
+    acq_buffer_next();
+    status = nrfx_saadc_mode_trigger();
+    if (status != NRFX_SUCCESS) {
+        printf("SAADC start failed with error: %d\n", status);
+        return -EIO;
+    }
+
+    nrfx_timer_compare(stim_timer, NRF_TIMER_CC_CHANNEL5, STIM_US_TO_TICKS(ACQ_DELAY_US), false);
+    nrfx_gppi_channels_enable(BIT(ch_start) | BIT(ch_sample) | BIT(ch_stop));
+    printf("Acquisition: %d samples at %d S/s, %d us after the period start\n",
+           ACQ_SAMPLES, ACQ_SAMPLE_RATE_HZ, ACQ_DELAY_US);
+    return 0;
+}
+
+uint32_t acq_dropped(void) {
+    return atomic_clear(&acq_lost);
+}
+
+// Wire layout of struct acq_window
+static void acq_window_put(uint8_t *out, const struct acq_buffer *buf) {
+    sys_put_le32(buf->number, &out[offsetof(struct acq_window, number)]);
+    sys_put_le64(buf->tick, &out[offsetof(struct acq_window, tick)]);
+    memcpy(&out[offsetof(struct acq_window, sample)], buf->sample, sizeof(buf->sample));
+}
+
+static bool acq_link_up(struct bt_conn *conn) {
+    struct bt_conn_info info;
+
+    return bt_conn_get_info(conn, &info) == 0 && info.state == BT_CONN_STATE_CONNECTED;
+}
+
+// Packs as many windows as the MTU allows into each notification and
+// sends them through the NUS path of the UART bridge. Without a
+// connection the windows are dropped.
+static void acq_thread(void) {
+    static uint8_t frame[ACQ_FRAME_MAX];
+    struct acq_frame_header *hdr = (struct acq_frame_header *)frame;
+    uint8_t *win = &frame[sizeof(*hdr)];
+
+    hdr->sync[0] = ACQ_SYNC0;
+    hdr->sync[1] = ACQ_SYNC1;
+    hdr->samples = ACQ_SAMPLES;
+
+    for (;;) {
+        k_sem_take(&acq_ready, K_FOREVER);
+
+        atomic_val_t tail = atomic_get(&acq_tail);
+        atomic_val_t avail = atomic_get(&acq_head) - tail;
+
+        // One reference per batch, the link may go away while it is sent
+        struct bt_conn *conn = current_conn_get();
+
+        if (!conn) {
+            atomic_add(&acq_lost, avail);
+            atomic_set(&acq_tail, tail + avail);
+            continue;
+        }
+
+        size_t max = (MIN(bt_nus_get_mtu(conn), sizeof(frame)) - sizeof(*hdr)) /
+                     sizeof(struct acq_window);
+        if (max == 0) {
+            // ATT MTU too small for a window
+            bt_conn_unref(conn);
+            atomic_add(&acq_lost, avail);
+            atomic_set(&acq_tail, tail + avail);
+            continue;
+        }
+
+        while (avail > 0) {
+            size_t n = MIN(max, avail);
+
+            for (size_t i = 0; i < n; i++) {
+                acq_window_put(&win[i * sizeof(struct acq_window)],
+                               &acq_ring[(tail + i) & (ACQ_BUFFERS - 1)]);
+            }
+            // The buffers go back to the SAADC before the notification is sent
+            tail += n;
+            avail -= n;
+            atomic_set(&acq_tail, tail);
+
+            hdr->count = n;
+            int err;
+            while ((err = nus_send(frame, sizeof(*hdr) + n * sizeof(struct acq_window),
+                                   K_MSEC(10))) == -ENOMEM ||
+                   err == -EAGAIN) {
+                // Out of buffers, the link is the limit
+                if (!acq_link_up(conn)) {
+                    break;
+                }
+                k_sleep(K_MSEC(1));
+            }
+            if (err) {
+                atomic_add(&acq_lost, n);
+            }
+            avail = atomic_get(&acq_head) - tail;
+        }
+        bt_conn_unref(conn);
+    }
+}
+
+K_THREAD_DEFINE(acq_thread_id, 1024, acq_thread, NULL, NULL, NULL,
+                K_LOWEST_APPLICATION_THREAD_PRIO - 1, 0, 0);
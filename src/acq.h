@@ -0,0 +1,38 @@
+#ifndef ACQ_H
+#define ACQ_H
+
+#include <nrfx_timer.h>
+#include <zephyr/kernel.h>
+
+#define ACQ_TIMER_INST_IDX 2
+#define ACQ_DELAY_US CONFIG_STIM_ACQ_DELAY_US
+#define ACQ_SAMPLES CONFIG_STIM_ACQ_SAMPLES
+#define ACQ_SAMPLE_RATE_HZ CONFIG_STIM_ACQ_SAMPLE_RATE
+#define ACQ_BUFFERS CONFIG_STIM_ACQ_BUFFERS
+
+// One acquisition window, little endian on the wire. number counts every
+// window since boot, a gap means windows were dropped. tick is the
+// timer_timestamp of the trigger, the first sample is taken one sample
+// period later.
+struct acq_window {
+    uint32_t number;
+    uint64_t tick;
+    int16_t sample[ACQ_SAMPLES];
+} __packed;
+
+// Notifications start with this header followed by count windows
+#define ACQ_SYNC0 0xA5
+#define ACQ_SYNC1 0xAD
+struct acq_frame_header {
+    uint8_t sync[2];
+    uint8_t count;
+    uint8_t samples;        // per window
+} __packed;
+
+int acq_init(nrfx_timer_t *stim_timer, nrfx_timer_t *meas_timer);
+// Windows dropped because the stream fell behind, since the last call
+uint32_t acq_dropped(void);
+// Whether a window fits a stimulation period of this length, so that it
+// ends before the next period starts
+bool acq_fits_period(uint64_t period_ticks);
+#endif
@@ -0,0 +1,371 @@
+#include <zephyr/kernel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "nrfx_sim.h"
+#include "timer.h"
+#include "spi.h"
+#include "stats.h"
+#include "evlog.h"
+
+// Host benchmark of the stimulation engine. timer.c and spi.c run unchanged
+// on the emulated TIMER/SPIM/GPIOTE in src/sim, the clock only moves in
+// sim_run(). Every phase prints one line of key=value pairs, and the run
+// ends with STIM_BENCH PASS or STIM_BENCH FAIL.
+
+// Fast schedule for the benchmark, 1 kHz
+static const stim_schedule bench_sched = {
+    .period_us = 1000,
+    .event1_offset_us = 100,
+    .event2_offset_us = 200,
+    .event3_offset_us = 100,
+};
+// 3/4 scaled copy for the reconfiguration phase
+static const stim_schedule bench_sched_alt = {
+    .period_us = 750,
+    .event1_offset_us = 75,
+    .event2_offset_us = 150,
+    .event3_offset_us = 75,
+};
+
+#define US_TO_TICKS(us) ((uint64_t)(us) * (SIM_BASE_FREQUENCY / 1000000))
+
+// Injected latency above the tolerance would count as malformed events
+BUILD_ASSERT(CONFIG_STIM_BENCH_JITTER_TICKS < STIM_US_TO_TICKS(CONFIG_STIM_MALFORMED_TOLERANCE_US),
+             "STIM_BENCH_JITTER_TICKS must stay below STIM_MALFORMED_TOLERANCE_US");
+
+// Pin 1.03 goes high at event 0 and 2 and low at event 1 and 3, so the
+// distance between two edges has to follow the schedule offsets
+static struct {
+    bool enabled;
+    bool seen;
+    uint64_t last;
+    int index;
+    uint32_t gap[4];
+    uint32_t tolerance;
+    uint64_t edges;
+    uint32_t errors;
+} edge;
+
+static uint64_t dac_done;
+static uint64_t dac_errors;
+static uint64_t log_records;
+static uint64_t log_dropped;
+static bool failed;
+
+// Phases run in slices of this many periods, and the log ring is drained
+// after each one the way the log thread would
+#define SLICE_PERIODS 8
+
+static void edge_listener(uint32_t pin, bool value, uint64_t time) {
+    if (pin != STIM_PIN_1_03 || !edge.enabled) {
+        return;
+    }
+    uint32_t gap = time - edge.last;
+
+    if (!edge.seen) {
+        // Sync on event 0, the rising edge that ends the gap after event 3
+        edge.seen = value && edge.last && abs((int32_t)(gap - edge.gap[3])) <= edge.tolerance;
+        edge.index = 0;
+        edge.last = time;
+        return;
+    }
+
+    uint32_t expected = edge.gap[edge.index];
+    if (abs((int32_t)(gap - expected)) > edge.tolerance || value != (edge.index % 2 == 1)) {
+        edge.errors++;
+    }
+    edge.edges++;
+    edge.last = time;
+    edge.index = (edge.index + 1) % 4;
+}
+
+static void edge_check_start(const stim_schedule *sched, uint32_t tolerance) {
+    edge.gap[0] = US_TO_TICKS(sched->event1_offset_us);
+    edge.gap[1] = US_TO_TICKS(sched->event2_offset_us);
+    edge.gap[2] = US_TO_TICKS(sched->event3_offset_us);
+    edge.gap[3] = US_TO_TICKS(sched->period_us - sched->event1_offset_us -
+                              sched->event2_offset_us - sched->event3_offset_us);
+    edge.tolerance = tolerance;
+    edge.edges = 0;
+    edge.errors = 0;
+    edge.seen = false;
+    edge.last = 0;
+    edge.enabled = true;
+}
+
+static void dac_done_cb(enum dac_id dac, int result) {
+    dac_done++;
+    if (result) {
+        dac_errors++;
+    }
+}
+
+static void log_drain(void) {
+#if defined(CONFIG_STIM_EVLOG)
+    struct evlog_record rec;
+
+    while (evlog_get(&rec)) {
+        log_records++;
+    }
+    log_dropped += evlog_dropped();
+#endif
+}
+
+static void check(bool ok, const char *phase, const char *what) {
+    if (!ok) {
+        printf("bench,phase=%s,fail=%s\n", phase, what);
+        failed = true;
+    }
+}
+
+static uint32_t overrun_total(const stats_snapshot *snap) {
+    uint32_t total = 0;
+
+    for (int i = 0; i < STATS_EVENTS; i++) {
+        total += snap->overrun[i];
+    }
+    return total;
+}
+
+static void report(const char *phase, uint32_t periods, uint64_t host_ns) {
+    stats_snapshot snap;
+
+    stats_get(&snap);
+    printf("bench,phase=%s,periods=%u,host_ms=%llu,missed=%u,malformed=%u,reconfig=%u,"
+           "overruns=%u,edges=%llu,edge_errors=%u,dac_done=%llu,dac_errors=%llu\n",
+           phase, periods, (unsigned long long)(host_ns / 1000000),
+           snap.counter[STATS_MISSED], snap.counter[STATS_MALFORMED],
+           snap.counter[STATS_RECONFIG], overrun_total(&snap), (unsigned long long)edge.edges,
+           edge.errors, (unsigned long long)dac_done, (unsigned long long)dac_errors);
+    if (IS_ENABLED(CONFIG_STIM_EVLOG)) {
+        printf("bench,phase=%s,log_records=%llu,log_dropped=%llu\n", phase,
+               (unsigned long long)log_records, (unsigned long long)log_dropped);
+    }
+    for (int i = 0; i < STATS_EVENTS; i++) {
+        if (snap.event[i].count == 0) {
+            continue;
+        }
+        printf("bench,phase=%s,event=%d,n=%u,err_mean=%u,err_p50=%u,err_p99=%u,"
+               "err_p999=%u,err_max=%u\n",
+               phase, i, snap.event[i].count, snap.event[i].mean, snap.event[i].p50,
+               snap.event[i].p99, snap.event[i].p999, snap.event[i].max);
+    }
+    if (snap.latency.count) {
+        printf("bench,phase=%s,irq_latency,n=%u,mean=%u,p50=%u,p99=%u,p999=%u,max=%u\n",
+               phase, snap.latency.count, snap.latency.mean, snap.latency.p50,
+               snap.latency.p99, snap.latency.p999, snap.latency.max);
+    }
+    if (snap.dead_time.count) {
+        printf("bench,phase=%s,dead_time,n=%u,mean=%u,p50=%u,p99=%u,p999=%u,max=%u\n",
+               phase, snap.dead_time.count, snap.dead_time.mean, snap.dead_time.p50,
+               snap.dead_time.p99, snap.dead_time.p999, snap.dead_time.max);
+    }
+    for (int ch = 0; ch < SIM_TIMER_CC_COUNT; ch++) {
+        struct sim_isr_cost cost;
+
+        sim_isr_cost_get(ch, &cost);
+        if (cost.calls == 0) {
+            continue;
+        }
+        printf("bench,phase=%s,compare=%d,isr_calls=%llu,isr_ns_mean=%llu,isr_ns_max=%llu\n",
+               phase, ch, (unsigned long long)cost.calls,
+               (unsigned long long)(cost.total_ns / cost.calls),
+               (unsigned long long)cost.max_ns);
+    }
+}
+
+static void phase_begin(void) {
+    stats_snapshot discard;
+
+    edge.edges = 0;
+    edge.errors = 0;
+    stats_reset();
+    stats_get_delta(&discard);
+    sim_isr_cost_reset();
+    dac_done = 0;
+    dac_errors = 0;
+    log_drain();
+    log_records = 0;
+    log_dropped = 0;
+}
+
+// Fixed schedule, events have to land on their compare values exactly
+// (jitter 0) or within the injected ISR latency
+static void run_fixed(const char *phase, uint32_t periods, uint32_t jitter) {
+    uint64_t period = US_TO_TICKS(bench_sched.period_us);
+    uint64_t t0 = sim_host_ns();
+    stats_snapshot snap;
+
+    phase_begin();
+    sim_latency_set(jitter);
+    edge_check_start(&bench_sched, jitter);
+    for (uint32_t done = 0; done < periods; done += SLICE_PERIODS) {
+        sim_run(sim_now() + MIN(SLICE_PERIODS, periods - done) * period);
+        log_drain();
+    }
+    edge.enabled = false;
+    report(phase, periods, sim_host_ns() - t0);
+
+    stats_get(&snap);
+    check(snap.counter[STATS_MISSED] == 0, phase, "missed");
+    check(snap.counter[STATS_MALFORMED] == 0, phase, "malformed");
+    check(overrun_total(&snap) == 0, phase, "overruns");
+    check(edge.errors == 0, phase, "edges");
+    check(edge.edges + 8 >= (uint64_t)periods * 4, phase, "edge_count");
+    check(log_dropped == 0, phase, "log_dropped");
+    check(dac_errors == 0 && dac_done + 2 >= (uint64_t)periods * 2, phase, "dac");
+    for (int i = 0; i < STATS_EVENTS; i++) {
+        check(snap.event[i].max <= jitter, phase, "error_max");
+    }
+    check(snap.latency.max <= jitter, phase, "latency_max");
+
+    // The phase began with a delta as well, so the first one covers the
+    // same events as the window and the second one none
+    stats_snapshot delta;
+
+    stats_get_delta(&delta);
+    check(delta.event[0].count == snap.event[0].count, phase, "delta");
+    stats_get_delta(&delta);
+    check(delta.event[0].count == 0 && delta.latency.count == 0, phase, "delta_reset");
+}
+
+#if defined(CONFIG_STIM_EVLOG)
+// Same as the steady phase with a log record for every event and DAC
+// transfer, the ISR cost against the steady phase is the cost of logging
+static void run_logged(const char *phase, uint32_t periods) {
+    evlog_verbose_set(true);
+    run_fixed(phase, periods, 0);
+    evlog_verbose_set(false);
+    check(log_records + 12 >= (uint64_t)periods * 6, phase, "log_records");
+}
+#endif
+
+// A new schedule is staged once per step. A step is longer than the
+// longest period plus the COMPARE3 to COMPARE0 gap, so every request is
+// swapped in exactly once.
+static void run_reconfig(const char *phase, uint32_t periods) {
+    uint64_t step = US_TO_TICKS(bench_sched.period_us + bench_sched_alt.period_us);
+    uint64_t t0 = sim_host_ns();
+    stats_snapshot snap;
+    bool flip = true;
+
+    phase_begin();
+    sim_latency_set(0);
+    for (uint32_t i = 0; i < periods; i++) {
+        const stim_schedule *next = flip ? &bench_sched_alt : &bench_sched;
+
+        stim_schedule_set(next);
+        sim_run(sim_now() + step);
+        flip = !flip;
+    }
+    report(phase, periods, sim_host_ns() - t0);
+
+    stats_get(&snap);
+    check(snap.counter[STATS_MISSED] == 0, phase, "missed");
+    check(snap.counter[STATS_MALFORMED] == 0, phase, "malformed");
+    check(snap.counter[STATS_RECONFIG] == periods, phase, "reconfig");
+}
+
+#if defined(CONFIG_STIM_TIMELINE)
+#define DENSE_GAP_US 60
+
+// Timeline filling all entries, 60 us apart. Even entries raise 1.00
+// and send a DAC frame, alternating between the DACs, odd ones lower it.
+static void run_dense(const char *phase, uint32_t periods, uint32_t jitter) {
+    static stim_timeline timeline;
+    uint32_t period_us = (STIM_MAX_ENTRIES + 1) * DENSE_GAP_US;
+    uint64_t period = US_TO_TICKS(period_us);
+    uint64_t t0 = sim_host_ns();
+    stats_snapshot snap;
+
+    timeline.period_us = period_us;
+    timeline.count = STIM_MAX_ENTRIES;
+    for (uint32_t i = 0; i < STIM_MAX_ENTRIES; i++) {
+        bool on = i % 2 == 0;
+
+        timeline.entry[i] = (stim_entry) {
+            .offset_us = i * DENSE_GAP_US,
+            .pin_set = on ? STIM_PIN_BIT(STIM_PIN_1_00) : 0,
+            .pin_clear = on ? 0 : STIM_PIN_BIT(STIM_PIN_1_00),
+            .dac = on ? (i / 2) % DAC_COUNT : STIM_DAC_NONE,
+            .dac_word = 0x1000 + i,
+        };
+    }
+    check(stim_timeline_set(&timeline) == 0, phase, "timeline_set");
+
+    // Let the swap happen, then measure whole periods of the timeline
+    sim_run(sim_now() + 2 * US_TO_TICKS(STIM_TIMER));
+    phase_begin();
+    sim_latency_set(jitter);
+    sim_run(sim_now() + periods * period);
+    report(phase, periods, sim_host_ns() - t0);
+
+    stats_get(&snap);
+    check(snap.counter[STATS_MISSED] == 0, phase, "missed");
+    check(snap.counter[STATS_MALFORMED] == 0, phase, "malformed");
+    check(dac_errors == 0 && dac_done + 2 >= (uint64_t)periods * STIM_MAX_ENTRIES / 2, phase, "dac");
+    for (int i = 0; i < STIM_MAX_ENTRIES; i++) {
+        check(snap.event[i].count + 1 >= periods, phase, "entry_count");
+        check(snap.event[i].max <= jitter, phase, "error_max");
+    }
+}
+#endif
+
+// ISR latency beyond the shortest event gap. Every overrun has to be
+// counted, and after it the engine has to come back cleanly with the
+// STIM_OVERRUN policy that is configured.
+#define OVERRUN_LATENCY_US 150
+
+static void run_overrun(const char *phase, uint32_t periods) {
+    uint64_t period = US_TO_TICKS(bench_sched.period_us);
+    uint64_t t0;
+    stats_snapshot snap;
+
+    stim_schedule_set(&bench_sched);
+    sim_run(sim_now() + 4 * period);
+    t0 = sim_host_ns();
+    phase_begin();
+    sim_latency_set(US_TO_TICKS(OVERRUN_LATENCY_US));
+    sim_run(sim_now() + periods * period);
+    report(phase, periods, sim_host_ns() - t0);
+
+    stats_get(&snap);
+    check(overrun_total(&snap) > 0, phase, "overrun_count");
+#if defined(CONFIG_STIM_TIMELINE)
+    check(snap.counter[STATS_MISSED] == overrun_total(&snap), phase, "missed");
+#endif
+
+    // A new schedule restarts the timer after an abort
+    sim_latency_set(0);
+    stim_schedule_set(&bench_sched);
+    sim_run(sim_now() + 4 * period);
+}
+
+int main(void) {
+    uint32_t periods = CONFIG_STIM_BENCH_PERIODS;
+
+    sim_gpio_listener_set(edge_listener);
+    spi_init();
+    spi_dac_set_callback(dac_done_cb);
+    measurement_timer_init();
+    timer_init();
+
+    // The power-on schedule finishes its first period before the swap
+    stim_schedule_set(&bench_sched);
+    sim_run(US_TO_TICKS(2 * STIM_TIMER));
+
+    run_fixed("steady", periods, 0);
+#if defined(CONFIG_STIM_EVLOG)
+    run_logged("logged", periods);
+#endif
+    run_fixed("jitter", periods, CONFIG_STIM_BENCH_JITTER_TICKS);
+    run_reconfig("reconfig", periods / 10);
+#if defined(CONFIG_STIM_TIMELINE)
+    run_dense("dense", periods / 10, CONFIG_STIM_BENCH_JITTER_TICKS);
+#endif
+    run_overrun("overrun", periods / 10);
+    run_fixed("recovered", periods / 10, 0);
+
+    printf("STIM_BENCH %s\n", failed ? "FAIL" : "PASS");
+    return 0;
+}
@@ -0,0 +1,276 @@
+#include <nrfx_timer.h>
+#include <nrfx_gpiote.h>
+#include <helpers/nrfx_gppi.h>
+#include <zephyr/kernel.h>
+#include "burst.h"
+#include "timer.h"
+#include "spi.h"
+#include "stats.h"
+
+// Pulse train engine.
+//
+// The stimulation timer runs one cycle per train, the counter is cleared
+// at the end of each train:
+//
+//   stim COMPARE2     -> ch_start -> pulse timer START        (after the gap)
+//   pulse COMPARE0    -> ch_pulse -> SET 1.03, CLR CS, SPIM START
+//   pulse COMPARE1    -> ch_off   -> CLR 1.03, SET 1.00, SET 1.01
+//   stim COMPARE0     -> ch_stop  -> pulse timer STOP and CLEAR,
+//                                    DIS of the group holding ch_start
+//
+// The pulse timer clears itself on COMPARE0, one pulse period. The train
+// end is placed just after the falling edge of the last pulse, so the
+// pulses are counted by time on the shared 16 MHz clock and no COUNTER
+// instance is needed. The SPIM walks the envelope table with TX
+// post-increment, SPIM END releases CS (see spi.c). The only CPU work is
+// the COMPARE0 interrupt at the end of a train, which rewinds the table
+// and applies a new burst. ch_start is turned off in hardware at the
+// train end and only back on once the table is rewound, so an interrupt
+// that comes late costs a train instead of sending the frames past the
+// end of the table.
+
+static nrfx_timer_t pulse_timer = NRFX_TIMER_INSTANCE(BURST_TIMER_INST_IDX);
+static const nrfx_gpiote_t gpiote = NRFX_GPIOTE_INSTANCE(GPIOTE_INST_IDX);
+static nrfx_timer_t *stim;
+
+// Burst in timer ticks with its table. burst_set fills the back plan and
+// the train-done interrupt swaps it in, so a table is never rewritten
+// while the SPIM reads it.
+struct burst_plan {
+    uint32_t start;         // stim CC2
+    uint32_t end;           // stim CC0
+    uint32_t period;        // pulse CC0
+    uint32_t width;         // pulse CC1
+    uint8_t dac;
+    uint8_t frames[BURST_MAX_PULSES][DAC_TX_LEN];
+};
+
+static struct burst_plan plans[2];
+static int plan_front;
+static atomic_t plan_pending;
+static atomic_t trains_on;
+static stim_burst burst_us;
+static uint8_t ch_start, ch_pulse, ch_off, ch_stop;
+static nrfx_gppi_channel_group_t start_group;
+
+// Envelope value of pulse i, linear ramps at both ends of the train
+static uint16_t envelope(const stim_burst *burst, uint32_t i) {
+    uint32_t step = MIN(i + 1, burst->pulses - i);
+
+    if (step > burst->ramp_pulses) {
+        return burst->amplitude;
+    }
+    return (uint32_t)burst->amplitude * step / (burst->ramp_pulses + 1);
+}
+
+static int burst_to_plan(const stim_burst *burst, struct burst_plan *plan) {
+    if (burst->pulse_hz == 0 || burst->pulse_hz > STIM_TIMER_FREQ_HZ ||
+        burst->pulses == 0 || burst->pulses > BURST_MAX_PULSES ||
+        burst->width_us == 0 || 2 * burst->ramp_pulses > burst->pulses ||
+        burst->gap_us < BURST_MIN_GAP_US || burst->dac >= DAC_COUNT) {
+        return -EINVAL;
+    }
+
+    uint32_t period = STIM_TIMER_FREQ_HZ / burst->pulse_hz;
+    uint64_t width = STIM_US_TO_TICKS(burst->width_us);
+    uint64_t start = STIM_US_TO_TICKS(burst->gap_us);
+    // One microsecond after the last falling edge, before the next pulse
+    uint64_t end = start + (uint64_t)burst->pulses * period + width + STIM_US_TO_TICKS(1);
+
+    if (width + STIM_US_TO_TICKS(BURST_MIN_OFF_US) > period || end > UINT32_MAX) {
+        return -EINVAL;
+    }
+
+    plan->start = start;
+    plan->end = end;
+    plan->period = period;
+    plan->width = width;
+    plan->dac = burst->dac;
+    for (uint32_t i = 0; i < burst->pulses; i++) {
+        uint16_t level = envelope(burst, i);
+
+        dac_frame(plan->dac, level, plan->frames[i]);
+    }
+    return 0;
+}
+
+// Both timers are idle at the CC values written here: the pulse timer is
+// stopped and the stim timer has just been cleared, start and end are at
+// least BURST_MIN_GAP_US ahead
+static void plan_apply(const struct burst_plan *plan, const struct burst_plan *prev) {
+    nrf_timer_cc_set(stim->p_reg, NRF_TIMER_CC_CHANNEL2, plan->start);
+    nrf_timer_cc_set(stim->p_reg, NRF_TIMER_CC_CHANNEL0, plan->end);
+    nrf_timer_cc_set(pulse_timer.p_reg, NRF_TIMER_CC_CHANNEL0, plan->period);
+    nrf_timer_cc_set(pulse_timer.p_reg, NRF_TIMER_CC_CHANNEL1, plan->width);
+
+    if (prev) {
+        nrfx_gppi_task_endpoint_clear(ch_pulse, spi_dac_cs_clr_task_address(prev->dac));
+    }
+    nrfx_gppi_task_endpoint_setup(ch_pulse, spi_dac_cs_clr_task_address(plan->dac));
+}
+
+static int gpiote_out_init(uint32_t pin) {
+    uint8_t ch;
+    nrfx_err_t err = nrfx_gpiote_channel_alloc(&gpiote, &ch);
+    if (err != NRFX_SUCCESS) {
+        printf("GPIOTE channel allocation failed for pin %d\n", pin);
+        return -ENOMEM;
+    }
+
+    nrfx_gpiote_output_config_t out_config = NRFX_GPIOTE_DEFAULT_OUTPUT_CONFIG;
+    nrfx_gpiote_task_config_t task_config = {
+        .task_ch = ch,
+        .polarity = NRF_GPIOTE_POLARITY_TOGGLE,
+        .init_val = NRF_GPIOTE_INITIAL_VALUE_LOW,
+    };
+    err = nrfx_gpiote_output_configure(&gpiote, pin, &out_config, &task_config);
+    if (err != NRFX_SUCCESS) {
+        printf("GPIOTE output configuration failed for pin %d\n", pin);
+        return -EIO;
+    }
+    nrfx_gpiote_out_task_enable(&gpiote, pin);
+    return 0;
+}
+
+int burst_init(nrfx_timer_t *stim_timer) {
+    stim = stim_timer;
+
+    nrfx_timer_config_t config = NRFX_TIMER_DEFAULT_CONFIG(STIM_TIMER_FREQ_HZ);
+    config.bit_width = NRF_TIMER_BIT_WIDTH_32;
+    nrfx_err_t status = nrfx_timer_init(&pulse_timer, &config, NULL);
+    if (status != NRFX_SUCCESS) {
+        printf("Burst timer initialization failed with error: %d\n", status);
+        return -EIO;
+    }
+
+    // Switch pins idle low, as in the sequencer
+    if (!nrfx_gpiote_init_check(&gpiote)) {
+        nrfx_gpiote_init(&gpiote, 0);
+    }
+    int err = gpiote_out_init(STIM_PIN_1_03);
+    err = err ? err : gpiote_out_init(STIM_PIN_1_00);
+    err = err ? err : gpiote_out_init(STIM_PIN_1_01);
+    if (err) {
+        return err;
+    }
+
+    if (nrfx_gppi_channel_alloc(&ch_start) != NRFX_SUCCESS ||
+        nrfx_gppi_channel_alloc(&ch_pulse) != NRFX_SUCCESS ||
+        nrfx_gppi_channel_alloc(&ch_off) != NRFX_SUCCESS ||
+        nrfx_gppi_channel_alloc(&ch_stop) != NRFX_SUCCESS ||
+        nrfx_gppi_group_alloc(&start_group) != NRFX_SUCCESS) {
+        printf("DPPI channel allocation failed\n");
+        return -ENOMEM;
+    }
+    nrfx_gppi_channels_include_in_group(BIT(ch_start), start_group);
+
+    nrfx_gppi_event_endpoint_setup(ch_start,
+        nrfx_timer_compare_event_address_get(stim, NRF_TIMER_CC_CHANNEL2));
+    nrfx_gppi_task_endpoint_setup(ch_start, nrfx_timer_task_address_get(&pulse_timer, NRF_TIMER_TASK_START));
+
+    nrfx_gppi_event_endpoint_setup(ch_pulse,
+        nrfx_timer_compare_event_address_get(&pulse_timer, NRF_TIMER_CC_CHANNEL0));
+    nrfx_gppi_task_endpoint_setup(ch_pulse, nrfx_gpiote_set_task_address_get(&gpiote, STIM_PIN_1_03));
+    nrfx_gppi_task_endpoint_setup(ch_pulse, spi_start_task_address());
+
+    nrfx_gppi_event_endpoint_setup(ch_off,
+        nrfx_timer_compare_event_address_get(&pulse_timer, NRF_TIMER_CC_CHANNEL1));
+    nrfx_gppi_task_endpoint_setup(ch_off, nrfx_gpiote_clr_task_address_get(&gpiote, STIM_PIN_1_03));
+    nrfx_gppi_task_endpoint_setup(ch_off, nrfx_gpiote_set_task_address_get(&gpiote, STIM_PIN_1_00));
+    nrfx_gppi_task_endpoint_setup(ch_off, nrfx_gpiote_set_task_address_get(&gpiote, STIM_PIN_1_01));
+
+    nrfx_gppi_event_endpoint_setup(ch_stop,
+        nrfx_timer_compare_event_address_get(stim, NRF_TIMER_CC_CHANNEL0));
+    nrfx_gppi_task_endpoint_setup(ch_stop, nrfx_timer_task_address_get(&pulse_timer, NRF_TIMER_TASK_STOP));
+    nrfx_gppi_task_endpoint_setup(ch_stop, nrfx_timer_task_address_get(&pulse_timer, NRF_TIMER_TASK_CLEAR));
+    nrfx_gppi_task_endpoint_setup(ch_stop, nrfx_gppi_group_disable_task_address(start_group));
+
+    burst_us = (stim_burst) {
+        .pulse_hz = BURST_PULSE_HZ,
+        .width_us = BURST_WIDTH_US,
+        .pulses = BURST_PULSES,
+        .gap_us = BURST_GAP_US,
+        .amplitude = BURST_AMPLITUDE,
+        .ramp_pulses = BURST_RAMP_PULSES,
+        .dac = DAC1,
+    };
+    if (burst_to_plan(&burst_us, &plans[0]) != 0) {
+        printf("Invalid default burst\n");
+        return -EINVAL;
+    }
+
+    // The stim timer is not running yet, the first train starts after the gap
+    nrfx_timer_extended_compare(&pulse_timer, NRF_TIMER_CC_CHANNEL0, plans[0].period,
+                                NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, false);
+    nrfx_timer_extended_compare(&pulse_timer, NRF_TIMER_CC_CHANNEL1, plans[0].width, 0, false);
+    nrfx_timer_extended_compare(stim, NRF_TIMER_CC_CHANNEL0, plans[0].end,
+                                NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, true);
+    nrfx_timer_extended_compare(stim, NRF_TIMER_CC_CHANNEL2, plans[0].start, 0, false);
+    plan_apply(&plans[0], NULL);
+    spi_dac_list_arm(plans[0].frames[0]);
+
+    atomic_set(&trains_on, 1);
+    nrfx_gppi_channels_enable(BIT(ch_pulse) | BIT(ch_off) | BIT(ch_stop));
+    nrfx_gppi_group_enable(start_group);
+    printf("Burst engine: %lu Hz, %lu pulses, max %d pulses per train\n",
+           burst_us.pulse_hz, burst_us.pulses, BURST_MAX_PULSES);
+    return 0;
+}
+
+int burst_set(const stim_burst *burst) {
+    // The previous burst has not been picked up by a train end yet
+    if (atomic_test_bit(&plan_pending, 0)) {
+        return -EBUSY;
+    }
+
+    int err = burst_to_plan(burst, &plans[plan_front ^ 1]);
+    if (err) {
+        return err;
+    }
+
+    unsigned int key = irq_lock();
+    burst_us = *burst;
+    irq_unlock(key);
+
+    atomic_set(&trains_on, 1);
+    atomic_set_bit(&plan_pending, 0);
+    return 0;
+}
+
+void burst_get(stim_burst *burst) {
+    unsigned int key = irq_lock();
+    *burst = burst_us;
+    irq_unlock(key);
+}
+
+void burst_stop(void) {
+    atomic_set(&trains_on, 0);
+}
+
+// Stim timer COMPARE0, the pulse timer has already been stopped, the stim
+// timer cleared and ch_start turned off in hardware
+void burst_train_done(void) {
+    // The compare matched at the clear, so the counter is the IRQ latency
+    stats_record(STATS_LATENCY, nrfx_timer_capture(stim, NRF_TIMER_CC_CHANNEL4));
+
+    if (atomic_test_and_clear_bit(&plan_pending, 0)) {
+        const struct burst_plan *prev = &plans[plan_front];
+
+        plan_front ^= 1;
+        plan_apply(&plans[plan_front], prev);
+        stats_count(STATS_RECONFIG, 1);
+    }
+    spi_dac_list_arm(plans[plan_front].frames[0]);
+
+    if (atomic_get(&trains_on)) {
+        // Too late for this train's start, the group stays off, the train
+        // is skipped and the table stays rewound for the next one. The
+        // count is taken before the enable, so a start that comes right
+        // after it runs its train and is never counted as missed.
+        if (nrfx_timer_capture(stim, NRF_TIMER_CC_CHANNEL4) >= plans[plan_front].start) {
+            stats_count(STATS_MISSED, 1);
+        } else {
+            nrfx_gppi_group_enable(start_group);
+        }
+    }
+}
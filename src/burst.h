@@ -0,0 +1,46 @@
+#ifndef BURST_H
+#define BURST_H
+
+#include <nrfx_timer.h>
+#include <zephyr/kernel.h>
+#include "spi.h"
+
+#define BURST_TIMER_INST_IDX 2
+#define BURST_MAX_PULSES CONFIG_STIM_BURST_MAX_PULSES
+// Shortest gap between two trains, the train-done interrupt runs in it
+#define BURST_MIN_GAP_US 100
+// Shortest low time of 1.03 between two pulses, covers the DAC frame
+#define BURST_MIN_OFF_US 5
+
+// Power-on burst, changed at runtime with burst_set
+#define BURST_PULSE_HZ 1000
+#define BURST_WIDTH_US 200
+#define BURST_PULSES 50
+#define BURST_GAP_US 950000
+#define BURST_AMPLITUDE 0x4000
+#define BURST_RAMP_PULSES 10
+
+// A train is pulses pulse periods long and its first pulse comes one pulse
+// period after the train starts. 1.03 is high for width_us of every pulse
+// and the DAC gets the envelope value of the pulse on the rising edge. The
+// envelope ramps from 0 to amplitude over the first ramp_pulses pulses and
+// back down over the last ramp_pulses pulses.
+typedef struct {
+    uint32_t pulse_hz;
+    uint32_t width_us;
+    uint32_t pulses;
+    uint32_t gap_us;        // from the end of a train to the start of the next
+    uint16_t amplitude;     // DAC code of the plateau
+    uint16_t ramp_pulses;
+    uint8_t dac;            // enum dac_id
+} stim_burst;
+
+int burst_init(nrfx_timer_t *stim_timer);
+// Applied when the running train ends, the first new train starts gap_us
+// later. Restarts the trains if they were stopped.
+int burst_set(const stim_burst *burst);
+void burst_get(stim_burst *burst);
+// No new trains after the running one
+void burst_stop(void);
+void burst_train_done(void);
+#endif
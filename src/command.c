@@ -0,0 +1,225 @@
+#include <zephyr/kernel.h>
+#include <bluetooth/services/nus.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "command.h"
+#include "BLE.h"
+#include "timer.h"
+#include "stats.h"
+#include "evlog.h"
+#include "spi.h"
+#if defined(CONFIG_STIM_BURST)
+#include "burst.h"
+#endif
+
+// Text commands over NUS, one per write, answered with a single line:
+//
+//   !sched <period_us> <event1_us> <event2_us> <event3_us>
+//                      stage a new schedule, applied at the next period
+//   !sched             report the current schedule
+//   !stats             timing error percentiles per event or timeline entry,
+//                      of the timer IRQ latency and of the dead time, in
+//                      timer ticks, the overruns per event or entry, and
+//                      the timer wakeups and active time of the periods
+//   !stats reset       start a new experiment window
+//   !log on|off        log every stimulation event and DAC transfer
+//   !dac <code1> <code2>
+//                      set both DACs, their outputs change together, not
+//                      with STIM_ZLI or the DPPI engines
+//   !burst <pulse_hz> <width_us> <pulses> <gap_us> <amplitude> <ramp> [dac]
+//                      stage a new pulse train, applied at the end of the
+//                      running train, dac is 1 (default) or 2
+//   !burst             report the current pulse train
+//   !burst off         stop after the running train
+
+// Replies share the NUS pipeline credit and the bench tracking with the
+// bridge. Commands run in the Bluetooth RX thread, so a reply that finds
+// the pipeline full is dropped rather than waited for. The sample serves
+// one connection, which is the one that sent the command.
+static void reply(struct bt_conn *conn, const char *fmt, ...) {
+    char buf[COMMAND_MAX_LEN];
+    va_list args;
+
+    ARG_UNUSED(conn);
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    nus_send((const uint8_t *)buf, MIN(len, sizeof(buf) - 1), K_NO_WAIT);
+}
+
+static int parse_u32(const char *arg, uint32_t *value) {
+    char *end;
+
+    if (!arg) {
+        return -EINVAL;
+    }
+    *value = strtoul(arg, &end, 0);
+    return *end == '\0' ? 0 : -EINVAL;
+}
+
+static void cmd_sched(struct bt_conn *conn, char **save) {
+    stim_schedule sched;
+    char *arg = strtok_r(NULL, " ", save);
+
+    if (!arg) {
+        stim_schedule_get(&sched);
+        reply(conn, "sched %u %u %u %u\r\n", sched.period_us, sched.event1_offset_us,
+              sched.event2_offset_us, sched.event3_offset_us);
+        return;
+    }
+
+    int err = parse_u32(arg, &sched.period_us);
+    err = err ? err : parse_u32(strtok_r(NULL, " ", save), &sched.event1_offset_us);
+    err = err ? err : parse_u32(strtok_r(NULL, " ", save), &sched.event2_offset_us);
+    err = err ? err : parse_u32(strtok_r(NULL, " ", save), &sched.event3_offset_us);
+    err = err ? err : stim_schedule_set(&sched);
+    reply(conn, err ? "ERR %d\r\n" : "OK\r\n", err);
+}
+
+static void cmd_stats(struct bt_conn *conn, char **save) {
+    char *arg = strtok_r(NULL, " ", save);
+    stats_snapshot snap;
+
+    if (arg && strcmp(arg, "reset") == 0) {
+        stats_reset();
+        reply(conn, "OK\r\n");
+        return;
+    }
+
+    stats_get(&snap);
+    for (int i = 0; i < STATS_EVENTS; i++) {
+        if (snap.event[i].count == 0) {
+            continue;
+        }
+        reply(conn, "e%d n=%u p50=%u p99=%u p999=%u max=%u\r\n", i, snap.event[i].count,
+              snap.event[i].p50, snap.event[i].p99, snap.event[i].p999, snap.event[i].max);
+    }
+    if (snap.latency.count) {
+        reply(conn, "lat n=%u p50=%u p99=%u p999=%u max=%u\r\n", snap.latency.count,
+              snap.latency.p50, snap.latency.p99, snap.latency.p999, snap.latency.max);
+    }
+    if (snap.dead_time.count) {
+        reply(conn, "dead n=%u p50=%u p99=%u p999=%u max=%u\r\n", snap.dead_time.count,
+              snap.dead_time.p50, snap.dead_time.p99, snap.dead_time.p999, snap.dead_time.max);
+    }
+    reply(conn, "missed=%u malformed=%u reconfig=%u\r\n", snap.counter[STATS_MISSED],
+          snap.counter[STATS_MALFORMED], snap.counter[STATS_RECONFIG]);
+    for (int i = 0; i < STATS_EVENTS; i++) {
+        if (snap.overrun[i]) {
+            reply(conn, "e%d overrun=%u\r\n", i, snap.overrun[i]);
+        }
+    }
+    if (snap.counter[STATS_PERIODS]) {
+        reply(conn, "periods=%u wakeups=%u active_us=%u\r\n", snap.counter[STATS_PERIODS],
+              snap.counter[STATS_WAKEUPS], snap.counter[STATS_ACTIVE_US]);
+    }
+}
+
+static void cmd_dac(struct bt_conn *conn, char **save) {
+    uint16_t code[DAC_COUNT];
+    uint32_t value;
+    int err = 0;
+
+    for (int i = 0; i < DAC_COUNT && !err; i++) {
+        err = parse_u32(strtok_r(NULL, " ", save), &value);
+        if (!err && value > UINT16_MAX) {
+            err = -EINVAL;
+        }
+        code[i] = value;
+    }
+    err = err ? err : spi_dac_write_all(code);
+    reply(conn, err ? "ERR %d\r\n" : "OK\r\n", err);
+}
+
+#if defined(CONFIG_STIM_EVLOG)
+static void cmd_log(struct bt_conn *conn, char **save) {
+    char *arg = strtok_r(NULL, " ", save);
+
+    if (!arg || (strcmp(arg, "on") != 0 && strcmp(arg, "off") != 0)) {
+        reply(conn, "ERR %d\r\n", -EINVAL);
+        return;
+    }
+    evlog_verbose_set(strcmp(arg, "on") == 0);
+    reply(conn, "OK\r\n");
+}
+#endif
+
+#if defined(CONFIG_STIM_BURST)
+static void cmd_burst(struct bt_conn *conn, char **save) {
+    stim_burst burst;
+    uint32_t amplitude, ramp, dac = 1;
+    char *arg = strtok_r(NULL, " ", save);
+
+    if (!arg) {
+        burst_get(&burst);
+        reply(conn, "burst %u %u %u %u %u %u %u\r\n", burst.pulse_hz, burst.width_us,
+              burst.pulses, burst.gap_us, burst.amplitude, burst.ramp_pulses, burst.dac + 1);
+        return;
+    }
+    if (strcmp(arg, "off") == 0) {
+        burst_stop();
+        reply(conn, "OK\r\n");
+        return;
+    }
+
+    int err = parse_u32(arg, &burst.pulse_hz);
+    err = err ? err : parse_u32(strtok_r(NULL, " ", save), &burst.width_us);
+    err = err ? err : parse_u32(strtok_r(NULL, " ", save), &burst.pulses);
+    err = err ? err : parse_u32(strtok_r(NULL, " ", save), &burst.gap_us);
+    err = err ? err : parse_u32(strtok_r(NULL, " ", save), &amplitude);
+    err = err ? err : parse_u32(strtok_r(NULL, " ", save), &ramp);
+    arg = strtok_r(NULL, " ", save);
+    if (!err && arg) {
+        err = parse_u32(arg, &dac);
+    }
+    if (!err && (amplitude > UINT16_MAX || ramp > UINT16_MAX || dac < 1 || dac > DAC_COUNT)) {
+        err = -EINVAL;
+    }
+    if (!err) {
+        burst.amplitude = amplitude;
+        burst.ramp_pulses = ramp;
+        burst.dac = dac - 1;
+        err = burst_set(&burst);
+    }
+    reply(conn, err ? "ERR %d\r\n" : "OK\r\n", err);
+}
+#endif
+
+bool command_handle(struct bt_conn *conn, const uint8_t *data, uint16_t len) {
+    char line[COMMAND_MAX_LEN];
+    char *save;
+
+    if (len == 0 || data[0] != COMMAND_PREFIX) {
+        return false;
+    }
+    if (len >= sizeof(line)) {
+        reply(conn, "ERR %d\r\n", -E2BIG);
+        return true;
+    }
+
+    memcpy(line, &data[1], len - 1);
+    line[len - 1] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+
+    char *cmd = strtok_r(line, " ", &save);
+    if (cmd && strcmp(cmd, "sched") == 0) {
+        cmd_sched(conn, &save);
+    } else if (cmd && strcmp(cmd, "stats") == 0) {
+        cmd_stats(conn, &save);
+    } else if (cmd && strcmp(cmd, "dac") == 0) {
+        cmd_dac(conn, &save);
+#if defined(CONFIG_STIM_EVLOG)
+    } else if (cmd && strcmp(cmd, "log") == 0) {
+        cmd_log(conn, &save);
+#endif
+#if defined(CONFIG_STIM_BURST)
+    } else if (cmd && strcmp(cmd, "burst") == 0) {
+        cmd_burst(conn, &save);
+#endif
+    } else {
+        reply(conn, "ERR %d\r\n", -ENOTSUP);
+    }
+    return true;
+}
@@ -0,0 +1,13 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <zephyr/types.h>
+#include <zephyr/bluetooth/conn.h>
+
+// Commands sent over NUS start with this character, everything else is
+// bridged to the UART
+#define COMMAND_PREFIX '!'
+#define COMMAND_MAX_LEN 64
+
+bool command_handle(struct bt_conn *conn, const uint8_t *data, uint16_t len);
+#endif
@@ -0,0 +1,112 @@
+#include <zephyr/kernel.h>
+#include <string.h>
+#include "dac.h"
+
+// Frame formats of the supported DACs, MSB first on the wire. Codes are
+// 16 bit full scale whatever the chip resolution.
+
+#if defined(CONFIG_STIM_DAC_AD5686)
+#define AD5686_CMD_NOP          0x0
+#define AD5686_CMD_WRITE_INPUT  0x1     // input register, output on LDAC
+#define AD5686_CMD_WRITE_UPDATE 0x3     // input and DAC register
+#define AD5686_CMD_DCEN         0x8     // daisy-chain enable
+#define AD5686_ADDR_DAC_A       0x1
+#elif defined(CONFIG_STIM_DAC_MCP4921)
+#define MCP4921_GA              BIT(13) // 1x gain
+#define MCP4921_SHDN            BIT(12) // output active
+#endif
+
+static void chip_frame(uint16_t code, bool update, uint8_t *tx) {
+#if defined(CONFIG_STIM_DAC_DAC8551)
+    // 6 don't care bits and the power-down bits in normal mode
+    ARG_UNUSED(update);
+    tx[0] = 0x00;
+    tx[1] = code >> 8;
+    tx[2] = code & 0xFF;
+#elif defined(CONFIG_STIM_DAC_MCP4921)
+    // Channel A, unbuffered reference, upper 12 bits of the code
+    uint16_t word = MCP4921_GA | MCP4921_SHDN | (code >> 4);
+
+    ARG_UNUSED(update);
+    tx[0] = word >> 8;
+    tx[1] = word & 0xFF;
+#elif defined(CONFIG_STIM_DAC_AD5686)
+    tx[0] = (update ? AD5686_CMD_WRITE_UPDATE : AD5686_CMD_WRITE_INPUT) << 4 | AD5686_ADDR_DAC_A;
+    tx[1] = code >> 8;
+    tx[2] = code & 0xFF;
+#else
+    ARG_UNUSED(update);
+    tx[0] = code >> 8;
+    tx[1] = code & 0xFF;
+#endif
+}
+
+static uint16_t chip_code(const uint8_t *tx) {
+#if defined(CONFIG_STIM_DAC_DAC8551) || defined(CONFIG_STIM_DAC_AD5686)
+    return (tx[1] << 8) | tx[2];
+#elif defined(CONFIG_STIM_DAC_MCP4921)
+    return (((tx[0] & 0x0F) << 8) | tx[1]) << 4;
+#else
+    return (tx[0] << 8) | tx[1];
+#endif
+}
+
+#if defined(CONFIG_STIM_DAC_CHAIN)
+BUILD_ASSERT(AD5686_CMD_NOP == 0, "Chain padding must be a no-op frame");
+
+// The first frame out is shifted on to the last chip of the chain
+static size_t chain_offset(enum dac_id dac) {
+    return (DAC_COUNT - 1 - dac) * DAC_FRAME_LEN;
+}
+#endif
+
+static void frame_put(enum dac_id dac, uint16_t code, bool update, uint8_t *tx) {
+#if defined(CONFIG_STIM_DAC_CHAIN)
+    // All-zero frames are no-ops for the other chips
+    memset(tx, 0, DAC_TX_LEN);
+    chip_frame(code, update, &tx[chain_offset(dac)]);
+#else
+    chip_frame(code, update, tx);
+#endif
+}
+
+void dac_frame(enum dac_id dac, uint16_t code, uint8_t *tx) {
+    frame_put(dac, code, true, tx);
+}
+
+void dac_frame_input(enum dac_id dac, uint16_t code, uint8_t *tx) {
+    frame_put(dac, code, !IS_ENABLED(CONFIG_STIM_DAC_LDAC), tx);
+}
+
+#if defined(CONFIG_STIM_DAC_CHAIN)
+void dac_frame_all(const uint16_t *code, uint8_t *tx) {
+    for (int i = 0; i < DAC_COUNT; i++) {
+        chip_frame(code[i], true, &tx[chain_offset(i)]);
+    }
+}
+#endif
+
+uint16_t dac_frame_code(enum dac_id dac, const uint8_t *tx) {
+#if defined(CONFIG_STIM_DAC_CHAIN)
+    return chip_code(&tx[chain_offset(dac)]);
+#else
+    ARG_UNUSED(dac);
+    return chip_code(tx);
+#endif
+}
+
+int dac_setup_frame(uint8_t *tx) {
+#if defined(CONFIG_STIM_DAC_CHAIN)
+    // SDO is off until DCEN is set, so each transfer of DCEN frames
+    // reaches one chip further down the chain
+    for (int i = 0; i < DAC_COUNT; i++) {
+        tx[i * DAC_FRAME_LEN] = AD5686_CMD_DCEN << 4;
+        tx[i * DAC_FRAME_LEN + 1] = 0x00;
+        tx[i * DAC_FRAME_LEN + 2] = 0x01;
+    }
+    return DAC_COUNT;
+#else
+    ARG_UNUSED(tx);
+    return 0;
+#endif
+}
@@ -0,0 +1,46 @@
+#ifndef DAC_H
+#define DAC_H
+#include <zephyr/kernel.h>
+
+enum dac_id {
+    DAC1 = 0,
+    DAC2,
+    DAC_COUNT
+};
+
+// Bytes of one chip frame, see STIM_DAC_CHIP
+#if defined(CONFIG_STIM_DAC_DAC8551) || defined(CONFIG_STIM_DAC_AD5686)
+#define DAC_FRAME_LEN 3
+#else
+#define DAC_FRAME_LEN 2
+#endif
+
+// Bytes of one SPIM transfer. A daisy chain takes a frame for every DAC,
+// the one for DAC1 last as it is the first chip after MOSI.
+#if defined(CONFIG_STIM_DAC_CHAIN)
+#define DAC_TX_LEN (DAC_FRAME_LEN * DAC_COUNT)
+#else
+#define DAC_TX_LEN DAC_FRAME_LEN
+#endif
+
+// The MCP4921 only moves its output on LDAC
+#if defined(CONFIG_STIM_DAC_MCP4921) && defined(CONFIG_STIM_DAC_LDAC)
+#define DAC_LDAC_EVERY_FRAME 1
+#else
+#define DAC_LDAC_EVERY_FRAME 0
+#endif
+
+// Transfer that sets dac to code and updates its output
+void dac_frame(enum dac_id dac, uint16_t code, uint8_t *tx);
+// Transfer that loads code into the input register of dac, the output
+// follows on the LDAC pulse. Same as dac_frame without STIM_DAC_LDAC.
+void dac_frame_input(enum dac_id dac, uint16_t code, uint8_t *tx);
+#if defined(CONFIG_STIM_DAC_CHAIN)
+// One transfer that sets every DAC of the chain
+void dac_frame_all(const uint16_t *code, uint8_t *tx);
+#endif
+// Code of dac in a transfer built by the functions above
+uint16_t dac_frame_code(enum dac_id dac, const uint8_t *tx);
+// Transfer to send at start-up and how many times, 0 if none is needed
+int dac_setup_frame(uint8_t *tx);
+#endif
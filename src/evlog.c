@@ -0,0 +1,120 @@
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include "evlog.h"
+#include "timer.h"
+
+#define EVLOG_RING_SIZE CONFIG_STIM_EVLOG_RING_SIZE
+
+BUILD_ASSERT((EVLOG_RING_SIZE & (EVLOG_RING_SIZE - 1)) == 0, "Log ring size must be a power of two");
+
+// Any interrupt or thread may write, so producers take the IRQ lock for
+// the few instructions that claim and fill a slot. That is the whole cost
+// in the ISR: nothing is formatted and nothing waits on the console. A
+// full ring drops the record and counts it. Only the log thread moves
+// evlog_tail. The IRQ lock does not mask STIM_ZLI handlers, which is fine
+// as long as every writer runs at that level, as in timeline mode.
+static struct evlog_record evlog_ring[EVLOG_RING_SIZE];
+static atomic_t evlog_head;
+static atomic_t evlog_tail;
+static atomic_t evlog_lost;
+static bool evlog_verbose = IS_ENABLED(CONFIG_STIM_EVLOG_VERBOSE);
+
+void evlog_put(enum evlog_id id, uint16_t arg, int32_t value) {
+    uint64_t tick = timer_timestamp();
+    unsigned int key = irq_lock();
+    atomic_val_t head = atomic_get(&evlog_head);
+
+    if (head - atomic_get(&evlog_tail) == EVLOG_RING_SIZE) {
+        atomic_inc(&evlog_lost);
+    } else {
+        evlog_ring[head & (EVLOG_RING_SIZE - 1)] = (struct evlog_record) {
+            .id = id,
+            .arg = arg,
+            .value = value,
+            .tick = tick,
+        };
+        atomic_set(&evlog_head, head + 1);
+    }
+    irq_unlock(key);
+}
+
+void evlog_put_verbose(enum evlog_id id, uint16_t arg, int32_t value) {
+    if (evlog_verbose) {
+        evlog_put(id, arg, value);
+    }
+}
+
+void evlog_verbose_set(bool on) {
+    evlog_verbose = on;
+}
+
+bool evlog_get(struct evlog_record *rec) {
+    atomic_val_t tail = atomic_get(&evlog_tail);
+
+    if (tail == atomic_get(&evlog_head)) {
+        return false;
+    }
+    *rec = evlog_ring[tail & (EVLOG_RING_SIZE - 1)];
+    atomic_set(&evlog_tail, tail + 1);
+    return true;
+}
+
+uint32_t evlog_dropped(void) {
+    return atomic_clear(&evlog_lost);
+}
+
+// The host benchmark drains the ring itself
+#if !defined(CONFIG_STIM_BENCH)
+LOG_MODULE_REGISTER(evlog, LOG_LEVEL_DBG);
+
+static void evlog_format(const struct evlog_record *rec) {
+    switch (rec->id) {
+    case EVLOG_MISSED:
+        LOG_WRN("%llu: %d events missed from event %u", rec->tick, rec->value, rec->arg);
+        break;
+    case EVLOG_MALFORMED:
+        LOG_WRN("%llu: event %u off by %d ticks", rec->tick, rec->arg, rec->value);
+        break;
+    case EVLOG_DAC_QUEUE_FULL:
+        LOG_WRN("%llu: DAC%u queue full, frame dropped", rec->tick, rec->arg + 1);
+        break;
+    case EVLOG_DAC_XFER_FAILED:
+        LOG_ERR("%llu: DAC%u transfer of 0x%04x failed", rec->tick, rec->arg + 1, rec->value);
+        break;
+    case EVLOG_DAC_LIST_FAILED:
+        LOG_ERR("%llu: SPI list setup failed with error: %d", rec->tick, rec->value);
+        break;
+    case EVLOG_EVENT:
+        LOG_DBG("%llu: event %u error %d", rec->tick, rec->arg, rec->value);
+        break;
+    case EVLOG_SPI_DONE:
+        LOG_DBG("%llu: DAC%u sent 0x%04x", rec->tick, rec->arg + 1, rec->value);
+        break;
+    case EVLOG_OVERRUN:
+        LOG_WRN("%llu: event %u overrun by %d ticks", rec->tick, rec->arg, rec->value);
+        break;
+    default:
+        LOG_WRN("%llu: unknown record %u", rec->tick, rec->id);
+        break;
+    }
+}
+
+static void evlog_thread(void) {
+    struct evlog_record rec;
+
+    for (;;) {
+        k_msleep(CONFIG_STIM_EVLOG_FLUSH_MS);
+
+        while (evlog_get(&rec)) {
+            evlog_format(&rec);
+        }
+        uint32_t lost = evlog_dropped();
+        if (lost) {
+            LOG_WRN("%u log records dropped", lost);
+        }
+    }
+}
+
+K_THREAD_DEFINE(evlog_thread_id, 1024, evlog_thread, NULL, NULL, NULL,
+                K_LOWEST_APPLICATION_THREAD_PRIO, 0, 0);
+#endif
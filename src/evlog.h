@@ -0,0 +1,41 @@
+#ifndef EVLOG_H
+#define EVLOG_H
+
+#include <zephyr/kernel.h>
+
+// Log records from the timer and SPIM interrupts. The ISR only stores the
+// id, two arguments and the 64-bit timestamp, the text is formatted later
+// by a low priority thread.
+enum evlog_id {
+    EVLOG_MISSED = 0,       // arg: first event missed, value: how many
+    EVLOG_MALFORMED,        // arg: entry or event, value: timing error in ticks
+    EVLOG_DAC_QUEUE_FULL,   // arg: DAC, frame not queued
+    EVLOG_DAC_XFER_FAILED,  // arg: DAC, value: DAC word dropped
+    EVLOG_DAC_LIST_FAILED,  // value: nrfx error of the SPIM list setup
+    EVLOG_EVENT,            // verbose, arg: entry or event, value: timing error in ticks
+    EVLOG_SPI_DONE,         // verbose, arg: DAC, value: DAC word clocked out
+    EVLOG_OVERRUN,          // arg: entry or event, value: ticks past its compare
+};
+
+struct evlog_record {
+    uint16_t id;
+    uint16_t arg;
+    int32_t value;
+    uint64_t tick;          // timer_timestamp
+};
+
+#if defined(CONFIG_STIM_EVLOG)
+void evlog_put(enum evlog_id id, uint16_t arg, int32_t value);
+// Only records while verbose logging is on
+void evlog_put_verbose(enum evlog_id id, uint16_t arg, int32_t value);
+void evlog_verbose_set(bool on);
+// Consumer side, for the log thread. Returns false if the ring is empty.
+bool evlog_get(struct evlog_record *rec);
+// Records lost to a full ring since the last call
+uint32_t evlog_dropped(void);
+#else
+static inline void evlog_put(enum evlog_id id, uint16_t arg, int32_t value) {}
+static inline void evlog_put_verbose(enum evlog_id id, uint16_t arg, int32_t value) {}
+static inline void evlog_verbose_set(bool on) {}
+#endif
+#endif
@@ -41,6 +41,14 @@
 #include "BLE.h"
 #include "spi.h"
 #include "timer.h"
+#include "stats.h"
+#if defined(CONFIG_STIM_WAVEFORM)
+#include "waveform.h"
+#endif
+#if defined(CONFIG_STIM_ACQ)
+#include <nrfx_saadc.h>
+#include "acq.h"
+#endif
 
 LOG_MODULE_REGISTER(mymain, LOG_LEVEL_DBG);
 static void init_clock();
@@ -55,6 +63,7 @@ BT_CONN_CB_DEFINE(conn_callbacks) = {
 
 static struct bt_nus_cb nus_cb = {
 	.received = bt_receive_cb,
+	.sent     = bt_sent_cb,
 };
 
 static void init_misc_pins(void) {
@@ -76,23 +85,132 @@ static void init_misc_pins(void) {
     nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(1, 1)); // set low
 }
 
+#if defined(CONFIG_STIM_WAVEFORM)
+static void init_waveforms(void) {
+    static uint16_t samples[WAVE_MAX_SAMPLES];
+    // Charge balanced biphasic pulse on DAC1, DAC2 keeps its fixed frame
+    size_t count = waveform_biphasic_exp(samples, 64, 0x4000, 32, 8.0f);
+
+    if (waveform_load(DAC1, samples, count) || waveform_start()) {
+        printf("Waveform engine start failed\n");
+    }
+}
+#endif
+
+#if !defined(CONFIG_STIM_GATT)
+#define STATS_LOG_INTERVAL_S 10
+
+// Console report of the stats window, from the main loop
+static void stats_log(void) {
+    static uint32_t elapsed_s;
+    stats_snapshot snap;
+
+    elapsed_s += STATS_LOG_INTERVAL_S;
+    stats_get(&snap);
+    // Deferred log, the UART is written by the log thread and the main
+    // loop never blocks on it
+    LOG_INF("Elapsed: %is Window: %lums BLE TX: %lu bit/s",
+            elapsed_s,
+            snap.window_ms,
+            nus_tx_rate_get());
+    LOG_INF("Reconfigurations: %lu missed: %lu malformed: %lu",
+            snap.counter[STATS_RECONFIG],
+            snap.counter[STATS_MISSED],
+            snap.counter[STATS_MALFORMED]);
+    struct uart_rx_pool_stats pool;
+    uart_rx_pool_stats_get(&pool);
+    LOG_INF("UART RX pool used: %lu/%d high water: %lu alloc failures: %lu",
+            pool.used,
+            CONFIG_BT_NUS_UART_RX_BUF_COUNT,
+            pool.high_water,
+            pool.alloc_failures);
+    struct bridge_flow_stats flow;
+    bridge_flow_stats_get(&flow);
+    LOG_INF("Flow UART RX stalls: %lu UART TX stalls: %lu dropped: %lu BLE TX stalls: %lu dropped: %lu",
+            flow.uart_rx_stalls,
+            flow.uart_tx_stalls,
+            flow.uart_tx_dropped,
+            flow.ble_tx_stalls,
+            flow.ble_tx_dropped);
+#if defined(CONFIG_STIM_ACQ)
+    LOG_INF("Acquisition windows dropped: %lu", acq_dropped());
+#endif
+    if (snap.dead_time.count) {
+        LOG_INF("Dead time n: %lu mean: %lu p50: %lu p99: %lu p99.9: %lu max: %lu",
+                snap.dead_time.count,
+                snap.dead_time.mean,
+                snap.dead_time.p50,
+                snap.dead_time.p99,
+                snap.dead_time.p999,
+                snap.dead_time.max);
+    }
+    if (snap.counter[STATS_PERIODS]) {
+        LOG_INF("Per period wakeups: %lu active: %lu us",
+                snap.counter[STATS_WAKEUPS] / snap.counter[STATS_PERIODS],
+                snap.counter[STATS_ACTIVE_US] / snap.counter[STATS_PERIODS]);
+    }
+    if (snap.latency.count) {
+        LOG_INF("IRQ latency n: %lu mean: %lu p50: %lu p99: %lu p99.9: %lu max: %lu",
+                snap.latency.count,
+                snap.latency.mean,
+                snap.latency.p50,
+                snap.latency.p99,
+                snap.latency.p999,
+                snap.latency.max);
+    }
+    for (int i = 0; i < STATS_EVENTS; i++) {
+        if (snap.overrun[i]) {
+            LOG_WRN("Event%d overruns: %lu", i, snap.overrun[i]);
+        }
+        // Entries past the end of the timeline stay empty
+        if (snap.event[i].count == 0) {
+            continue;
+        }
+        // Timing errors in timer ticks
+        LOG_INF("Event%d n: %lu mean: %lu p50: %lu p99: %lu p99.9: %lu max: %lu",
+                i,
+                snap.event[i].count,
+                snap.event[i].mean,
+                snap.event[i].p50,
+                snap.event[i].p99,
+                snap.event[i].p999,
+                snap.event[i].max);
+    }
+}
+#endif
+
 int main(void)
 {
-    #if defined(__ZEPHYR__)
+    #if defined(__ZEPHYR__) && defined(CONFIG_STIM_ZLI)
+        // Above the kernel, Bluetooth and UART, see STIM_ZLI
+        IRQ_DIRECT_CONNECT(NRFX_IRQ_NUMBER_GET(NRF_TIMER_INST_GET(TIMER_INST_IDX)), 0,
+                           timer_zli_isr, IRQ_ZERO_LATENCY);
+        IRQ_DIRECT_CONNECT(NRFX_IRQ_NUMBER_GET(NRF_TIMER_INST_GET(MEAS_TIMER_INST_IDX)), 0,
+                           measurement_zli_isr, IRQ_ZERO_LATENCY);
+        IRQ_DIRECT_CONNECT(NRFX_IRQ_NUMBER_GET(NRF_SPIM_INST_GET(SPIM_INST_IDX)), 0,
+                           spi_zli_isr, IRQ_ZERO_LATENCY);
+    #elif defined(__ZEPHYR__)
         IRQ_CONNECT(NRFX_IRQ_NUMBER_GET(NRF_TIMER_INST_GET(TIMER_INST_IDX)), IRQ_PRIO_LOWEST,
                     NRFX_TIMER_INST_HANDLER_GET(TIMER_INST_IDX), 0, 0);
+        IRQ_CONNECT(NRFX_IRQ_NUMBER_GET(NRF_TIMER_INST_GET(MEAS_TIMER_INST_IDX)), IRQ_PRIO_LOWEST,
+                    NRFX_TIMER_INST_HANDLER_GET(MEAS_TIMER_INST_IDX), 0, 0);
         IRQ_CONNECT(NRFX_IRQ_NUMBER_GET(NRF_SPIM_INST_GET(SPIM_INST_IDX)), IRQ_PRIO_LOWEST,
                     NRFX_SPIM_INST_HANDLER_GET(SPIM_INST_IDX), 0, 0);
     #endif
+    #if defined(__ZEPHYR__) && defined(CONFIG_STIM_ACQ)
+        IRQ_CONNECT(SAADC_IRQn, IRQ_PRIO_LOWEST, nrfx_saadc_irq_handler, 0, 0);
+    #endif
 
     init_clock();
     init_misc_pins();
     spi_init();
     timer_init();
     measurement_timer_init();
+#if defined(CONFIG_STIM_WAVEFORM)
+    init_waveforms();
+#endif
 	int blink_status = 0;
 	int err = 0;
-    uint32_t experiment_counter = 0;
     
 	configure_gpio();
 
@@ -139,34 +257,36 @@ int main(void)
 
 	for (;;) {
 		dk_set_led(RUN_STATUS_LED, (++blink_status) % 2);
-		//k_sleep(K_MSEC(RUN_LED_BLINK_INTERVAL));
-        k_msleep(10000);
-        experiment_counter += 10;
-        error_data my_error_data;
-        get_error_data(&my_error_data);
-        printf("Counter: %i Elapsed: %is\nEvent0 running error: %lu avg error: %lu max error: %lu\nEvents1-3 running error: %lu avg error: %lu max error: %lu, %lu, %lu\n", 
-               my_error_data.mycounter, 
-               experiment_counter,
-               my_error_data.event0_error,
-               (my_error_data.event0_error/my_error_data.mycounter), 
-               my_error_data.event0_max,
-               my_error_data.myerror,
-               (my_error_data.myerror/my_error_data.mycounter),
-               my_error_data.event1_max,
-               my_error_data.event2_max,
-               my_error_data.event3_max);
+#if defined(CONFIG_STIM_GATT)
+		// Stats are published by the stimulation GATT service
+		k_sleep(K_MSEC(RUN_LED_BLINK_INTERVAL));
+#else
+        k_sleep(K_SECONDS(STATS_LOG_INTERVAL_S));
+        stats_log();
+#endif
 	}
 }
 
 K_THREAD_DEFINE(ble_write_thread_id, STACKSIZE, ble_write_thread, NULL, NULL,
 		NULL, PRIORITY, 0, 0);
 
+K_THREAD_DEFINE(uart_write_thread_id, STACKSIZE, uart_write_thread, NULL, NULL,
+		NULL, PRIORITY, 0, 0);
+
 static void init_clock() {
 	// select the clock source: HFINT (high frequency internal oscillator) or HFXO (external 32 MHz crystal)
 	NRF_CLOCK_S->HFCLKSRC = (CLOCK_HFCLKSRC_SRC_HFINT << CLOCK_HFCLKSRC_SRC_Pos);
 
+#if !defined(CONFIG_STIM_IDLE)
     // start the clock, and wait to verify that it is running
     NRF_CLOCK_S->TASKS_HFCLKSTART = 1;
     while (NRF_CLOCK_S->EVENTS_HFCLKSTARTED == 0);
     NRF_CLOCK_S->EVENTS_HFCLKSTARTED = 0;
+#endif
+    // In idle mode the timers request the clock only while they run
+
+#if defined(CONFIG_STIM_DAC_SPIM_HS)
+    // SPIM4 only reaches 32 MHz with the core clock at 128 MHz
+    NRF_CLOCK_S->HFCLKCTRL = (CLOCK_HFCLKCTRL_HCLK_Div1 << CLOCK_HFCLKCTRL_HCLK_Pos);
+#endif
 }
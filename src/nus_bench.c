@@ -0,0 +1,206 @@
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/conn.h>
+#include <bluetooth/services/nus.h>
+#include <stdio.h>
+#include <string.h>
+#include "nus_bench.h"
+#include "stats.h"
+#include "BLE.h"
+
+#define INFLIGHT_LEN 32     // power of two
+
+enum {
+    DIR_U2B,                // UART -> BLE notifications
+    DIR_B2U,                // BLE writes -> UART
+    DIR_COUNT
+};
+
+static const char *const dir_name[DIR_COUNT] = { "u2b", "b2u" };
+
+struct bench_dir {
+    uint64_t bytes;
+    uint32_t packets;
+    uint32_t untracked;     // packets whose latency could not be followed
+    uint32_t max_us;
+    uint64_t sum_us;
+    uint32_t bucket[STATS_BUCKETS];
+};
+
+// Notifications handed to the stack, oldest first. The sent callbacks come
+// in the same order.
+struct u2b_entry {
+    uint32_t stamp;
+    uint16_t len;
+};
+
+// Writes waiting in the UART TX ring and the ring position of their last byte
+struct b2u_entry {
+    uint32_t stamp;
+    uint32_t end;
+};
+
+static struct k_spinlock lock;
+static struct bench_dir dirs[DIR_COUNT];
+static struct u2b_entry u2b[INFLIGHT_LEN];
+static uint32_t u2b_head, u2b_tail;
+static struct b2u_entry b2u[INFLIGHT_LEN];
+static uint32_t b2u_head, b2u_tail;
+static uint32_t b2u_queued_bytes;
+static uint32_t b2u_drained_bytes;
+static int64_t window_start;
+
+static void report_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(report_work, report_work_handler);
+
+// Caller holds lock
+static void dir_record(struct bench_dir *dir, uint32_t stamp, uint32_t len) {
+    uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - stamp);
+
+    dir->bytes += len;
+    dir->packets++;
+    dir->sum_us += us;
+    dir->max_us = MAX(dir->max_us, us);
+    dir->bucket[stats_bucket_index(us)]++;
+}
+
+void nus_bench_u2b_queued(uint32_t stamp, uint16_t len) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    if (u2b_tail - u2b_head < INFLIGHT_LEN) {
+        u2b[u2b_tail++ & (INFLIGHT_LEN - 1)] = (struct u2b_entry) { stamp, len };
+    } else {
+        dirs[DIR_U2B].untracked++;
+    }
+    k_spin_unlock(&lock, key);
+}
+
+// The notification of the last nus_bench_u2b_queued() was not accepted
+void nus_bench_u2b_cancel(void) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    if (u2b_tail != u2b_head) {
+        u2b_tail--;
+    }
+    k_spin_unlock(&lock, key);
+}
+
+void nus_bench_u2b_sent(void) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    if (u2b_head != u2b_tail) {
+        struct u2b_entry *e = &u2b[u2b_head++ & (INFLIGHT_LEN - 1)];
+
+        dir_record(&dirs[DIR_U2B], e->stamp, e->len);
+    }
+    k_spin_unlock(&lock, key);
+}
+
+void nus_bench_b2u_queued(uint32_t len) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    b2u_queued_bytes += len;
+    if (b2u_tail - b2u_head < INFLIGHT_LEN) {
+        b2u[b2u_tail++ & (INFLIGHT_LEN - 1)] = (struct b2u_entry) {
+            k_cycle_get_32(), b2u_queued_bytes
+        };
+    } else {
+        dirs[DIR_B2U].untracked++;
+    }
+    k_spin_unlock(&lock, key);
+}
+
+void nus_bench_b2u_drained(uint32_t len) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    uint32_t start = b2u_drained_bytes;
+
+    b2u_drained_bytes += len;
+    while (b2u_head != b2u_tail) {
+        struct b2u_entry *e = &b2u[b2u_head & (INFLIGHT_LEN - 1)];
+
+        if ((int32_t)(e->end - b2u_drained_bytes) > 0) {
+            break;
+        }
+        dir_record(&dirs[DIR_B2U], e->stamp, e->end - start);
+        start = e->end;
+        b2u_head++;
+    }
+    k_spin_unlock(&lock, key);
+}
+
+// Connection boundary, nothing in flight survives it
+void nus_bench_reset(void) {
+    k_spinlock_key_t key = k_spin_lock(&lock);
+
+    memset(dirs, 0, sizeof(dirs));
+    u2b_head = u2b_tail = 0;
+    b2u_head = b2u_tail = 0;
+    b2u_queued_bytes = b2u_drained_bytes = 0;
+    window_start = k_uptime_get();
+    k_spin_unlock(&lock, key);
+
+    k_work_reschedule(&report_work, K_MSEC(CONFIG_BT_NUS_BENCH_REPORT_MS));
+}
+
+static uint32_t dir_percentile(const struct bench_dir *dir, uint32_t per_mille) {
+    uint64_t target = ((uint64_t)dir->packets * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += dir->bucket[b];
+        if (seen >= target && seen > 0) {
+            return MIN(stats_bucket_upper(b), dir->max_us);
+        }
+    }
+    return dir->max_us;
+}
+
+static void report_work_handler(struct k_work *work) {
+    static struct bench_dir snap[DIR_COUNT];
+    struct bt_conn *conn;
+    struct bridge_flow_stats flow;
+    struct bt_conn_info info;
+    uint32_t interval_us = 0;
+    uint8_t tx_phy = 0;
+    uint16_t data_len = 0;
+    uint16_t mtu = 0;
+    int64_t now = k_uptime_get();
+
+    k_spinlock_key_t key = k_spin_lock(&lock);
+    memcpy(snap, dirs, sizeof(snap));
+    memset(dirs, 0, sizeof(dirs));
+    uint32_t window_ms = now - window_start;
+    window_start = now;
+    k_spin_unlock(&lock, key);
+
+    k_work_reschedule(&report_work, K_MSEC(CONFIG_BT_NUS_BENCH_REPORT_MS));
+
+    conn = current_conn_get();
+    if (!conn) {
+        return;
+    }
+    if (bt_conn_get_info(conn, &info)) {
+        bt_conn_unref(conn);
+        return;
+    }
+    interval_us = info.le.interval * 1250;
+    tx_phy = info.le.phy->tx_phy;
+    data_len = info.le.data_len->tx_max_len;
+    mtu = bt_nus_get_mtu(conn);
+    bt_conn_unref(conn);
+    bridge_flow_stats_get(&flow);
+
+    for (int i = 0; i < DIR_COUNT; i++) {
+        const struct bench_dir *d = &snap[i];
+
+        printk("nus_bench,dir=%s,t_ms=%u,window_ms=%u,mtu=%u,phy=%u,data_len=%u,interval_us=%u,"
+               "bps=%u,packets=%u,untracked=%u,lat_us_mean=%u,lat_us_p50=%u,lat_us_p99=%u,"
+               "lat_us_max=%u,stalls=%u,dropped=%u\n",
+               dir_name[i], (uint32_t)now, window_ms, mtu, tx_phy, data_len, interval_us,
+               window_ms ? (uint32_t)(d->bytes * 8 * MSEC_PER_SEC / window_ms) : 0,
+               d->packets, d->untracked,
+               d->packets ? (uint32_t)(d->sum_us / d->packets) : 0,
+               dir_percentile(d, 500), dir_percentile(d, 990), d->max_us,
+               i == DIR_U2B ? flow.ble_tx_stalls : flow.uart_tx_stalls,
+               i == DIR_U2B ? flow.ble_tx_dropped : flow.uart_tx_dropped);
+    }
+}
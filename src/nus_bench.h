@@ -0,0 +1,29 @@
+#ifndef NUS_BENCH_H
+#define NUS_BENCH_H
+
+#include <zephyr/kernel.h>
+
+// Bridge instrumentation for the BabbleSim benchmark, see CONFIG_BT_NUS_BENCH.
+// UART->BLE latency runs from the UART releasing a buffer to the NUS sent
+// callback of the notification carrying it, BLE->UART latency from the
+// write being copied into the BLE RX staging ring to its last byte clocked
+// out.
+// A report line of key=value pairs is printed every
+// CONFIG_BT_NUS_BENCH_REPORT_MS.
+
+#if defined(CONFIG_BT_NUS_BENCH)
+void nus_bench_u2b_queued(uint32_t stamp, uint16_t len);
+void nus_bench_u2b_cancel(void);
+void nus_bench_u2b_sent(void);
+void nus_bench_b2u_queued(uint32_t len);
+void nus_bench_b2u_drained(uint32_t len);
+void nus_bench_reset(void);
+#else
+static inline void nus_bench_u2b_queued(uint32_t stamp, uint16_t len) {}
+static inline void nus_bench_u2b_cancel(void) {}
+static inline void nus_bench_u2b_sent(void) {}
+static inline void nus_bench_b2u_queued(uint32_t len) {}
+static inline void nus_bench_b2u_drained(uint32_t len) {}
+static inline void nus_bench_reset(void) {}
+#endif
+#endif
@@ -0,0 +1,119 @@
+#include <nrfx_timer.h>
+#include <nrfx_gpiote.h>
+#include <helpers/nrfx_gppi.h>
+#include <zephyr/kernel.h>
+#include <hal/nrf_gpio.h>
+#include "sequencer.h"
+#include "timer.h"
+#include "spi.h"
+
+// Hardware stimulation sequencer.
+//
+// The stimulation timer compare events are routed through DPPI so that the
+// pin edges and the DAC frames are produced without any ISR in the path:
+//
+//   COMPARE0, COMPARE2 -> ch_pulse  -> SET 1.03, SPIM START, capture measurement CC0
+//   COMPARE1, COMPARE3 -> ch_switch -> CLR 1.03, SET 1.00, SET 1.01, capture measurement CC1
+//
+// SPIM END releases the DAC chip selects in hardware (see spi_init).
+//
+// Several events publish on the same channel, which only DPPI supports.
+// The CPU only runs on COMPARE1/COMPARE3 to refill the next DAC frame and
+// to pre-select the chip select of the DAC that is written next.
+
+static const nrfx_gpiote_t gpiote = NRFX_GPIOTE_INSTANCE(GPIOTE_INST_IDX);
+
+static int gpiote_out_init(uint32_t pin, nrf_gpiote_outinit_t init_val) {
+    uint8_t ch;
+    nrfx_err_t err = nrfx_gpiote_channel_alloc(&gpiote, &ch);
+    if (err != NRFX_SUCCESS) {
+        printf("GPIOTE channel allocation failed for pin %d\n", pin);
+        return -ENOMEM;
+    }
+
+    nrfx_gpiote_output_config_t out_config = NRFX_GPIOTE_DEFAULT_OUTPUT_CONFIG;
+    nrfx_gpiote_task_config_t task_config = {
+        .task_ch = ch,
+        .polarity = NRF_GPIOTE_POLARITY_TOGGLE,
+        .init_val = init_val,
+    };
+    err = nrfx_gpiote_output_configure(&gpiote, pin, &out_config, &task_config);
+    if (err != NRFX_SUCCESS) {
+        printf("GPIOTE output configuration failed for pin %d\n", pin);
+        return -EIO;
+    }
+    nrfx_gpiote_out_task_enable(&gpiote, pin);
+    return 0;
+}
+
+static int seq_channel_alloc(uint8_t *ch) {
+    if (nrfx_gppi_channel_alloc(ch) != NRFX_SUCCESS) {
+        printf("DPPI channel allocation failed\n");
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+int sequencer_init(nrfx_timer_t *stim_timer, nrfx_timer_t *meas_timer) {
+    uint8_t ch_pulse, ch_switch;
+    int err;
+
+    if (!nrfx_gpiote_init_check(&gpiote)) {
+        nrfx_gpiote_init(&gpiote, 0);
+    }
+
+    // Switch pins idle low (same as init_misc_pins)
+    err = gpiote_out_init(STIM_PIN_1_03, NRF_GPIOTE_INITIAL_VALUE_LOW);
+    err = err ? err : gpiote_out_init(STIM_PIN_1_00, NRF_GPIOTE_INITIAL_VALUE_LOW);
+    err = err ? err : gpiote_out_init(STIM_PIN_1_01, NRF_GPIOTE_INITIAL_VALUE_LOW);
+    err = err ? err : seq_channel_alloc(&ch_pulse);
+    err = err ? err : seq_channel_alloc(&ch_switch);
+    if (err) {
+        return err;
+    }
+
+    // Pulse on: DAC frame goes out while 1.03 is driven high
+    nrfx_gppi_event_endpoint_setup(ch_pulse,
+        nrfx_timer_compare_event_address_get(stim_timer, NRF_TIMER_CC_CHANNEL0));
+    nrfx_gppi_event_endpoint_setup(ch_pulse,
+        nrfx_timer_compare_event_address_get(stim_timer, NRF_TIMER_CC_CHANNEL2));
+    nrfx_gppi_task_endpoint_setup(ch_pulse, nrfx_gpiote_set_task_address_get(&gpiote, STIM_PIN_1_03));
+    nrfx_gppi_task_endpoint_setup(ch_pulse, spi_start_task_address());
+    nrfx_gppi_task_endpoint_setup(ch_pulse,
+        nrfx_timer_capture_task_address_get(meas_timer, NRF_TIMER_CC_CHANNEL0));
+
+    // Switch: 1.03 off, 1.00 and 1.01 on
+    nrfx_gppi_event_endpoint_setup(ch_switch,
+        nrfx_timer_compare_event_address_get(stim_timer, NRF_TIMER_CC_CHANNEL1));
+    nrfx_gppi_event_endpoint_setup(ch_switch,
+        nrfx_timer_compare_event_address_get(stim_timer, NRF_TIMER_CC_CHANNEL3));
+    nrfx_gppi_task_endpoint_setup(ch_switch, nrfx_gpiote_clr_task_address_get(&gpiote, STIM_PIN_1_03));
+    nrfx_gppi_task_endpoint_setup(ch_switch, nrfx_gpiote_set_task_address_get(&gpiote, STIM_PIN_1_00));
+    nrfx_gppi_task_endpoint_setup(ch_switch, nrfx_gpiote_set_task_address_get(&gpiote, STIM_PIN_1_01));
+    nrfx_gppi_task_endpoint_setup(ch_switch,
+        nrfx_timer_capture_task_address_get(meas_timer, NRF_TIMER_CC_CHANNEL1));
+
+    // First period starts with DAC1
+    spi_dac_seq_arm();
+    spi_dac_cs_select(DAC1);
+
+    nrfx_gppi_channels_enable(BIT(ch_pulse) | BIT(ch_switch));
+    printf("Hardware sequencer enabled (DPPI %d, %d)\n", ch_pulse, ch_switch);
+    return 0;
+}
+
+void sequencer_refill(nrf_timer_event_t event_type) {
+    switch (event_type) {
+        case NRF_TIMER_EVENT_COMPARE1:
+            // DAC1 frame is out, DAC2 is written on COMPARE2
+            spi_dac_cs_select(DAC2);
+            break;
+        case NRF_TIMER_EVENT_COMPARE3:
+            // Period done: rewind the DAC frame list and select DAC1 for COMPARE0
+            spi_dac_seq_arm();
+            spi_dac_cs_select(DAC1);
+            break;
+        default:
+            break;
+    }
+}
@@ -0,0 +1,9 @@
+#ifndef SEQUENCER_H
+#define SEQUENCER_H
+
+#include <nrfx_timer.h>
+#include <zephyr/kernel.h>
+
+int sequencer_init(nrfx_timer_t *stim_timer, nrfx_timer_t *meas_timer);
+void sequencer_refill(nrf_timer_event_t event_type);
+#endif
@@ -0,0 +1,60 @@
+#ifndef NRF_GPIO_SIM_H
+#define NRF_GPIO_SIM_H
+
+#include "../nrfx_sim.h"
+
+#define NRF_GPIO_PIN_MAP(port, pin) (((port) << 5) | ((pin) & 0x1F))
+
+static inline void nrf_gpio_pin_set(uint32_t pin) {
+    sim_gpio_write(pin, true);
+}
+
+static inline void nrf_gpio_pin_clear(uint32_t pin) {
+    sim_gpio_write(pin, false);
+}
+
+static inline void nrf_gpio_cfg_output(uint32_t pin) {
+    (void)pin;
+}
+
+typedef struct {
+    uint32_t port;
+} NRF_GPIO_Type;
+
+extern NRF_GPIO_Type sim_gpio_ports[2];
+#define NRF_P0 (&sim_gpio_ports[0])
+#define NRF_P1 (&sim_gpio_ports[1])
+
+static inline void nrf_gpio_port_out_set(NRF_GPIO_Type *p_reg, uint32_t set_mask) {
+    for (; set_mask; set_mask &= set_mask - 1) {
+        sim_gpio_write(NRF_GPIO_PIN_MAP(p_reg->port, __builtin_ctz(set_mask)), true);
+    }
+}
+
+static inline void nrf_gpio_port_out_clear(NRF_GPIO_Type *p_reg, uint32_t clr_mask) {
+    for (; clr_mask; clr_mask &= clr_mask - 1) {
+        sim_gpio_write(NRF_GPIO_PIN_MAP(p_reg->port, __builtin_ctz(clr_mask)), false);
+    }
+}
+
+static inline uint32_t nrf_gpio_port_out_read(NRF_GPIO_Type const *p_reg) {
+    uint32_t out = 0;
+
+    for (int i = 0; i < 32; i++) {
+        out |= (uint32_t)sim_gpio_get(NRF_GPIO_PIN_MAP(p_reg->port, i)) << i;
+    }
+    return out;
+}
+
+// Only the pins that change are reported, all at the time of the write
+static inline void nrf_gpio_port_out_write(NRF_GPIO_Type *p_reg, uint32_t value) {
+    uint32_t changed = nrf_gpio_port_out_read(p_reg) ^ value;
+
+    for (; changed; changed &= changed - 1) {
+        int pin = __builtin_ctz(changed);
+
+        sim_gpio_write(NRF_GPIO_PIN_MAP(p_reg->port, pin), value & (1U << pin));
+    }
+}
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef NRFX_GPPI_SIM_H
+#define NRFX_GPPI_SIM_H
+
+#include "../nrfx_sim.h"
+
+#define SIM_GPPI_CHANNELS 8
+
+nrfx_err_t nrfx_gppi_channel_alloc(uint8_t *p_channel);
+void nrfx_gppi_channel_endpoints_setup(uint8_t channel, uint32_t eep, uint32_t tep);
+void nrfx_gppi_fork_endpoint_setup(uint8_t channel, uint32_t fork_tep);
+void nrfx_gppi_channels_enable(uint32_t mask);
+
+#endif
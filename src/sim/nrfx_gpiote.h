@@ -0,0 +1,74 @@
+#ifndef NRFX_GPIOTE_SIM_H
+#define NRFX_GPIOTE_SIM_H
+
+#include "nrfx_sim.h"
+
+// Task addresses encode the pin and the level the task drives
+#define SIM_GPIOTE_TASK(pin, value) (0x80000000 | ((pin) << 1) | (value))
+
+typedef enum {
+    NRF_GPIOTE_POLARITY_LOTOHI = 1,
+    NRF_GPIOTE_POLARITY_HITOLO,
+    NRF_GPIOTE_POLARITY_TOGGLE,
+} nrf_gpiote_polarity_t;
+
+typedef enum {
+    NRF_GPIOTE_INITIAL_VALUE_LOW,
+    NRF_GPIOTE_INITIAL_VALUE_HIGH,
+} nrf_gpiote_outinit_t;
+
+typedef struct {
+    int drive;
+    int input_connect;
+    int pull;
+} nrfx_gpiote_output_config_t;
+
+#define NRFX_GPIOTE_DEFAULT_OUTPUT_CONFIG { 0 }
+
+typedef struct {
+    uint8_t task_ch;
+    nrf_gpiote_polarity_t polarity;
+    nrf_gpiote_outinit_t init_val;
+} nrfx_gpiote_task_config_t;
+
+typedef struct {
+    uint8_t drv_inst_idx;
+} nrfx_gpiote_t;
+
+#define NRFX_GPIOTE_INSTANCE(id) { .drv_inst_idx = id }
+
+bool nrfx_gpiote_init_check(nrfx_gpiote_t const *p_instance);
+nrfx_err_t nrfx_gpiote_init(nrfx_gpiote_t const *p_instance, uint8_t interrupt_priority);
+nrfx_err_t nrfx_gpiote_channel_alloc(nrfx_gpiote_t const *p_instance, uint8_t *p_channel);
+nrfx_err_t nrfx_gpiote_output_configure(nrfx_gpiote_t const *p_instance, uint32_t pin,
+                                        nrfx_gpiote_output_config_t const *p_config,
+                                        nrfx_gpiote_task_config_t const *p_task_config);
+
+static inline void nrfx_gpiote_out_task_enable(nrfx_gpiote_t const *p_instance, uint32_t pin) {
+    (void)p_instance;
+    (void)pin;
+}
+
+static inline void nrfx_gpiote_set_task_trigger(nrfx_gpiote_t const *p_instance, uint32_t pin) {
+    (void)p_instance;
+    sim_gpio_write(pin, true);
+}
+
+static inline void nrfx_gpiote_clr_task_trigger(nrfx_gpiote_t const *p_instance, uint32_t pin) {
+    (void)p_instance;
+    sim_gpio_write(pin, false);
+}
+
+static inline uint32_t nrfx_gpiote_set_task_address_get(nrfx_gpiote_t const *p_instance,
+                                                        uint32_t pin) {
+    (void)p_instance;
+    return SIM_GPIOTE_TASK(pin, 1);
+}
+
+static inline uint32_t nrfx_gpiote_clr_task_address_get(nrfx_gpiote_t const *p_instance,
+                                                        uint32_t pin) {
+    (void)p_instance;
+    return SIM_GPIOTE_TASK(pin, 0);
+}
+
+#endif
@@ -0,0 +1,418 @@
+#include <string.h>
+#include <time.h>
+#include <zephyr/sys/util.h>
+#include "nrfx_sim.h"
+#include "nrfx_timer.h"
+#include "nrfx_spim.h"
+#include "nrfx_gpiote.h"
+#include "helpers/nrfx_gppi.h"
+#include "hal/nrf_gpio.h"
+
+#define SIM_SPIM_END_EVENT(idx) (0x40000000 | ((idx) << 12) | 0x118)
+#define SIM_GPIO_PINS 64
+
+NRF_TIMER_Type sim_timers[SIM_TIMER_COUNT];
+NRF_GPIO_Type sim_gpio_ports[2] = { { 0 }, { 1 } };
+
+// hw_time is when the last peripheral event happened, cpu_time what the
+// code running now sees. They differ by the ISR entry latency while a
+// handler runs.
+static uint64_t hw_time;
+static uint64_t cpu_time;
+static uint32_t latency_max;
+static uint32_t rng_state = 0x2545F491;
+static struct sim_isr_cost isr_cost[SIM_TIMER_CC_COUNT];
+
+static bool gpio_state[SIM_GPIO_PINS];
+static sim_gpio_listener_t gpio_listener;
+
+struct sim_spim {
+    nrfx_spim_evt_handler_t handler;
+    void *context;
+    uint32_t ticks_per_byte;
+    bool busy;
+    uint64_t end_time;
+    nrfx_spim_xfer_desc_t xfer;
+};
+static struct sim_spim spims[SIM_SPIM_COUNT];
+
+struct sim_gppi {
+    bool allocated;
+    bool enabled;
+    uint32_t eep;
+    uint32_t tep[2];
+};
+static struct sim_gppi gppi[SIM_GPPI_CHANNELS];
+static bool gpiote_initialized;
+static uint8_t gpiote_channels;
+
+uint64_t sim_host_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t latency_draw(void) {
+    if (latency_max == 0) {
+        return 0;
+    }
+    // xorshift32, reproducible from run to run
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state % (latency_max + 1);
+}
+
+// A handler sees the counter at its delayed time, which can be past a
+// COMPARE0 clear that the event loop has not processed yet
+static uint32_t timer_counter(NRF_TIMER_Type const *timer, uint64_t t) {
+    uint64_t count = t - timer->start;
+
+    if (!timer->enabled) {
+        return 0;
+    }
+    if ((timer->shorts & NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK) && timer->cc[0] &&
+        count > timer->cc[0]) {
+        count %= timer->cc[0];
+    }
+    return (uint32_t)count;
+}
+
+uint64_t sim_now(void) {
+    return cpu_time;
+}
+
+void sim_latency_set(uint32_t max_ticks) {
+    latency_max = max_ticks;
+}
+
+void sim_isr_cost_get(int channel, struct sim_isr_cost *cost) {
+    *cost = isr_cost[channel];
+}
+
+void sim_isr_cost_reset(void) {
+    memset(isr_cost, 0, sizeof(isr_cost));
+}
+
+void sim_gpio_listener_set(sim_gpio_listener_t listener) {
+    gpio_listener = listener;
+}
+
+bool sim_gpio_get(uint32_t pin) {
+    return gpio_state[pin % SIM_GPIO_PINS];
+}
+
+void sim_gpio_write(uint32_t pin, bool value) {
+    gpio_state[pin % SIM_GPIO_PINS] = value;
+    if (gpio_listener) {
+        gpio_listener(pin, value, cpu_time);
+    }
+}
+
+void sim_task_trigger(uint32_t task) {
+    if (task & 0x80000000) {
+        sim_gpio_write((task >> 1) & 0x3FF, task & 1);
+    }
+}
+
+static void event_publish(uint32_t eep) {
+    for (int i = 0; i < SIM_GPPI_CHANNELS; i++) {
+        if (!gppi[i].enabled || gppi[i].eep != eep) {
+            continue;
+        }
+        for (int j = 0; j < 2; j++) {
+            if (gppi[i].tep[j]) {
+                sim_task_trigger(gppi[i].tep[j]);
+            }
+        }
+    }
+}
+
+// Channels of the timer whose compare events fire next, and when. With the
+// COMPARE0 clear short nothing beyond CC0 is reached before the clear.
+static uint32_t timer_next(NRF_TIMER_Type const *timer, uint64_t *when) {
+    uint64_t delta[SIM_TIMER_CC_COUNT];
+    uint64_t best = UINT64_MAX;
+    uint32_t mask = 0;
+    uint32_t count = timer_counter(timer, hw_time);
+
+    if (!timer->enabled || !timer->handler) {
+        return 0;
+    }
+    for (int ch = 0; ch < SIM_TIMER_CC_COUNT; ch++) {
+        // A CC value written by a late handler only matches once the
+        // counter reaches it after the write
+        uint64_t from = MAX(hw_time, timer->armed_at[ch]);
+        uint32_t from_count = from > hw_time ? timer_counter(timer, from) : count;
+
+        delta[ch] = (uint32_t)(timer->cc[ch] - from_count);
+        if (delta[ch] == 0) {
+            // Matched at the current tick already, next match after a wrap
+            delta[ch] = 1ULL << 32;
+        }
+        delta[ch] += from - hw_time;
+    }
+    for (int ch = 0; ch < SIM_TIMER_CC_COUNT; ch++) {
+        bool used = timer->int_mask & (1U << ch) ||
+                    (ch == 0 && timer->shorts & NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK);
+
+        if (!used) {
+            continue;
+        }
+        if ((timer->shorts & NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK) && delta[ch] > delta[0]) {
+            continue;
+        }
+        if (delta[ch] < best) {
+            best = delta[ch];
+            mask = 0;
+        }
+        if (delta[ch] == best) {
+            mask |= 1U << ch;
+        }
+    }
+    *when = hw_time + best;
+    return mask;
+}
+
+static void timer_fire(NRF_TIMER_Type *timer, uint32_t mask) {
+    for (int ch = 0; ch < SIM_TIMER_CC_COUNT; ch++) {
+        if (!(mask & (1U << ch))) {
+            continue;
+        }
+        if (ch == 0 && timer->shorts & NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK) {
+            timer->start = hw_time;
+        }
+        if (!(timer->int_mask & (1U << ch))) {
+            continue;
+        }
+
+        cpu_time = hw_time + latency_draw();
+        uint64_t t0 = sim_host_ns();
+        timer->handler((nrf_timer_event_t)ch, timer->context);
+        uint64_t spent = sim_host_ns() - t0;
+        cpu_time = hw_time;
+
+        isr_cost[ch].calls++;
+        isr_cost[ch].total_ns += spent;
+        if (spent > isr_cost[ch].max_ns) {
+            isr_cost[ch].max_ns = spent;
+        }
+    }
+}
+
+static void spim_fire(int idx) {
+    struct sim_spim *spim = &spims[idx];
+    nrfx_spim_evt_t evt = {
+        .type = NRFX_SPIM_EVENT_DONE,
+        .xfer_desc = spim->xfer,
+    };
+
+    spim->busy = false;
+    event_publish(SIM_SPIM_END_EVENT(idx));
+    if (spim->handler) {
+        spim->handler(&evt, spim->context);
+    }
+}
+
+void sim_run(uint64_t until) {
+    for (;;) {
+        uint64_t next = UINT64_MAX;
+        int timer_idx = -1;
+        int spim_idx = -1;
+        uint32_t mask = 0;
+
+        for (int i = 0; i < SIM_TIMER_COUNT; i++) {
+            uint64_t when;
+            uint32_t m = timer_next(&sim_timers[i], &when);
+
+            if (m && when < next) {
+                next = when;
+                timer_idx = i;
+                mask = m;
+            }
+        }
+        uint64_t timer_time = next;
+
+        for (int i = 0; i < SIM_SPIM_COUNT; i++) {
+            // A transfer ending at the same tick as a compare goes first
+            if (spims[i].busy && spims[i].end_time <= next) {
+                next = spims[i].end_time;
+                spim_idx = i;
+            }
+        }
+        if (next > until) {
+            break;
+        }
+
+        hw_time = next;
+        cpu_time = next;
+        if (spim_idx >= 0) {
+            spim_fire(spim_idx);
+        }
+        // The compares of the same tick fire now, looked up again they
+        // would count as matched already
+        if (timer_idx >= 0 && timer_time == next) {
+            timer_fire(&sim_timers[timer_idx], mask);
+        }
+    }
+    hw_time = until;
+    cpu_time = until;
+}
+
+// TIMER
+
+nrfx_err_t nrfx_timer_init(nrfx_timer_t const *p_instance, nrfx_timer_config_t const *p_config,
+                           nrfx_timer_event_handler_t timer_event_handler) {
+    NRF_TIMER_Type *timer = p_instance->p_reg;
+
+    memset(timer, 0, sizeof(*timer));
+    timer->handler = timer_event_handler;
+    timer->context = p_config->p_context;
+    return NRFX_SUCCESS;
+}
+
+void nrfx_timer_enable(nrfx_timer_t const *p_instance) {
+    if (!p_instance->p_reg->enabled) {
+        p_instance->p_reg->enabled = true;
+        p_instance->p_reg->start = cpu_time;
+    }
+}
+
+void nrfx_timer_disable(nrfx_timer_t const *p_instance) {
+    p_instance->p_reg->enabled = false;
+}
+
+bool nrfx_timer_is_enabled(nrfx_timer_t const *p_instance) {
+    return p_instance->p_reg->enabled;
+}
+
+void nrfx_timer_clear(nrfx_timer_t const *p_instance) {
+    p_instance->p_reg->start = cpu_time;
+}
+
+uint32_t nrfx_timer_capture(nrfx_timer_t const *p_instance, nrf_timer_cc_channel_t cc_channel) {
+    NRF_TIMER_Type *timer = p_instance->p_reg;
+
+    timer->cc[cc_channel] = timer_counter(timer, cpu_time);
+    return timer->cc[cc_channel];
+}
+
+void nrf_timer_task_trigger(NRF_TIMER_Type *p_reg, nrf_timer_task_t task) {
+    p_reg->cc[task] = timer_counter(p_reg, cpu_time);
+}
+
+void nrfx_timer_extended_compare(nrfx_timer_t const *p_instance, nrf_timer_cc_channel_t cc_channel,
+                                 uint32_t cc_value, uint32_t timer_short_mask, bool enable_int) {
+    NRF_TIMER_Type *timer = p_instance->p_reg;
+
+    timer->cc[cc_channel] = cc_value;
+    timer->armed_at[cc_channel] = cpu_time;
+    timer->shorts |= timer_short_mask;
+    if (enable_int) {
+        timer->int_mask |= 1U << cc_channel;
+    } else {
+        timer->int_mask &= ~(1U << cc_channel);
+    }
+}
+
+void nrfx_timer_compare_int_enable(nrfx_timer_t const *p_instance, uint32_t channel) {
+    p_instance->p_reg->int_mask |= 1U << channel;
+}
+
+void nrfx_timer_compare_int_disable(nrfx_timer_t const *p_instance, uint32_t channel) {
+    p_instance->p_reg->int_mask &= ~(1U << channel);
+}
+
+// SPIM, clocks out the TX buffer at the configured frequency
+
+nrfx_err_t nrfx_spim_init(nrfx_spim_t const *p_instance, nrfx_spim_config_t const *p_config,
+                          nrfx_spim_evt_handler_t handler, void *p_context) {
+    struct sim_spim *spim = &spims[p_instance->drv_inst_idx];
+
+    memset(spim, 0, sizeof(*spim));
+    spim->handler = handler;
+    spim->context = p_context;
+    spim->ticks_per_byte = (uint64_t)SIM_BASE_FREQUENCY * 8 / p_config->frequency;
+    return NRFX_SUCCESS;
+}
+
+nrfx_err_t nrfx_spim_xfer(nrfx_spim_t const *p_instance, nrfx_spim_xfer_desc_t const *p_xfer_desc,
+                          uint32_t flags) {
+    struct sim_spim *spim = &spims[p_instance->drv_inst_idx];
+
+    // Held and repeated transfers need (D)PPI triggers, not modelled
+    if (flags) {
+        return NRFX_ERROR_INVALID_PARAM;
+    }
+    if (spim->busy) {
+        return NRFX_ERROR_BUSY;
+    }
+    spim->busy = true;
+    spim->xfer = *p_xfer_desc;
+    spim->end_time = cpu_time + MAX(p_xfer_desc->tx_length, p_xfer_desc->rx_length) *
+                                spim->ticks_per_byte;
+    return NRFX_SUCCESS;
+}
+
+uint32_t nrfx_spim_end_event_address_get(nrfx_spim_t const *p_instance) {
+    return SIM_SPIM_END_EVENT(p_instance->drv_inst_idx);
+}
+
+// GPIOTE
+
+bool nrfx_gpiote_init_check(nrfx_gpiote_t const *p_instance) {
+    return gpiote_initialized;
+}
+
+nrfx_err_t nrfx_gpiote_init(nrfx_gpiote_t const *p_instance, uint8_t interrupt_priority) {
+    gpiote_initialized = true;
+    return NRFX_SUCCESS;
+}
+
+nrfx_err_t nrfx_gpiote_channel_alloc(nrfx_gpiote_t const *p_instance, uint8_t *p_channel) {
+    if (gpiote_channels == 8) {
+        return NRFX_ERROR_NO_MEM;
+    }
+    *p_channel = gpiote_channels++;
+    return NRFX_SUCCESS;
+}
+
+nrfx_err_t nrfx_gpiote_output_configure(nrfx_gpiote_t const *p_instance, uint32_t pin,
+                                        nrfx_gpiote_output_config_t const *p_config,
+                                        nrfx_gpiote_task_config_t const *p_task_config) {
+    if (p_task_config) {
+        sim_gpio_write(pin, p_task_config->init_val == NRF_GPIOTE_INITIAL_VALUE_HIGH);
+    }
+    return NRFX_SUCCESS;
+}
+
+// GPPI
+
+nrfx_err_t nrfx_gppi_channel_alloc(uint8_t *p_channel) {
+    for (int i = 0; i < SIM_GPPI_CHANNELS; i++) {
+        if (!gppi[i].allocated) {
+            gppi[i].allocated = true;
+            *p_channel = i;
+            return NRFX_SUCCESS;
+        }
+    }
+    return NRFX_ERROR_NO_MEM;
+}
+
+void nrfx_gppi_channel_endpoints_setup(uint8_t channel, uint32_t eep, uint32_t tep) {
+    gppi[channel].eep = eep;
+    gppi[channel].tep[0] = tep;
+}
+
+void nrfx_gppi_fork_endpoint_setup(uint8_t channel, uint32_t fork_tep) {
+    gppi[channel].tep[1] = fork_tep;
+}
+
+void nrfx_gppi_channels_enable(uint32_t mask) {
+    for (int i = 0; i < SIM_GPPI_CHANNELS; i++) {
+        if (mask & (1U << i)) {
+            gppi[i].enabled = true;
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef NRFX_SIM_H
+#define NRFX_SIM_H
+
+// Host stand-in for the parts of nrfx used by the stimulation engine.
+// Every peripheral runs off one simulated 16 MHz clock that only moves in
+// sim_run(), which fires compare and SPIM END events in time order and
+// calls the registered handlers synchronously.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef int nrfx_err_t;
+
+#define NRFX_SUCCESS        0
+#define NRFX_ERROR_BUSY     1
+#define NRFX_ERROR_NO_MEM   2
+#define NRFX_ERROR_INVALID_PARAM 3
+
+#define SIM_BASE_FREQUENCY  16000000
+#define SIM_TIMER_COUNT     3
+#define SIM_TIMER_CC_COUNT  6
+
+// Simulated time in timer ticks
+uint64_t sim_now(void);
+// Host monotonic clock, for measuring how long the simulation takes
+uint64_t sim_host_ns(void);
+// Run all peripheral events up to and including the given time
+void sim_run(uint64_t until);
+// ISR entry latency, uniformly drawn from 0..max_ticks for every handler
+// call. Captures taken by a handler see the delayed time.
+void sim_latency_set(uint32_t max_ticks);
+
+// Host time spent in the TIMER handler, per compare channel
+struct sim_isr_cost {
+    uint64_t calls;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+void sim_isr_cost_get(int channel, struct sim_isr_cost *cost);
+void sim_isr_cost_reset(void);
+
+// Called on every GPIO output change with the simulated time of the write
+typedef void (*sim_gpio_listener_t)(uint32_t pin, bool value, uint64_t time);
+void sim_gpio_listener_set(sim_gpio_listener_t listener);
+bool sim_gpio_get(uint32_t pin);
+
+// Internal, used by the stand-in headers
+void sim_gpio_write(uint32_t pin, bool value);
+void sim_task_trigger(uint32_t task);
+
+#endif
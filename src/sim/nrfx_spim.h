@@ -0,0 +1,62 @@
+#ifndef NRFX_SPIM_SIM_H
+#define NRFX_SPIM_SIM_H
+
+#include <stddef.h>
+#include "nrfx_sim.h"
+
+#define SIM_SPIM_COUNT 5
+
+#define NRF_SPIM_PIN_NOT_CONNECTED 0xFFFFFFFF
+
+typedef struct {
+    uint8_t const *p_tx_buffer;
+    size_t tx_length;
+    uint8_t *p_rx_buffer;
+    size_t rx_length;
+} nrfx_spim_xfer_desc_t;
+
+#define NRFX_SPIM_XFER_TX(p_buf, length) { \
+    .p_tx_buffer = (uint8_t const *)(p_buf), \
+    .tx_length = (length),                  \
+}
+
+typedef enum {
+    NRFX_SPIM_EVENT_DONE,
+} nrfx_spim_evt_type_t;
+
+typedef struct {
+    nrfx_spim_evt_type_t type;
+    nrfx_spim_xfer_desc_t xfer_desc;
+} nrfx_spim_evt_t;
+
+typedef void (*nrfx_spim_evt_handler_t)(nrfx_spim_evt_t const *p_event, void *p_context);
+
+typedef struct {
+    uint32_t sck_pin;
+    uint32_t mosi_pin;
+    uint32_t miso_pin;
+    uint32_t ss_pin;
+    uint32_t frequency;
+} nrfx_spim_config_t;
+
+#define NRFX_SPIM_DEFAULT_CONFIG(_pin_sck, _pin_mosi, _pin_miso, _pin_ss) { \
+    .sck_pin = _pin_sck,        \
+    .mosi_pin = _pin_mosi,      \
+    .miso_pin = _pin_miso,      \
+    .ss_pin = _pin_ss,          \
+    .frequency = 4000000,       \
+}
+
+typedef struct {
+    uint8_t drv_inst_idx;
+} nrfx_spim_t;
+
+#define NRFX_SPIM_INSTANCE(id) { .drv_inst_idx = id }
+
+nrfx_err_t nrfx_spim_init(nrfx_spim_t const *p_instance, nrfx_spim_config_t const *p_config,
+                          nrfx_spim_evt_handler_t handler, void *p_context);
+nrfx_err_t nrfx_spim_xfer(nrfx_spim_t const *p_instance, nrfx_spim_xfer_desc_t const *p_xfer_desc,
+                          uint32_t flags);
+uint32_t nrfx_spim_end_event_address_get(nrfx_spim_t const *p_instance);
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef NRFX_TIMER_SIM_H
+#define NRFX_TIMER_SIM_H
+
+#include "nrfx_sim.h"
+
+typedef enum {
+    NRF_TIMER_CC_CHANNEL0 = 0,
+    NRF_TIMER_CC_CHANNEL1,
+    NRF_TIMER_CC_CHANNEL2,
+    NRF_TIMER_CC_CHANNEL3,
+    NRF_TIMER_CC_CHANNEL4,
+    NRF_TIMER_CC_CHANNEL5,
+} nrf_timer_cc_channel_t;
+
+typedef enum {
+    NRF_TIMER_EVENT_COMPARE0 = 0,
+    NRF_TIMER_EVENT_COMPARE1,
+    NRF_TIMER_EVENT_COMPARE2,
+    NRF_TIMER_EVENT_COMPARE3,
+    NRF_TIMER_EVENT_COMPARE4,
+    NRF_TIMER_EVENT_COMPARE5,
+} nrf_timer_event_t;
+
+// Only the capture tasks are modelled
+typedef enum {
+    NRF_TIMER_TASK_CAPTURE0 = 0,
+    NRF_TIMER_TASK_CAPTURE1,
+    NRF_TIMER_TASK_CAPTURE2,
+    NRF_TIMER_TASK_CAPTURE3,
+    NRF_TIMER_TASK_CAPTURE4,
+    NRF_TIMER_TASK_CAPTURE5,
+} nrf_timer_task_t;
+
+typedef enum {
+    NRF_TIMER_BIT_WIDTH_32 = 3,
+} nrf_timer_bit_width_t;
+
+#define NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK (1 << 0)
+
+typedef void (*nrfx_timer_event_handler_t)(nrf_timer_event_t event_type, void *p_context);
+
+typedef struct {
+    bool enabled;
+    uint64_t start;             // simulated time of the last counter zero
+    uint32_t cc[SIM_TIMER_CC_COUNT];
+    uint64_t armed_at[SIM_TIMER_CC_COUNT];  // simulated time of the last CC write
+    uint32_t int_mask;
+    uint32_t shorts;
+    nrfx_timer_event_handler_t handler;
+    void *context;
+} NRF_TIMER_Type;
+
+extern NRF_TIMER_Type sim_timers[SIM_TIMER_COUNT];
+#define NRF_TIMER0 (&sim_timers[0])
+
+typedef struct {
+    NRF_TIMER_Type *p_reg;
+    uint8_t instance_id;
+    uint8_t cc_channel_count;
+} nrfx_timer_t;
+
+#define NRFX_TIMER_INSTANCE(id) {       \
+    .p_reg = &sim_timers[id],           \
+    .instance_id = id,                  \
+    .cc_channel_count = SIM_TIMER_CC_COUNT, \
+}
+
+typedef struct {
+    uint32_t frequency;
+    nrf_timer_bit_width_t bit_width;
+    uint8_t interrupt_priority;
+    void *p_context;
+} nrfx_timer_config_t;
+
+#define NRFX_TIMER_DEFAULT_CONFIG(_frequency) { \
+    .frequency = _frequency,                    \
+    .bit_width = NRF_TIMER_BIT_WIDTH_32,        \
+}
+
+#define NRF_TIMER_BASE_FREQUENCY_GET(p_reg) SIM_BASE_FREQUENCY
+
+nrfx_err_t nrfx_timer_init(nrfx_timer_t const *p_instance, nrfx_timer_config_t const *p_config,
+                           nrfx_timer_event_handler_t timer_event_handler);
+void nrfx_timer_enable(nrfx_timer_t const *p_instance);
+void nrfx_timer_disable(nrfx_timer_t const *p_instance);
+bool nrfx_timer_is_enabled(nrfx_timer_t const *p_instance);
+void nrfx_timer_clear(nrfx_timer_t const *p_instance);
+uint32_t nrfx_timer_capture(nrfx_timer_t const *p_instance, nrf_timer_cc_channel_t cc_channel);
+void nrfx_timer_extended_compare(nrfx_timer_t const *p_instance, nrf_timer_cc_channel_t cc_channel,
+                                 uint32_t cc_value, uint32_t timer_short_mask, bool enable_int);
+void nrfx_timer_compare_int_enable(nrfx_timer_t const *p_instance, uint32_t channel);
+void nrfx_timer_compare_int_disable(nrfx_timer_t const *p_instance, uint32_t channel);
+void nrf_timer_task_trigger(NRF_TIMER_Type *p_reg, nrf_timer_task_t task);
+
+static inline nrf_timer_task_t nrf_timer_capture_task_get(uint8_t channel) {
+    return (nrf_timer_task_t)channel;
+}
+
+static inline uint32_t nrf_timer_cc_get(NRF_TIMER_Type const *p_reg,
+                                        nrf_timer_cc_channel_t cc_channel) {
+    return p_reg->cc[cc_channel];
+}
+
+static inline uint32_t nrfx_timer_capture_get(nrfx_timer_t const *p_instance,
+                                              nrf_timer_cc_channel_t cc_channel) {
+    return p_instance->p_reg->cc[cc_channel];
+}
+
+static inline uint32_t nrfx_timer_us_to_ticks(nrfx_timer_t const *p_instance, uint32_t time_us) {
+    (void)p_instance;
+    return (uint32_t)((uint64_t)time_us * (SIM_BASE_FREQUENCY / 1000000));
+}
+
+// Compare events are delivered straight to the handler, nothing is latched
+static inline void nrf_timer_event_clear(NRF_TIMER_Type *p_reg, nrf_timer_event_t event) {
+    (void)p_reg;
+    (void)event;
+}
+
+static inline bool nrf_timer_event_check(NRF_TIMER_Type const *p_reg, nrf_timer_event_t event) {
+    (void)p_reg;
+    (void)event;
+    return false;
+}
+
+static inline void nrf_timer_cc_set(NRF_TIMER_Type *p_reg, nrf_timer_cc_channel_t cc_channel,
+                                    uint32_t cc_value) {
+    p_reg->cc[cc_channel] = cc_value;
+    p_reg->armed_at[cc_channel] = sim_now();
+}
+
+#endif
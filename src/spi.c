@@ -1,74 +1,341 @@
 #include <nrfx_spim.h>
+#include <nrfx_gpiote.h>
+#include <helpers/nrfx_gppi.h>
 #include <zephyr/kernel.h>
 #include <zephyr/device.h>
 #include <hal/nrf_gpio.h>
 #include "spi.h"
+#include "timer.h"
+#include "trace.h"
+#include "evlog.h"
+
+BUILD_ASSERT((DAC_QUEUE_LEN & (DAC_QUEUE_LEN - 1)) == 0, "DAC_QUEUE_LEN must be a power of two");
 
 static nrfx_spim_t spim_inst = NRFX_SPIM_INSTANCE(SPIM_INST_IDX);
+static const nrfx_gpiote_t gpiote = NRFX_GPIOTE_INSTANCE(GPIOTE_INST_IDX);
 static void spim_handler(nrfx_spim_evt_t const * p_event, void * p_context);
-uint8_t dac1_buf_tx[DAC_TX_LEN] = {0x52, 0x53};
-uint8_t dac2_buf_tx[DAC_TX_LEN] = {0x54, 0x55};
-uint8_t dac1_buf_rx[DAC_RX_LEN];
-uint8_t dac2_buf_rx[DAC_RX_LEN];
 
-void cs_select(uint32_t pin_number) {
-    nrf_gpio_pin_clear(pin_number);  // Drive CS low (active)
+// A daisy chain shares the DAC1 CS line
+#if defined(CONFIG_STIM_DAC_CHAIN)
+#define DAC_CS_COUNT 1
+#else
+#define DAC_CS_COUNT DAC_COUNT
+#endif
+
+static const uint32_t dac_cs_pins[DAC_COUNT] = {
+    NRF_GPIO_PIN_MAP(0, DAC1_CS_PIN),
+#if defined(CONFIG_STIM_DAC_CHAIN)
+    NRF_GPIO_PIN_MAP(0, DAC1_CS_PIN),
+#else
+    NRF_GPIO_PIN_MAP(0, DAC2_CS_PIN),
+#endif
+};
+
+// Power-on codes of the staged frames
+static const uint16_t dac_power_on[DAC_COUNT] = {
+    [DAC1] = 0x5253,
+    [DAC2] = 0x5455,
+};
+
+// Staged frame per DAC. Threads write the back buffer and flip, the ISR
+// copies the front buffer into the queue, so neither side waits on the other.
+static uint8_t dac_frames[DAC_COUNT][2][DAC_TX_LEN];
+static atomic_t dac_front[DAC_COUNT];
+
+// Pending transfers. Each descriptor owns its frame so EasyDMA never reads
+// a buffer that is being restaged.
+struct dac_xfer {
+    uint8_t dac;
+    bool ldac;              // pulse LDAC once the frame is out
+    uint8_t tx[DAC_TX_LEN];
+};
+static struct dac_xfer dac_queue[DAC_QUEUE_LEN];
+static uint32_t dac_queue_head;     // frame on the bus, or next to start
+static uint32_t dac_queue_tail;     // next free descriptor
+static bool dac_busy;
+static spi_dac_done_cb_t dac_done_cb;
+
+#if defined(CONFIG_STIM_HW_SEQUENCER)
+// Both DAC frames of one period back to back, so the SPIM TX pointer can
+// post-increment from the DAC1 frame to the DAC2 frame between two STARTs
+static uint8_t dac_seq_tx[2][DAC_TX_LEN];
+#endif
+
+void spi_dac_cs_select(enum dac_id dac) {
+    // Deselect happens in hardware on SPIM END, see spi_init
+    nrfx_gpiote_clr_task_trigger(&gpiote, dac_cs_pins[dac]);
+}
+
+void spi_dac_set_callback(spi_dac_done_cb_t cb) {
+    dac_done_cb = cb;
+}
+
+void spi_dac_stage(enum dac_id dac, const uint8_t *tx_data) {
+    int back = !atomic_get(&dac_front[dac]);
+
+    memcpy(dac_frames[dac][back], tx_data, DAC_TX_LEN);
+    atomic_set(&dac_front[dac], back);
+}
+
+void spi_dac_staged(enum dac_id dac, uint8_t *tx_data) {
+    memcpy(tx_data, dac_frames[dac][atomic_get(&dac_front[dac])], DAC_TX_LEN);
+}
+
+// Caller holds the IRQ lock
+static void dac_start_next(void) {
+    while (dac_queue_head != dac_queue_tail) {
+        struct dac_xfer *xfer = &dac_queue[dac_queue_head & (DAC_QUEUE_LEN - 1)];
+        nrfx_spim_xfer_desc_t xfer_desc = NRFX_SPIM_XFER_TX(xfer->tx, DAC_TX_LEN);
+
+        spi_dac_cs_select(xfer->dac);
+        if (nrfx_spim_xfer(&spim_inst, &xfer_desc, 0) == NRFX_SUCCESS) {
+            dac_busy = true;
+            return;
+        }
+        // Drop the frame and release CS, the caller is told via the callback
+        nrfx_gpiote_set_task_trigger(&gpiote, dac_cs_pins[xfer->dac]);
+        trace_put(TRACE_SPI_DONE | xfer->dac, -EIO, dac_frame_code(xfer->dac, xfer->tx),
+                  timer_timestamp());
+        evlog_put(EVLOG_DAC_XFER_FAILED, xfer->dac, dac_frame_code(xfer->dac, xfer->tx));
+        dac_queue_head++;
+        if (dac_done_cb) {
+            dac_done_cb(xfer->dac, -EIO);
+        }
+    }
+    dac_busy = false;
+}
+
+// Caller holds the IRQ lock
+static int dac_queue_put(enum dac_id dac, const uint8_t *tx_data, bool ldac) {
+    if (dac_queue_tail - dac_queue_head == DAC_QUEUE_LEN) {
+        evlog_put(EVLOG_DAC_QUEUE_FULL, dac, 0);
+        return -ENOBUFS;
+    }
+
+    struct dac_xfer *xfer = &dac_queue[dac_queue_tail & (DAC_QUEUE_LEN - 1)];
+    xfer->dac = dac;
+    xfer->ldac = ldac;
+    memcpy(xfer->tx, tx_data, DAC_TX_LEN);
+    dac_queue_tail++;
+
+    if (!dac_busy) {
+        dac_start_next();
+    }
+    return 0;
+}
+
+int spi_dac_write(enum dac_id dac) {
+    unsigned int key = irq_lock();
+    int err = dac_queue_put(dac, dac_frames[dac][atomic_get(&dac_front[dac])], DAC_LDAC_EVERY_FRAME);
+
+    irq_unlock(key);
+    return err;
 }
 
-void cs_deselect(uint32_t pin_number) {
-    nrf_gpio_pin_set(pin_number);     // Drive CS high (inactive)
+int spi_dac_write_frame(enum dac_id dac, const uint8_t *tx_data) {
+    unsigned int key = irq_lock();
+    int err = dac_queue_put(dac, tx_data, DAC_LDAC_EVERY_FRAME);
+
+    irq_unlock(key);
+    return err;
 }
 
-void spi_write_dac1(uint8_t *tx_data, uint8_t *rx_data) {
-    // Select DAC1
-    cs_select(DAC1_CS_PIN);
-    memset(rx_data, 0, DAC_RX_LEN); // Clear RX buffer
-    // Prepare transfer descriptor
-    nrfx_spim_xfer_desc_t xfer_desc = NRFX_SPIM_XFER_TRX(tx_data, DAC_TX_LEN, rx_data, DAC_RX_LEN);
-    
-    // Perform the transfer
-    nrfx_err_t err = nrfx_spim_xfer(&spim_inst, &xfer_desc, 0);
-    if(err != NRFX_SUCCESS){
-        printf("SPI ERROR\n");
+int spi_dac_write_all(const uint16_t *code) {
+    // The queue is shared with the stimulation ISRs, which irq_lock does
+    // not hold off once they are zero-latency interrupts
+    if (IS_ENABLED(CONFIG_STIM_ZLI)) {
+        return -ENOTSUP;
+    }
+    // The DPPI engines own the SPIM, a CPU started transfer would move
+    // TXD.PTR off their armed frame list
+    if (IS_ENABLED(CONFIG_STIM_HW_SEQUENCER) || IS_ENABLED(CONFIG_STIM_WAVEFORM) ||
+        IS_ENABLED(CONFIG_STIM_BURST)) {
+        return -ENOTSUP;
+    }
+
+    uint8_t tx[DAC_TX_LEN];
+    unsigned int key = irq_lock();
+    int err = 0;
+
+#if defined(CONFIG_STIM_DAC_CHAIN)
+    dac_frame_all(code, tx);
+    err = dac_queue_put(DAC1, tx, false);
+#else
+    // All or none, so the LDAC pulse always follows the whole group
+    if (DAC_QUEUE_LEN - (dac_queue_tail - dac_queue_head) < DAC_COUNT) {
+        evlog_put(EVLOG_DAC_QUEUE_FULL, DAC1, 0);
+        err = -ENOBUFS;
     }
-    cs_deselect(DAC1_CS_PIN);
+    for (int i = 0; i < DAC_COUNT && !err; i++) {
+        dac_frame_input(i, code[i], tx);
+        err = dac_queue_put(i, tx, IS_ENABLED(CONFIG_STIM_DAC_LDAC) && i == DAC_COUNT - 1);
+    }
+#endif
+    irq_unlock(key);
+    return err;
 }
 
-void spi_write_dac2(uint8_t *tx_data, uint8_t *rx_data) {
-    // Select DAC1
-    cs_select(DAC2_CS_PIN);
-    memset(rx_data, 0, DAC_RX_LEN); // Clear RX buffer
-    // Prepare transfer descriptor
-    nrfx_spim_xfer_desc_t xfer_desc = NRFX_SPIM_XFER_TRX(tx_data, DAC_TX_LEN, rx_data, DAC_RX_LEN);
-    
-    // Perform the transfer
-    nrfx_err_t err = nrfx_spim_xfer(&spim_inst, &xfer_desc, 0);
-    if(err != NRFX_SUCCESS){
-        printf("SPI ERROR\n");
+// GPIOTE task output, idle high
+static int cs_init(uint32_t pin) {
+    uint8_t ch;
+    if (nrfx_gpiote_channel_alloc(&gpiote, &ch) != NRFX_SUCCESS) {
+        return -ENOMEM;
+    }
+
+    nrfx_gpiote_output_config_t out_config = NRFX_GPIOTE_DEFAULT_OUTPUT_CONFIG;
+    nrfx_gpiote_task_config_t task_config = {
+        .task_ch = ch,
+        .polarity = NRF_GPIOTE_POLARITY_TOGGLE,
+        .init_val = NRF_GPIOTE_INITIAL_VALUE_HIGH,
+    };
+    if (nrfx_gpiote_output_configure(&gpiote, pin, &out_config, &task_config) != NRFX_SUCCESS) {
+        return -EIO;
     }
-    cs_deselect(DAC2_CS_PIN);
+    nrfx_gpiote_out_task_enable(&gpiote, pin);
+    return 0;
 }
+
+// CS lines are GPIOTE task outputs. SPIM END releases them through (D)PPI,
+// so the DAC latches its frame right after the last bit regardless of how
+// late the SPIM interrupt is serviced.
+static int cs_hw_init(void) {
+    uint8_t ch;
+    int err = 0;
+
+    if (!nrfx_gpiote_init_check(&gpiote)) {
+        nrfx_gpiote_init(&gpiote, 0);
+    }
+    for (int i = 0; i < DAC_CS_COUNT && !err; i++) {
+        err = cs_init(dac_cs_pins[i]);
+    }
+#if defined(CONFIG_STIM_DAC_LDAC)
+    err = err ? err : cs_init(NRF_GPIO_PIN_MAP(0, DAC_LDAC_PIN));
+#endif
+    if (err) {
+        return err;
+    }
+
+    if (nrfx_gppi_channel_alloc(&ch) != NRFX_SUCCESS) {
+        return -ENOMEM;
+    }
+    nrfx_gppi_channel_endpoints_setup(ch, nrfx_spim_end_event_address_get(&spim_inst),
+                                      nrfx_gpiote_set_task_address_get(&gpiote, dac_cs_pins[DAC1]));
+    for (int i = 1; i < DAC_CS_COUNT; i++) {
+        nrfx_gppi_fork_endpoint_setup(ch, nrfx_gpiote_set_task_address_get(&gpiote, dac_cs_pins[i]));
+    }
+    nrfx_gppi_channels_enable(BIT(ch));
+    return 0;
+}
+
 void spi_init(){
+    uint8_t setup[DAC_TX_LEN];
+
+    for (int i = 0; i < DAC_COUNT; i++) {
+        dac_frame(i, dac_power_on[i], dac_frames[i][0]);
+    }
+
     nrfx_spim_config_t spim_config = NRFX_SPIM_DEFAULT_CONFIG(SCK_PIN,
                                                               MOSI_PIN,
                                                               MISO_PIN,
                                                               NRF_SPIM_PIN_NOT_CONNECTED);
 
-    spim_config.frequency = 8000000;
+    spim_config.frequency = SPIM_FREQ_HZ;
     nrfx_err_t status = nrfx_spim_init(&spim_inst, &spim_config, spim_handler, NULL);
     if (status == NRFX_SUCCESS) {
-        printf("SPI initialized successfully on SPIM%d\n", SPIM_INST_IDX);
+        printf("SPI initialized successfully on SPIM%d at %d MHz\n", SPIM_INST_IDX,
+               SPIM_FREQ_HZ / 1000000);
         printf("  SCK: P%d.%02d\n", (SCK_PIN >> 5), (SCK_PIN & 0x1F));
         printf("  MOSI: P%d.%02d\n", (MOSI_PIN >> 5), (MOSI_PIN & 0x1F)); 
         printf("  MISO: P%d.%02d\n", (MISO_PIN >> 5), (MISO_PIN & 0x1F));
     } else {
         printf("SPI initialization failed with error: %d\n", status);
     }
+
+    int err = cs_hw_init();
+    if (err) {
+        printf("DAC CS initialization failed with error: %d\n", err);
+    }
+
+    for (int n = dac_setup_frame(setup); n > 0; n--) {
+        spi_dac_write_frame(DAC1, setup);
+    }
 }
 
-static void spim_handler(nrfx_spim_evt_t const * p_event, void * p_context){
-    if (p_event->type == NRFX_SPIM_EVENT_DONE){
-        printf("Message received: %02X\n", p_event->xfer_desc.p_rx_buffer);
+#if defined(CONFIG_STIM_HW_SEQUENCER) || defined(CONFIG_STIM_WAVEFORM) || defined(CONFIG_STIM_BURST)
+// Point the SPIM at a list of back to back DAC frames. Each START sent
+// through (D)PPI clocks out one frame and advances to the next one.
+void spi_dac_list_arm(const uint8_t *frames) {
+    // Only loads the pointers, START comes from (D)PPI
+    nrfx_spim_xfer_desc_t xfer_desc = NRFX_SPIM_XFER_TX(frames, DAC_TX_LEN);
+    nrfx_err_t err = nrfx_spim_xfer(&spim_inst, &xfer_desc,
+                                    NRFX_SPIM_FLAG_HOLD_XFER |
+                                    NRFX_SPIM_FLAG_TX_POSTINC |
+                                    NRFX_SPIM_FLAG_REPEATED_XFER |
+                                    NRFX_SPIM_FLAG_NO_XFER_EVT_HANDLER);
+    // Called from the stimulation interrupts, so no console output here
+    if (err != NRFX_SUCCESS) {
+        evlog_put(EVLOG_DAC_LIST_FAILED, 0, err);
     }
 }
 
+uint32_t spi_start_task_address(void) {
+    return nrfx_spim_start_task_address_get(&spim_inst);
+}
+
+uint32_t spi_dac_cs_clr_task_address(enum dac_id dac) {
+    return nrfx_gpiote_clr_task_address_get(&gpiote, dac_cs_pins[dac]);
+}
+#endif
+
+#if defined(CONFIG_STIM_HW_SEQUENCER)
+void spi_dac_seq_arm(void) {
+    memcpy(dac_seq_tx[0], dac_frames[DAC1][atomic_get(&dac_front[DAC1])], DAC_TX_LEN);
+    memcpy(dac_seq_tx[1], dac_frames[DAC2][atomic_get(&dac_front[DAC2])], DAC_TX_LEN);
+    spi_dac_list_arm(dac_seq_tx[0]);
+}
+#endif
+
+#if defined(CONFIG_STIM_ZLI)
+// Same zero-latency level as the timer, so the two handlers still never
+// preempt each other
+ISR_DIRECT_DECLARE(spi_zli_isr)
+{
+    NRFX_SPIM_INST_HANDLER_GET(SPIM_INST_IDX)();
+    return 0;
+}
+#endif
+
+#if defined(CONFIG_STIM_DAC_LDAC)
+// END has already released CS. The wait covers the LDAC pulse width of
+// the supported chips.
+static void dac_ldac_pulse(void) {
+    nrfx_gpiote_clr_task_trigger(&gpiote, NRF_GPIO_PIN_MAP(0, DAC_LDAC_PIN));
+    k_busy_wait(1);
+    nrfx_gpiote_set_task_trigger(&gpiote, NRF_GPIO_PIN_MAP(0, DAC_LDAC_PIN));
+}
+#endif
+
+static void spim_handler(nrfx_spim_evt_t const * p_event, void * p_context){
+    if (p_event->type != NRFX_SPIM_EVENT_DONE) {
+        return;
+    }
+
+    unsigned int key = irq_lock();
+    struct dac_xfer *xfer = &dac_queue[dac_queue_head & (DAC_QUEUE_LEN - 1)];
+    enum dac_id dac = xfer->dac;
+
+#if defined(CONFIG_STIM_DAC_LDAC)
+    if (xfer->ldac) {
+        dac_ldac_pulse();
+    }
+#endif
+    trace_put(TRACE_SPI_DONE | dac, 0, dac_frame_code(dac, xfer->tx), timer_timestamp());
+    evlog_put_verbose(EVLOG_SPI_DONE, dac, dac_frame_code(dac, xfer->tx));
+    dac_queue_head++;
+    dac_start_next();
+    irq_unlock(key);
+
+    if (dac_done_cb) {
+        dac_done_cb(dac, 0);
+    }
+}
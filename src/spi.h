@@ -3,25 +3,58 @@
 #include <zephyr/kernel.h>
 #include <zephyr/device.h>
 #include <hal/nrf_gpio.h>
+#include "dac.h"
 
 #define DAC1_CS_PIN 16  // P0.16
 #define DAC2_CS_PIN 26  // P0.26
-#define DAC_TX_LEN			2
-#define DAC_RX_LEN			2
+#define DAC_LDAC_PIN 27 // P0.27, with STIM_DAC_LDAC
 
+#define GPIOTE_INST_IDX 0
+#if defined(CONFIG_STIM_DAC_SPIM_HS)
+// 32 MHz needs the dedicated SPIM4 pins
+#define SPIM_INST_IDX 4
+#define SPIM_FREQ_HZ 32000000
+#define MOSI_PIN NRF_GPIO_PIN_MAP(0, 9)
+#define MISO_PIN NRF_GPIO_PIN_MAP(0, 10)
+#define SCK_PIN NRF_GPIO_PIN_MAP(0, 8)
+#else
 #define SPIM_INST_IDX 1
+#define SPIM_FREQ_HZ 8000000
 #define MOSI_PIN NRF_GPIO_PIN_MAP(0, 7)
 #define MISO_PIN 25
 #define SCK_PIN NRF_GPIO_PIN_MAP(1, 2)   //1.02
+#endif
 
-void cs_select(uint32_t pin_number);
-void cs_deselect(uint32_t pin_number);
-void spi_write_dac1(uint8_t *tx_data, uint8_t *rx_data);
-void spi_write_dac2(uint8_t *tx_data, uint8_t *rx_data);
-void spi_init();
+// Number of DAC frames that can be waiting for the SPIM, power of two
+#define DAC_QUEUE_LEN 8
+
+// Called from the SPIM interrupt when a queued frame has been clocked out
+// and its CS line released. result is 0 or a negative errno.
+typedef void (*spi_dac_done_cb_t)(enum dac_id dac, int result);
 
-extern uint8_t dac1_buf_rx[DAC_RX_LEN];
-extern uint8_t dac1_buf_tx[DAC_TX_LEN];
-extern uint8_t dac2_buf_rx[DAC_RX_LEN];
-extern uint8_t dac2_buf_tx[DAC_TX_LEN]; 
-#endif
\ No newline at end of file
+void spi_init();
+void spi_dac_set_callback(spi_dac_done_cb_t cb);
+void spi_dac_stage(enum dac_id dac, const uint8_t *tx_data);
+void spi_dac_staged(enum dac_id dac, uint8_t *tx_data);
+int spi_dac_write(enum dac_id dac);
+// Queue the given frame instead of the staged one
+int spi_dac_write_frame(enum dac_id dac, const uint8_t *tx_data);
+// Set every DAC to its code so that the outputs change together: one
+// transfer in a daisy chain, else back to back frames latched by a single
+// LDAC pulse, or without LDAC each updating as its frame ends. From
+// threads only, -ENOTSUP with STIM_ZLI or a DPPI engine driving the SPIM.
+int spi_dac_write_all(const uint16_t *code);
+void spi_dac_cs_select(enum dac_id dac);
+#if defined(CONFIG_STIM_HW_SEQUENCER) || defined(CONFIG_STIM_WAVEFORM) || defined(CONFIG_STIM_BURST)
+void spi_dac_list_arm(const uint8_t *frames);
+uint32_t spi_start_task_address(void);
+uint32_t spi_dac_cs_clr_task_address(enum dac_id dac);
+#endif
+#if defined(CONFIG_STIM_HW_SEQUENCER)
+void spi_dac_seq_arm(void);
+#endif
+#if defined(CONFIG_STIM_ZLI)
+// Zero-latency entry of the DAC SPIM, for IRQ_DIRECT_CONNECT
+void spi_zli_isr(void);
+#endif
+#endif
@@ -0,0 +1,160 @@
+#include <zephyr/kernel.h>
+#include <string.h>
+#include "stats.h"
+
+// The ISR only ever writes the active bank, with plain stores and in
+// constant time. Readers flip the active bank, so from then on the old
+// bank is quiescent, fold it into the window totals and zero it. Every
+// snapshot therefore covers exactly the events recorded before the flip,
+// for all events and counters at once. The report totals get the same
+// folds and start over at every stats_get_delta, independent of the
+// window that stats_reset starts.
+
+struct stats_bank {
+    uint32_t count[STATS_HISTOGRAMS];
+    uint32_t max[STATS_HISTOGRAMS];
+    uint64_t sum[STATS_HISTOGRAMS];
+    uint32_t counter[STATS_COUNTERS];
+    uint32_t overrun[STATS_EVENTS];
+    uint32_t bucket[STATS_HISTOGRAMS][STATS_BUCKETS];
+};
+
+static struct stats_bank banks[2];
+static atomic_t active_bank;
+static struct stats_bank window;
+static int64_t window_start;
+static struct stats_bank report;
+static int64_t report_start;
+static K_MUTEX_DEFINE(stats_lock);
+
+uint32_t stats_bucket_index(uint32_t value) {
+    if (value < BIT(STATS_SUB_BITS)) {
+        return value;
+    }
+
+    uint32_t exp = 31 - __builtin_clz(value);
+    if (exp >= STATS_MAX_EXP) {
+        return STATS_OVERFLOW_BUCKET;
+    }
+    return ((exp - STATS_SUB_BITS + 1) << STATS_SUB_BITS) +
+           ((value >> (exp - STATS_SUB_BITS)) & (BIT(STATS_SUB_BITS) - 1));
+}
+
+// Largest value that lands in the bucket
+uint32_t stats_bucket_upper(uint32_t index) {
+    if (index < BIT(STATS_SUB_BITS)) {
+        return index;
+    }
+    if (index >= STATS_OVERFLOW_BUCKET) {
+        return UINT32_MAX;
+    }
+
+    uint32_t shift = (index >> STATS_SUB_BITS) - 1;
+    uint32_t lower = (BIT(STATS_SUB_BITS) + (index & (BIT(STATS_SUB_BITS) - 1))) << shift;
+    return lower + BIT(shift) - 1;
+}
+
+void stats_record(int event, uint32_t value) {
+    struct stats_bank *bank = &banks[atomic_get(&active_bank)];
+
+    bank->count[event]++;
+    bank->sum[event] += value;
+    if (value > bank->max[event]) {
+        bank->max[event] = value;
+    }
+    bank->bucket[event][stats_bucket_index(value)]++;
+}
+
+void stats_count(enum stats_counter counter, uint32_t n) {
+    banks[atomic_get(&active_bank)].counter[counter] += n;
+}
+
+void stats_overrun(int event) {
+    banks[atomic_get(&active_bank)].overrun[event]++;
+}
+
+static void bank_add(struct stats_bank *dst, const struct stats_bank *src) {
+    for (int i = 0; i < STATS_HISTOGRAMS; i++) {
+        dst->count[i] += src->count[i];
+        dst->sum[i] += src->sum[i];
+        dst->max[i] = MAX(dst->max[i], src->max[i]);
+        for (int b = 0; b < STATS_BUCKETS; b++) {
+            dst->bucket[i][b] += src->bucket[i][b];
+        }
+    }
+    for (int i = 0; i < STATS_COUNTERS; i++) {
+        dst->counter[i] += src->counter[i];
+    }
+    for (int i = 0; i < STATS_EVENTS; i++) {
+        dst->overrun[i] += src->overrun[i];
+    }
+}
+
+// Caller holds stats_lock
+static void stats_fold(void) {
+    int old = atomic_get(&active_bank);
+    struct stats_bank *bank = &banks[old];
+
+    atomic_set(&active_bank, !old);
+
+    bank_add(&window, bank);
+    bank_add(&report, bank);
+    memset(bank, 0, sizeof(*bank));
+}
+
+// Upper edge of the bucket holding the given fraction of the samples,
+// never above the exact maximum
+static uint32_t percentile(const struct stats_bank *totals, int event, uint32_t per_mille) {
+    uint64_t target = ((uint64_t)totals->count[event] * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+
+    for (int b = 0; b < STATS_BUCKETS; b++) {
+        seen += totals->bucket[event][b];
+        if (seen >= target && seen > 0) {
+            return MIN(stats_bucket_upper(b), totals->max[event]);
+        }
+    }
+    return totals->max[event];
+}
+
+// Caller holds stats_lock
+static void snapshot_fill(stats_snapshot *snap, const struct stats_bank *totals, int64_t start) {
+    for (int i = 0; i < STATS_HISTOGRAMS; i++) {
+        stats_event *ev = i == STATS_LATENCY ? &snap->latency :
+                          i == STATS_DEAD_TIME ? &snap->dead_time : &snap->event[i];
+
+        ev->count = totals->count[i];
+        ev->mean = totals->count[i] ? totals->sum[i] / totals->count[i] : 0;
+        ev->p50 = percentile(totals, i, 500);
+        ev->p99 = percentile(totals, i, 990);
+        ev->p999 = percentile(totals, i, 999);
+        ev->max = totals->max[i];
+    }
+    memcpy(snap->counter, totals->counter, sizeof(snap->counter));
+    memcpy(snap->overrun, totals->overrun, sizeof(snap->overrun));
+    snap->window_ms = k_uptime_get() - start;
+}
+
+void stats_get(stats_snapshot *snap) {
+    k_mutex_lock(&stats_lock, K_FOREVER);
+    stats_fold();
+    snapshot_fill(snap, &window, window_start);
+    k_mutex_unlock(&stats_lock);
+}
+
+void stats_get_delta(stats_snapshot *snap) {
+    k_mutex_lock(&stats_lock, K_FOREVER);
+    stats_fold();
+    snapshot_fill(snap, &report, report_start);
+    memset(&report, 0, sizeof(report));
+    report_start = k_uptime_get();
+    k_mutex_unlock(&stats_lock);
+}
+
+void stats_reset(void) {
+    k_mutex_lock(&stats_lock, K_FOREVER);
+    stats_fold();
+    memset(&window, 0, sizeof(window));
+    window_start = k_uptime_get();
+    k_mutex_unlock(&stats_lock);
+}
@@ -0,0 +1,72 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <zephyr/kernel.h>
+
+// One histogram per timeline entry, or per compare event of the fixed
+// four-event engine
+#if defined(CONFIG_STIM_TIMELINE)
+#define STATS_EVENTS CONFIG_STIM_TIMELINE_MAX_ENTRIES
+#else
+#define STATS_EVENTS 4
+#endif
+// Extra histogram for the stimulation timer IRQ entry latency, recorded
+// with stats_record(STATS_LATENCY, ticks) in timeline mode
+#define STATS_LATENCY STATS_EVENTS
+// Measured break before make gap of timeline entries with a dead time
+#define STATS_DEAD_TIME (STATS_EVENTS + 1)
+#define STATS_HISTOGRAMS (STATS_EVENTS + 2)
+
+// Log-linear histogram. Values below 2^STATS_SUB_BITS have a bucket each,
+// every power of two above that is split into 2^STATS_SUB_BITS buckets
+// (12.5 % resolution). Values from 2^STATS_MAX_EXP ticks (1 s at 16 MHz)
+// up share the last bucket.
+#define STATS_SUB_BITS 3
+#define STATS_MAX_EXP 24
+#define STATS_OVERFLOW_BUCKET ((STATS_MAX_EXP - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+#define STATS_BUCKETS (STATS_OVERFLOW_BUCKET + 1)
+
+enum stats_counter {
+    STATS_MISSED,       // events that did not come in schedule order, or
+                        // timeline entries whose compare was missed
+    STATS_MALFORMED,    // events off by more than the malformed tolerance
+    STATS_RECONFIG,     // schedule swaps done at a period boundary
+    STATS_PERIODS,      // timeline periods started
+    STATS_WAKEUPS,      // stimulation timer interrupts
+    STATS_ACTIVE_US,    // time the stimulation timer ran, STIM_IDLE only
+    STATS_COUNTERS
+};
+
+typedef struct {
+    uint32_t count;
+    uint32_t mean;
+    uint32_t p50;
+    uint32_t p99;
+    uint32_t p999;
+    uint32_t max;
+} stats_event;
+
+typedef struct {
+    stats_event event[STATS_EVENTS];
+    stats_event latency;    // compare event to ISR entry, timer ticks
+    stats_event dead_time;  // pin clear to pin set of a split entry, timer ticks
+    uint32_t counter[STATS_COUNTERS];
+    // Times the ISR found the compare of the event or entry already
+    // passed, handled by the STIM_OVERRUN policy
+    uint32_t overrun[STATS_EVENTS];
+    uint32_t window_ms;     // time since the last stats_reset
+} stats_snapshot;
+
+void stats_record(int event, uint32_t value);
+void stats_count(enum stats_counter counter, uint32_t n);
+void stats_overrun(int event);
+void stats_get(stats_snapshot *snap);
+// Snapshot of what was recorded since the previous call, window_ms is the
+// time since then. Not affected by stats_reset.
+void stats_get_delta(stats_snapshot *snap);
+void stats_reset(void);
+// Histogram bucket of a value and the largest value in a bucket, for other
+// modules keeping histograms in the same layout
+uint32_t stats_bucket_index(uint32_t value);
+uint32_t stats_bucket_upper(uint32_t index);
+#endif
@@ -0,0 +1,452 @@
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/gatt.h>
+#include <string.h>
+#include "stim_gatt.h"
+#include "timer.h"
+#include "spi.h"
+#include "BLE.h"
+#if defined(CONFIG_STIM_BURST)
+#include "burst.h"
+#endif
+#if defined(CONFIG_STIM_ACQ)
+#include "acq.h"
+#endif
+
+#define STATS_FRAME_MAX 244     // largest payload with a 247 byte ATT MTU
+// Counters, events, latency, dead time, bridge and acq
+#define STATS_RECORDS (STATS_EVENTS + 5)
+
+BUILD_ASSERT(STATS_COUNTERS + 1 <= STIM_GATT_STATS_VALUES, "Counters do not fit a stats record");
+BUILD_ASSERT(STATS_EVENTS < STIM_GATT_STATS_LATENCY, "Event ids collide with the stats record ids");
+
+// Stimulation control is only taken from an authenticated link when the
+// sample runs with security
+#if defined(CONFIG_BT_NUS_SECURITY_ENABLED)
+#define STIM_GATT_PERM_READ BT_GATT_PERM_READ_AUTHEN
+#define STIM_GATT_PERM_WRITE BT_GATT_PERM_WRITE_AUTHEN
+#else
+#define STIM_GATT_PERM_READ BT_GATT_PERM_READ
+#define STIM_GATT_PERM_WRITE BT_GATT_PERM_WRITE
+#endif
+
+#if defined(CONFIG_STIM_TIMELINE)
+#define SCHEDULE_VALUE_MAX (1 + sizeof(struct stim_gatt_timeline) + \
+                            STIM_MAX_ENTRIES * sizeof(struct stim_gatt_entry))
+#else
+#define SCHEDULE_VALUE_MAX (1 + sizeof(struct stim_gatt_schedule))
+#endif
+
+#if defined(CONFIG_STIM_TIMELINE)
+static int timeline_run(const uint8_t *data, uint16_t len) {
+    // Only the BT RX thread writes, too large for its stack
+    static stim_timeline timeline;
+    struct stim_gatt_timeline hdr;
+
+    if (len < sizeof(hdr)) {
+        return -EMSGSIZE;
+    }
+    memcpy(&hdr, data, sizeof(hdr));
+    if (len != sizeof(hdr) + hdr.count * sizeof(struct stim_gatt_entry)) {
+        return -EMSGSIZE;
+    }
+    if (hdr.count == 0 || hdr.count > STIM_MAX_ENTRIES) {
+        return -EINVAL;
+    }
+
+    timeline.period_us = hdr.period_us;
+    timeline.count = hdr.count;
+    for (int i = 0; i < hdr.count; i++) {
+        struct stim_gatt_entry wire;
+
+        memcpy(&wire, &data[sizeof(hdr) + i * sizeof(wire)], sizeof(wire));
+        timeline.entry[i] = (stim_entry) {
+            .offset_us = wire.offset_us,
+            .pin_set = wire.pin_set,
+            .pin_clear = wire.pin_clear,
+            .dac = wire.dac,
+            .flags = wire.flags,
+            .dac_word = wire.dac_word,
+        };
+    }
+    return stim_timeline_set(&timeline);
+}
+#endif
+
+#if defined(CONFIG_STIM_BURST)
+static int burst_run(const uint8_t *data, uint16_t len) {
+    struct stim_gatt_burst wire;
+
+    if (len != sizeof(wire)) {
+        return -EMSGSIZE;
+    }
+    memcpy(&wire, data, sizeof(wire));
+    if (wire.dac >= DAC_COUNT) {
+        return -EINVAL;
+    }
+
+    stim_burst burst = {
+        .pulse_hz = wire.pulse_hz,
+        .width_us = wire.width_us,
+        .pulses = wire.pulses,
+        .gap_us = wire.gap_us,
+        .amplitude = wire.amplitude,
+        .ramp_pulses = wire.ramp_pulses,
+        .dac = wire.dac,
+    };
+    return burst_set(&burst);
+}
+#endif
+
+static int control_run(uint8_t op, const uint8_t *data, uint16_t len) {
+    switch (op) {
+    case STIM_GATT_OP_SCHEDULE: {
+        struct stim_gatt_schedule wire;
+
+        if (len != sizeof(wire)) {
+            return -EMSGSIZE;
+        }
+        memcpy(&wire, data, sizeof(wire));
+        stim_schedule sched = {
+            .period_us = wire.period_us,
+            .event1_offset_us = wire.event1_offset_us,
+            .event2_offset_us = wire.event2_offset_us,
+            .event3_offset_us = wire.event3_offset_us,
+        };
+        return stim_schedule_set(&sched);
+    }
+#if defined(CONFIG_STIM_TIMELINE)
+    case STIM_GATT_OP_TIMELINE:
+        return timeline_run(data, len);
+#endif
+    case STIM_GATT_OP_STATS_RESET:
+        if (len) {
+            return -EMSGSIZE;
+        }
+        stats_reset();
+        return 0;
+    case STIM_GATT_OP_STATS_PUBLISH:
+        if (len) {
+            return -EMSGSIZE;
+        }
+        stim_gatt_stats_publish();
+        return 0;
+    case STIM_GATT_OP_STATS_INTERVAL: {
+        uint32_t interval_ms;
+
+        if (len != sizeof(interval_ms)) {
+            return -EMSGSIZE;
+        }
+        memcpy(&interval_ms, data, sizeof(interval_ms));
+        return stim_gatt_stats_interval_set(interval_ms);
+    }
+    case STIM_GATT_OP_DAC: {
+        uint16_t code[DAC_COUNT];
+
+        if (len != sizeof(code)) {
+            return -EMSGSIZE;
+        }
+        memcpy(code, data, sizeof(code));
+        return spi_dac_write_all(code);
+    }
+#if defined(CONFIG_STIM_BURST)
+    case STIM_GATT_OP_BURST:
+        return burst_run(data, len);
+    case STIM_GATT_OP_BURST_STOP:
+        if (len) {
+            return -EMSGSIZE;
+        }
+        burst_stop();
+        return 0;
+#endif
+    default:
+        return -ENOTSUP;
+    }
+}
+
+static ssize_t control_write(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+                             const void *buf, uint16_t len, uint16_t offset, uint8_t flags) {
+    const uint8_t *data = buf;
+
+    if (offset) {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    }
+    if (len == 0) {
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+
+    switch (control_run(data[0], &data[1], len - 1)) {
+    case 0:
+        return len;
+    case -EMSGSIZE:
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    case -ENOTSUP:
+        return BT_GATT_ERR(BT_ATT_ERR_NOT_SUPPORTED);
+    case -EINVAL:
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    default:
+        return BT_GATT_ERR(BT_ATT_ERR_UNLIKELY);
+    }
+}
+
+// Encoded again for every read, so a long read that spans a schedule
+// change can mix the two
+static uint16_t schedule_encode(uint8_t *value) {
+#if defined(CONFIG_STIM_TIMELINE)
+    static stim_timeline timeline;
+    struct stim_gatt_timeline hdr;
+
+    stim_timeline_get(&timeline);
+    value[0] = STIM_GATT_OP_TIMELINE;
+    hdr.period_us = timeline.period_us;
+    hdr.count = timeline.count;
+    memcpy(&value[1], &hdr, sizeof(hdr));
+    for (uint32_t i = 0; i < timeline.count; i++) {
+        struct stim_gatt_entry wire = {
+            .offset_us = timeline.entry[i].offset_us,
+            .pin_set = timeline.entry[i].pin_set,
+            .pin_clear = timeline.entry[i].pin_clear,
+            .dac = timeline.entry[i].dac,
+            .flags = timeline.entry[i].flags,
+            .dac_word = timeline.entry[i].dac_word,
+        };
+
+        memcpy(&value[1 + sizeof(hdr) + i * sizeof(wire)], &wire, sizeof(wire));
+    }
+    return 1 + sizeof(hdr) + timeline.count * sizeof(struct stim_gatt_entry);
+#else
+    stim_schedule sched;
+
+    stim_schedule_get(&sched);
+    struct stim_gatt_schedule wire = {
+        .period_us = sched.period_us,
+        .event1_offset_us = sched.event1_offset_us,
+        .event2_offset_us = sched.event2_offset_us,
+        .event3_offset_us = sched.event3_offset_us,
+    };
+
+    value[0] = STIM_GATT_OP_SCHEDULE;
+    memcpy(&value[1], &wire, sizeof(wire));
+    return 1 + sizeof(wire);
+#endif
+}
+
+static ssize_t schedule_read(struct bt_conn *conn, const struct bt_gatt_attr *attr,
+                             void *buf, uint16_t len, uint16_t offset) {
+    // Reads come from the BT RX thread only
+    static uint8_t value[SCHEDULE_VALUE_MAX];
+    uint16_t size = schedule_encode(value);
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, value, size);
+}
+
+// Attribute indices of the notified values
+#define STATS_ATTR 6
+#define TRACE_ATTR 9
+
+BT_GATT_SERVICE_DEFINE(stim_svc,
+    BT_GATT_PRIMARY_SERVICE(BT_UUID_DECLARE_128(STIM_GATT_UUID_SERVICE_VAL)),
+    BT_GATT_CHARACTERISTIC(BT_UUID_DECLARE_128(STIM_GATT_UUID_CONTROL_VAL),
+                           BT_GATT_CHRC_WRITE | BT_GATT_CHRC_WRITE_WITHOUT_RESP,
+                           STIM_GATT_PERM_WRITE, NULL, control_write, NULL),
+    BT_GATT_CHARACTERISTIC(BT_UUID_DECLARE_128(STIM_GATT_UUID_SCHEDULE_VAL),
+                           BT_GATT_CHRC_READ, STIM_GATT_PERM_READ, schedule_read, NULL, NULL),
+    BT_GATT_CHARACTERISTIC(BT_UUID_DECLARE_128(STIM_GATT_UUID_STATS_VAL),
+                           BT_GATT_CHRC_NOTIFY, BT_GATT_PERM_NONE, NULL, NULL, NULL),
+    BT_GATT_CCC(NULL, STIM_GATT_PERM_READ | STIM_GATT_PERM_WRITE),
+    BT_GATT_CHARACTERISTIC(BT_UUID_DECLARE_128(STIM_GATT_UUID_TRACE_VAL),
+                           BT_GATT_CHRC_NOTIFY, BT_GATT_PERM_NONE, NULL, NULL, NULL),
+    BT_GATT_CCC(NULL, STIM_GATT_PERM_READ | STIM_GATT_PERM_WRITE),
+);
+
+static const struct bt_gatt_attr *stream_attr(enum stim_gatt_stream stream) {
+    return &stim_svc.attrs[stream == STIM_GATT_STATS ? STATS_ATTR : TRACE_ATTR];
+}
+
+uint16_t stim_gatt_max_payload(void) {
+    struct bt_conn *conn = current_conn_get();
+    uint16_t max = 0;
+
+    if (conn) {
+        // 3 bytes of the MTU are the ATT header
+        max = bt_gatt_get_mtu(conn) - 3;
+        bt_conn_unref(conn);
+    }
+    return max;
+}
+
+bool stim_gatt_subscribed(enum stim_gatt_stream stream) {
+    struct bt_conn *conn = current_conn_get();
+    bool subscribed = false;
+
+    if (conn) {
+        subscribed = bt_gatt_is_subscribed(conn, stream_attr(stream), BT_GATT_CCC_NOTIFY);
+        bt_conn_unref(conn);
+    }
+    return subscribed;
+}
+
+int stim_gatt_notify(enum stim_gatt_stream stream, const void *data, uint16_t len) {
+    struct bt_conn *conn = current_conn_get();
+    int err = -ENOTCONN;
+
+    if (conn) {
+        if (bt_gatt_is_subscribed(conn, stream_attr(stream), BT_GATT_CCC_NOTIFY)) {
+            err = bt_gatt_notify(conn, stream_attr(stream), data, len);
+        }
+        bt_conn_unref(conn);
+    }
+    return err;
+}
+
+static void record_hist(struct stim_gatt_stats_record *rec, uint8_t id, const stats_event *e,
+                        uint32_t overrun) {
+    *rec = (struct stim_gatt_stats_record) {
+        .id = id,
+        .value = { e->count, e->mean, e->p50, e->p99, e->p999, e->max, overrun },
+    };
+}
+
+// Bridge counters are kept since boot, the record carries their increase
+static void record_bridge(struct stim_gatt_stats_record *rec) {
+    static struct bridge_flow_stats last;
+    struct bridge_flow_stats flow;
+    struct uart_rx_pool_stats pool;
+
+    bridge_flow_stats_get(&flow);
+    uart_rx_pool_stats_get(&pool);
+    *rec = (struct stim_gatt_stats_record) {
+        .id = STIM_GATT_STATS_BRIDGE,
+        .value = {
+            flow.uart_rx_stalls - last.uart_rx_stalls,
+            flow.uart_tx_stalls - last.uart_tx_stalls,
+            flow.uart_tx_dropped - last.uart_tx_dropped,
+            flow.ble_tx_stalls - last.ble_tx_stalls,
+            flow.ble_tx_dropped - last.ble_tx_dropped,
+            pool.high_water,
+            nus_tx_rate_get(),
+        },
+    };
+    last = flow;
+}
+
+// Fills recs with what changed since the previous snapshot, counters
+// first, and returns the count
+static size_t stats_encode(struct stim_gatt_stats_record *recs) {
+    // Only the stats thread encodes, too large for its stack
+    static stats_snapshot snap;
+    size_t n = 0;
+
+    stats_get_delta(&snap);
+    recs[n] = (struct stim_gatt_stats_record) { .id = STIM_GATT_STATS_COUNTERS };
+    for (int i = 0; i < STATS_COUNTERS; i++) {
+        recs[n].value[i] = snap.counter[i];
+    }
+    recs[n++].value[STATS_COUNTERS] = snap.window_ms;
+
+    // Entries past the end of the timeline stay empty and are left out
+    for (int i = 0; i < STATS_EVENTS; i++) {
+        if (snap.event[i].count || snap.overrun[i]) {
+            record_hist(&recs[n++], i, &snap.event[i], snap.overrun[i]);
+        }
+    }
+    if (snap.latency.count) {
+        record_hist(&recs[n++], STIM_GATT_STATS_LATENCY, &snap.latency, 0);
+    }
+    if (snap.dead_time.count) {
+        record_hist(&recs[n++], STIM_GATT_STATS_DEAD_TIME, &snap.dead_time, 0);
+    }
+    record_bridge(&recs[n++]);
+#if defined(CONFIG_STIM_ACQ)
+    recs[n++] = (struct stim_gatt_stats_record) {
+        .id = STIM_GATT_STATS_ACQ,
+        .value = { acq_dropped() },
+    };
+#endif
+    return n;
+}
+
+static atomic_t stats_interval = ATOMIC_INIT(CONFIG_STIM_GATT_STATS_MS);
+static K_SEM_DEFINE(stats_trigger, 0, 1);
+
+void stim_gatt_stats_publish(void) {
+    k_sem_give(&stats_trigger);
+}
+
+int stim_gatt_stats_interval_set(uint32_t interval_ms) {
+    if (interval_ms && interval_ms < STIM_GATT_STATS_MIN_MS) {
+        return -EINVAL;
+    }
+    // The thread publishes once and restarts the period with the new rate
+    atomic_set(&stats_interval, interval_ms);
+    k_sem_give(&stats_trigger);
+    return 0;
+}
+
+// True once a window has been taken for seq, even if part of it was lost
+// on the link. Without a subscriber nothing is taken and seq stays.
+static bool stats_send(uint8_t seq) {
+    static uint8_t frame[STATS_FRAME_MAX];
+    static struct stim_gatt_stats_record recs[STATS_RECORDS];
+    struct stim_gatt_stats_header *hdr = (struct stim_gatt_stats_header *)frame;
+
+    // Without a subscriber the next snapshot covers this interval too
+    if (!stim_gatt_subscribed(STIM_GATT_STATS)) {
+        return false;
+    }
+    size_t payload = MIN(stim_gatt_max_payload(), sizeof(frame));
+    if (payload < sizeof(*hdr) + sizeof(recs[0])) {
+        // ATT MTU too small for a record
+        return false;
+    }
+    size_t max = (payload - sizeof(*hdr)) / sizeof(recs[0]);
+    size_t count = stats_encode(recs);
+
+    hdr->sync[0] = STIM_GATT_STATS_SYNC0;
+    hdr->sync[1] = STIM_GATT_STATS_SYNC1;
+    hdr->seq = seq;
+    for (size_t sent = 0; sent < count;) {
+        size_t n = MIN(max, count - sent);
+
+        hdr->count = n;
+        memcpy(&frame[sizeof(*hdr)], &recs[sent], n * sizeof(recs[0]));
+        // Out of buffers, the rest of the snapshot is lost and the gap in
+        // seq tells the central
+        if (stim_gatt_notify(STIM_GATT_STATS, frame, sizeof(*hdr) + n * sizeof(recs[0]))) {
+            break;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+// Publishes at a fixed rate and whenever triggered. The rate is kept
+// against the due times, so a triggered snapshot does not shift the
+// periodic ones. The thread runs at the lowest priority and only reads
+// the stats banks, the stimulation interrupts never wait for it.
+static void stats_thread(void) {
+    uint32_t interval = 0;
+    int64_t due = 0;
+    uint8_t seq = 0;
+
+    for (;;) {
+        uint32_t want = atomic_get(&stats_interval);
+        if (want != interval) {
+            interval = want;
+            due = k_uptime_get() + interval;
+        }
+
+        k_timeout_t wait = interval ? K_MSEC(MAX(due - k_uptime_get(), 0)) : K_FOREVER;
+        if (k_sem_take(&stats_trigger, wait)) {
+            // A thread that fell behind skips the missed due times
+            due = MAX(due + interval, k_uptime_get());
+        }
+        if (stats_send(seq)) {
+            seq++;
+        }
+    }
+}
+
+K_THREAD_DEFINE(stim_gatt_stats_thread_id, 1024, stats_thread, NULL, NULL, NULL,
+                K_LOWEST_APPLICATION_THREAD_PRIO, 0, 0);
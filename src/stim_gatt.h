@@ -0,0 +1,123 @@
+#ifndef STIM_GATT_H
+#define STIM_GATT_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/uuid.h>
+#include "stats.h"
+#include "dac.h"
+
+// Stimulation control and telemetry service. All values are little endian
+// with the fixed layouts below.
+//
+//   control   write       one command per write, an opcode byte followed
+//                         by its payload. Errors come back as ATT errors:
+//                         value not allowed for rejected values, request
+//                         not supported for commands of other builds.
+//   schedule  read        the command that sets the running schedule or
+//                         timeline, written back it restores them
+//   stats     notify      stats of the time since the previous snapshot,
+//                         at a set rate and on request
+//   trace     notify      the STIM_TRACE records, see trace.h
+#define STIM_GATT_UUID(n) BT_UUID_128_ENCODE(0x5354494d, n, 0x4e52, 0x8035, 0x3400a5a55a5a)
+#define STIM_GATT_UUID_SERVICE_VAL STIM_GATT_UUID(0x0001)
+#define STIM_GATT_UUID_CONTROL_VAL STIM_GATT_UUID(0x0002)
+#define STIM_GATT_UUID_SCHEDULE_VAL STIM_GATT_UUID(0x0003)
+#define STIM_GATT_UUID_STATS_VAL STIM_GATT_UUID(0x0004)
+#define STIM_GATT_UUID_TRACE_VAL STIM_GATT_UUID(0x0005)
+
+enum stim_gatt_op {
+    STIM_GATT_OP_SCHEDULE = 0x01,       // struct stim_gatt_schedule
+    STIM_GATT_OP_TIMELINE = 0x02,       // struct stim_gatt_timeline, STIM_TIMELINE
+    STIM_GATT_OP_STATS_RESET = 0x03,    // no payload
+    STIM_GATT_OP_DAC = 0x04,            // uint16_t code[DAC_COUNT], see spi_dac_write_all
+    STIM_GATT_OP_BURST = 0x05,          // struct stim_gatt_burst, STIM_BURST
+    STIM_GATT_OP_BURST_STOP = 0x06,     // no payload, STIM_BURST
+    STIM_GATT_OP_STATS_PUBLISH = 0x07,  // no payload, send a snapshot now
+    STIM_GATT_OP_STATS_INTERVAL = 0x08, // uint32_t ms, see stim_gatt_stats_interval_set
+};
+
+struct stim_gatt_schedule {
+    uint32_t period_us;
+    uint32_t event1_offset_us;
+    uint32_t event2_offset_us;
+    uint32_t event3_offset_us;
+} __packed;
+
+// A timeline entry, see stim_entry
+struct stim_gatt_entry {
+    uint32_t offset_us;
+    uint32_t pin_set;
+    uint32_t pin_clear;
+    uint8_t dac;
+    uint8_t flags;
+    uint16_t dac_word;
+} __packed;
+
+// Followed by count entries, the whole command has to fit one write
+struct stim_gatt_timeline {
+    uint32_t period_us;
+    uint8_t count;
+} __packed;
+
+struct stim_gatt_burst {
+    uint32_t pulse_hz;
+    uint32_t width_us;
+    uint32_t pulses;
+    uint32_t gap_us;
+    uint16_t amplitude;
+    uint16_t ramp_pulses;
+    uint8_t dac;
+} __packed;
+
+// Stats notifications start with this header followed by count records.
+// A snapshot can take several notifications, all with the same seq, and
+// starts with its STIM_GATT_STATS_COUNTERS record. Every snapshot covers
+// the time since the one before it, a gap in seq is a lost interval.
+#define STIM_GATT_STATS_SYNC0 0xA5
+#define STIM_GATT_STATS_SYNC1 0x53
+struct stim_gatt_stats_header {
+    uint8_t sync[2];
+    uint8_t seq;
+    uint8_t count;
+} __packed;
+
+// Record ids below STATS_EVENTS are events or timeline entries
+#define STIM_GATT_STATS_LATENCY 0xF0
+#define STIM_GATT_STATS_DEAD_TIME 0xF1
+#define STIM_GATT_STATS_ACQ 0xFD
+#define STIM_GATT_STATS_BRIDGE 0xFE
+#define STIM_GATT_STATS_COUNTERS 0xFF
+
+// Histogram records hold count, mean, p50, p99, p999 and max in timer
+// ticks and the overruns of the event. The counters record holds
+// counter[STATS_COUNTERS] and the length of the interval in ms. The
+// bridge record holds the UART RX stalls, UART TX stalls, UART TX bytes
+// dropped, BLE TX stalls and BLE TX bytes dropped of the interval, the
+// UART RX pool high water mark and the NUS TX rate in bit/s. The acq
+// record holds the windows dropped.
+#define STIM_GATT_STATS_VALUES 7
+struct stim_gatt_stats_record {
+    uint8_t id;
+    uint32_t value[STIM_GATT_STATS_VALUES];
+} __packed;
+
+enum stim_gatt_stream {
+    STIM_GATT_STATS,
+    STIM_GATT_TRACE,
+};
+
+// Shortest stats interval, one snapshot takes a few notifications
+#define STIM_GATT_STATS_MIN_MS 10
+
+// Largest notification payload of the current link, 0 without a link
+uint16_t stim_gatt_max_payload(void);
+bool stim_gatt_subscribed(enum stim_gatt_stream stream);
+// 0, -ENOTCONN without a subscriber or -ENOMEM when the stack is out of
+// buffers
+int stim_gatt_notify(enum stim_gatt_stream stream, const void *data, uint16_t len);
+// Send a stats snapshot now, the periodic ones keep their times
+void stim_gatt_stats_publish(void);
+// Stats period in ms, at least STIM_GATT_STATS_MIN_MS, 0 to only publish
+// on request. Sends one snapshot and starts the new period from there.
+int stim_gatt_stats_interval_set(uint32_t interval_ms);
+#endif
@@ -3,43 +3,511 @@
 #include <zephyr/device.h>
 #include "timer.h"
 #include "spi.h"
+#include "stats.h"
+#include "trace.h"
+#include "evlog.h"
+#if defined(CONFIG_STIM_HW_SEQUENCER)
+#include "sequencer.h"
+#endif
+#if defined(CONFIG_STIM_WAVEFORM)
+#include "waveform.h"
+#endif
+#if defined(CONFIG_STIM_BURST)
+#include "burst.h"
+#endif
+#if defined(CONFIG_STIM_ACQ)
+#include "acq.h"
+#endif
+#if defined(CONFIG_STIM_IDLE)
+#include <nrfx_rtc.h>
+#include <helpers/nrfx_gppi.h>
+#endif
 
-static uint32_t timer_freq_hz = 0;  
-static uint32_t main_event_time = 0;
-static uint32_t event1_time = 0;
-static uint32_t event2_time = 0;
-static uint32_t event3_time = 0;
-
-static atomic_t counter;            // test variable to record how many times the timer handler has been called 
-static atomic_t error;
-static atomic_t event1_error_max;
-static atomic_t event2_error_max;
-static atomic_t event3_error_max;
-static atomic_t event0_error_counter;
-static atomic_t event0_error_max;
-static uint32_t prev_main_event_time = 0;
-static nrfx_timer_t measurement_timer = NRFX_TIMER_INSTANCE(1); // Use a separate timer for measurements
+#define MALFORMED_TOLERANCE_TICKS STIM_US_TO_TICKS(CONFIG_STIM_MALFORMED_TOLERANCE_US)
+
+// Every tick constant is built from STIM_TIMER_FREQ_HZ, a part with other
+// timer clocks has to fail here rather than mistime the pulses
+BUILD_ASSERT(STIM_TIMER_FREQ_HZ == NRF_TIMER_BASE_FREQUENCY_GET(NRF_TIMER0),
+             "STIM_TIMER_FREQ_HZ is not the TIMER0 base frequency");
+
+// Schedules that would cut the acquisition window short are rejected, the
+// window is armed once and runs from every period start
+static bool period_fits_acq(uint64_t period) {
+#if defined(CONFIG_STIM_ACQ)
+    return acq_fits_period(period);
+#else
+    ARG_UNUSED(period);
+    return true;
+#endif
+}
+
+static nrfx_timer_t measurement_timer = NRFX_TIMER_INSTANCE(MEAS_TIMER_INST_IDX); // Use a separate timer for measurements
 static nrfx_timer_t timer_inst = NRFX_TIMER_INSTANCE(TIMER_INST_IDX);; // Timer instance for the main timer
 static void timer_handler(nrf_timer_event_t event_type, void * p_context);
+static stim_schedule sched_us = {
+    .period_us = STIM_TIMER,
+    .event1_offset_us = EVENT1_OFFSET_US,
+    .event2_offset_us = EVENT2_OFFSET_US,
+    .event3_offset_us = EVENT3_OFFSET_US,
+};
+
+// The power-on schedule is converted to ticks at compile time, so it is
+// checked here instead of by stim_schedule_set
+#define POWER_ON_EVENT1 STIM_US_TO_TICKS(EVENT1_OFFSET_US)
+#define POWER_ON_EVENT2 STIM_US_TO_TICKS(EVENT1_OFFSET_US + EVENT2_OFFSET_US)
+#define POWER_ON_EVENT3 STIM_US_TO_TICKS(EVENT1_OFFSET_US + EVENT2_OFFSET_US + EVENT3_OFFSET_US)
+#define POWER_ON_PERIOD STIM_US_TO_TICKS(STIM_TIMER)
+
+BUILD_ASSERT(EVENT1_OFFSET_US >= STIM_MIN_OFFSET_US && EVENT2_OFFSET_US >= STIM_MIN_OFFSET_US &&
+             EVENT3_OFFSET_US >= STIM_MIN_OFFSET_US &&
+             (uint64_t)EVENT1_OFFSET_US + EVENT2_OFFSET_US + EVENT3_OFFSET_US +
+             STIM_MIN_OFFSET_US <= STIM_TIMER, "Invalid power-on stimulation schedule");
+BUILD_ASSERT(POWER_ON_PERIOD <= UINT32_MAX, "Power-on period does not fit the timer");
+
+// Counter value through the HAL, the ISRs skip the driver call and its
+// argument checks
+static inline uint32_t timer_capture(NRF_TIMER_Type *p_reg, nrf_timer_cc_channel_t channel) {
+    nrf_timer_task_trigger(p_reg, nrf_timer_capture_task_get(channel));
+    return nrf_timer_cc_get(p_reg, channel);
+}
+
+#if defined(CONFIG_STIM_OVERRUN_ABORT)
+static atomic_t stim_aborted;
+
+// Stops the periods after an overrun, the next schedule or timeline set
+// starts them again. Outputs are safe with all switch pins low.
+static void stim_abort(void) {
+    nrfx_timer_disable(&timer_inst);
+    stim_port_write(0, STIM_PORT_PINS);
+    atomic_set(&stim_aborted, 1);
+}
+#endif
+
+#if defined(CONFIG_STIM_TIMELINE)
+// An entry that clears and sets pins becomes two steps, the clear at the
+// entry and the set with the DAC frame DEAD_TIME_TICKS later, so the
+// break before make gap is a compare of the timer and not code order
+#define DEAD_TIME_TICKS (CONFIG_STIM_DEAD_TIME_NS * (STIM_TIMER_FREQ_HZ / 1000000) / 1000)
+#define STIM_MAX_STEPS (DEAD_TIME_TICKS ? 2 * STIM_MAX_ENTRIES : STIM_MAX_ENTRIES)
+// Set half of a split entry, in stim_step.flags next to the entry flags
+#define STIM_STEP_MAKE BIT(7)
+
+BUILD_ASSERT(DEAD_TIME_TICKS < STIM_US_TO_TICKS(STIM_MIN_OFFSET_US) / 2,
+             "Dead time too long for the entry spacing");
+
+// Timeline entry in timer ticks, ready for the ISR
+struct stim_step {
+    uint32_t cc;            // CC1 value, the period for the first entry
+    uint32_t due;           // counter value the entry is due at
+    uint32_t pin_set;
+    uint32_t pin_clear;
+    uint8_t entry;          // timeline entry the step belongs to
+    uint8_t dac;
+    uint8_t flags;
+    uint8_t frame[DAC_TX_LEN];
+};
 
-void get_error_data(error_data *data) {
-    data->event1_max = atomic_get(&event1_error_max);
-    data->event2_max = atomic_get(&event2_error_max);
-    data->event3_max = atomic_get(&event3_error_max);
-    data->event0_error = atomic_get(&event0_error_counter);
-    data->event0_max = atomic_get(&event0_error_max);
-    data->myerror = atomic_get(&error);
-    data->mycounter = atomic_get(&counter);
+struct stim_plan {
+    uint32_t period;
+    uint32_t count;
+    struct stim_step step[STIM_MAX_STEPS];
+};
+
+// CC0 clears the counter at the end of the period, without an interrupt.
+// CC1 walks the timeline: the ISR of an entry arms it for the next one,
+// and the first entry shares its compare value with the CC0 clear. CC2
+// captures the counter to measure how late an entry runs, so every entry
+// costs the same no matter how long the timeline is.
+//
+// The ISR owns plan_active. stim_timeline_set builds the new plan in the
+// buffer that is neither active nor staged and stages it. The first entry
+// of the next period takes it over right after the clear, while CC0 and
+// CC1 are still ahead of the counter. The handover uses no IRQ lock, as
+// with STIM_ZLI the ISR runs above it.
+#define POWER_ON_PULSE STIM_PIN_BIT(STIM_PIN_1_03)
+#define POWER_ON_OFF (STIM_PIN_BIT(STIM_PIN_1_00) | STIM_PIN_BIT(STIM_PIN_1_01))
+#if CONFIG_STIM_DEAD_TIME_NS > 0
+#define POWER_ON_SWITCH(idx, at)                                                           \
+    { .cc = (at), .due = (at), .pin_clear = POWER_ON_PULSE, .entry = (idx),                \
+      .dac = STIM_DAC_NONE },                                                                \
+    { .cc = (at) + DEAD_TIME_TICKS, .due = (at) + DEAD_TIME_TICKS, .pin_set = POWER_ON_OFF,  \
+      .entry = (idx), .dac = STIM_DAC_NONE, .flags = STIM_STEP_MAKE }
+#define POWER_ON_STEPS 6
+#else
+#define POWER_ON_SWITCH(idx, at)                                                           \
+    { .cc = (at), .due = (at), .pin_set = POWER_ON_OFF, .pin_clear = POWER_ON_PULSE,         \
+      .entry = (idx), .dac = STIM_DAC_NONE }
+#define POWER_ON_STEPS 4
+#endif
+
+static struct stim_plan plans[3] = {
+    [0] = {
+        .period = POWER_ON_PERIOD,
+        .count = POWER_ON_STEPS,
+        .step = {
+            { .cc = POWER_ON_PERIOD, .due = 0, .pin_set = POWER_ON_PULSE, .entry = 0,
+              .dac = DAC1, .flags = STIM_ENTRY_DAC_STAGED },
+            POWER_ON_SWITCH(1, POWER_ON_EVENT1),
+            { .cc = POWER_ON_EVENT2, .due = POWER_ON_EVENT2, .pin_set = POWER_ON_PULSE, .entry = 2,
+              .dac = DAC2, .flags = STIM_ENTRY_DAC_STAGED },
+            POWER_ON_SWITCH(3, POWER_ON_EVENT3),
+        },
+    },
+};
+static struct stim_plan *plan_active = &plans[0];
+static atomic_ptr_t plan_staged;
+static uint32_t step_next;          // entry CC1 is armed for
+#if !defined(CONFIG_STIM_IDLE)
+static uint32_t plan_shift;         // delay of the rest of the period, STIM_OVERRUN_SHIFT
+#endif
+static K_MUTEX_DEFINE(plan_lock);   // one writer at a time, recursive
+
+#if defined(CONFIG_STIM_IDLE)
+// Gaps between entries are timed by the RTC. After an entry that is
+// followed by a long gap the ISR stops the timer, and an RTC compare
+// clears and restarts it through DPPI IDLE_MARGIN before the next entry.
+// CC1 then times the entry from the restart, so the edge keeps the timer
+// resolution. The timer requests the HF clock only while it runs.
+//
+// Times below are absolute, in timer ticks since the RTC was started.
+// 32 RTC ticks are exactly 15625 timer ticks. CC0 does not clear the
+// counter, the period is kept in period_start and CC1 wraps with the
+// counter.
+#define IDLE_RTC_INST_IDX 0
+#define IDLE_MARGIN_TICKS STIM_US_TO_TICKS(CONFIG_STIM_IDLE_MARGIN_US)
+#define IDLE_MIN_GAP_TICKS STIM_US_TO_TICKS(CONFIG_STIM_IDLE_MIN_GAP_US)
+#define IDLE_RTC_MASK 0xFFFFFF
+
+// The RTC compare has to be written at least two RTC ticks ahead
+BUILD_ASSERT(CONFIG_STIM_IDLE_MIN_GAP_US >= CONFIG_STIM_IDLE_MARGIN_US + 100,
+             "Idle gap too short for the restart margin");
+
+static const nrfx_rtc_t rtc_inst = NRFX_RTC_INSTANCE(IDLE_RTC_INST_IDX);
+static uint64_t period_start;       // entry 0 of the running period
+static uint64_t window_start;       // counter 0 of the running window
+static uint64_t window_next;        // counter 0 after the next restart
+static atomic_t window_gen;         // bumped with every change of the two above
+static uint32_t cc_next;            // CC1 of step_next
+
+static inline uint64_t rtc_to_ticks(uint64_t rtc) {
+    return rtc * 15625 / 32;
+}
+
+static inline uint64_t ticks_to_rtc(uint64_t ticks) {
+    return ticks * 32 / 15625;
+}
+
+static int idle_init(void);
+#endif
+
+static int timeline_to_plan(const stim_timeline *timeline, struct stim_plan *plan) {
+    if (timeline->count == 0 || timeline->count > STIM_MAX_ENTRIES ||
+        timeline->entry[0].offset_us != 0 ||
+        STIM_US_TO_TICKS(timeline->period_us) > UINT32_MAX ||
+        !period_fits_acq(STIM_US_TO_TICKS(timeline->period_us))) {
+        return -EINVAL;
+    }
+
+    plan->period = STIM_US_TO_TICKS(timeline->period_us);
+    plan->count = 0;
+    for (uint32_t i = 0; i < timeline->count; i++) {
+        const stim_entry *entry = &timeline->entry[i];
+        struct stim_step *step = &plan->step[plan->count++];
+        uint32_t end = i + 1 < timeline->count ? timeline->entry[i + 1].offset_us
+                                               : timeline->period_us;
+
+        if ((uint64_t)entry->offset_us + STIM_MIN_OFFSET_US > end ||
+            (entry->pin_set | entry->pin_clear) & ~STIM_PORT_PINS ||
+            (entry->dac >= DAC_COUNT && entry->dac != STIM_DAC_NONE) ||
+            entry->flags & STIM_STEP_MAKE) {
+            return -EINVAL;
+        }
+        step->due = STIM_US_TO_TICKS(entry->offset_us);
+        step->cc = i == 0 ? plan->period : step->due;
+        step->pin_set = entry->pin_set;
+        step->pin_clear = entry->pin_clear;
+        step->entry = i;
+        step->dac = entry->dac;
+        step->flags = entry->flags;
+        if (entry->dac != STIM_DAC_NONE) {
+            dac_frame(entry->dac, entry->dac_word, step->frame);
+        }
+
+        if (DEAD_TIME_TICKS && step->pin_set && step->pin_clear) {
+            struct stim_step *make = &plan->step[plan->count++];
+
+            *make = *step;
+            make->due = step->due + DEAD_TIME_TICKS;
+            make->cc = make->due;
+            make->pin_clear = 0;
+            make->flags |= STIM_STEP_MAKE;
+            step->pin_set = 0;
+            step->dac = STIM_DAC_NONE;
+        }
+    }
+    return 0;
+}
+
+#if defined(CONFIG_STIM_OVERRUN_ABORT)
+// The timer is stopped, nothing runs the ISR while the staged plan takes
+// over. The first entry comes one period later, as after power-on.
+static void timeline_restart(void) {
+    plan_active = atomic_ptr_clear(&plan_staged);
+    step_next = 0;
+    nrf_timer_cc_set(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL0, plan_active->period);
+    nrf_timer_cc_set(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL1, plan_active->step[0].cc);
+    nrfx_timer_clear(&timer_inst);
+    atomic_set(&stim_aborted, 0);
+    nrfx_timer_enable(&timer_inst);
+}
+#endif
+
+static stim_timeline timeline_last;     // count 0 until the first set
+
+int stim_timeline_set(const stim_timeline *timeline) {
+    k_mutex_lock(&plan_lock, K_FOREVER);
+
+    // Staged before active: a plan the ISR takes over in between shows
+    // up as active and is still skipped
+    struct stim_plan *staged = atomic_ptr_get(&plan_staged);
+    struct stim_plan *active = plan_active;
+    struct stim_plan *plan = plans;
+    while (plan == active || plan == staged) {
+        plan++;
+    }
+
+    int err = timeline_to_plan(timeline, plan);
+    if (!err) {
+        // Latest request wins if several arrive within one period
+        atomic_ptr_set(&plan_staged, plan);
+        timeline_last = *timeline;
+#if defined(CONFIG_STIM_OVERRUN_ABORT)
+        if (atomic_get(&stim_aborted)) {
+            timeline_restart();
+        }
+#endif
+    }
+    k_mutex_unlock(&plan_lock);
+    return err;
+}
+
+// The four-event schedule as a timeline: two pulses on 1.03, each one
+// starting with a DAC frame and ending with the switch to 1.00 and 1.01
+static void schedule_to_timeline(const stim_schedule *sched, stim_timeline *timeline) {
+    uint32_t pulse = STIM_PIN_BIT(STIM_PIN_1_03);
+    uint32_t off = STIM_PIN_BIT(STIM_PIN_1_00) | STIM_PIN_BIT(STIM_PIN_1_01);
+    uint32_t event2 = sched->event1_offset_us + sched->event2_offset_us;
+
+    *timeline = (stim_timeline) {
+        .period_us = sched->period_us,
+        .count = 4,
+        .entry = {
+            { .offset_us = 0, .pin_set = pulse,
+              .dac = DAC1, .flags = STIM_ENTRY_DAC_STAGED },
+            { .offset_us = sched->event1_offset_us, .pin_set = off, .pin_clear = pulse,
+              .dac = STIM_DAC_NONE },
+            { .offset_us = event2, .pin_set = pulse,
+              .dac = DAC2, .flags = STIM_ENTRY_DAC_STAGED },
+            { .offset_us = event2 + sched->event3_offset_us, .pin_set = off, .pin_clear = pulse,
+              .dac = STIM_DAC_NONE },
+        },
+    };
+}
+
+int stim_schedule_set(const stim_schedule *sched) {
+    static stim_timeline timeline;
+
+    // The entry offsets must not wrap, timeline_to_plan checks the rest
+    if ((uint64_t)sched->event1_offset_us + sched->event2_offset_us +
+        sched->event3_offset_us > sched->period_us) {
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&plan_lock, K_FOREVER);
+    schedule_to_timeline(sched, &timeline);
+    int err = stim_timeline_set(&timeline);
+    if (!err) {
+        unsigned int key = irq_lock();
+        sched_us = *sched;
+        irq_unlock(key);
+    }
+    k_mutex_unlock(&plan_lock);
+    return err;
+}
+
+void stim_timeline_get(stim_timeline *timeline) {
+    k_mutex_lock(&plan_lock, K_FOREVER);
+    if (timeline_last.count) {
+        *timeline = timeline_last;
+    } else {
+        schedule_to_timeline(&sched_us, timeline);
+    }
+    k_mutex_unlock(&plan_lock);
+}
+#else
+// Schedule in timer ticks. cc[] are the compare values from the start of
+// the period, offset[] the expected distance of each event to the one
+// before it (offset[0] is the period itself).
+struct stim_ticks {
+    uint32_t cc[4];
+    uint32_t offset[4];
+};
+
+static uint64_t event_time[4];      // timer_timestamp of the last event of each kind
+static int expected_event;
+
+static uint64_t prev_main_event_time;
+static bool main_event_seen;
+
+// Schedule changes go through three copies so a period is never half old
+// and half new. stim_schedule_set fills sched_staged. At the last event of
+// a period the ISR moves it to sched_next and writes the CC1..CC3 values
+// that are already behind the counter, so they only match after the
+// COMPARE0 clear. The COMPARE0 interrupt then makes sched_next active,
+// writes CC0 and the CC values that were still ahead of the counter.
+// STIM_MIN_OFFSET_US keeps those ahead of the interrupt latency.
+static struct stim_ticks sched_staged;
+static struct stim_ticks sched_next;
+static struct stim_ticks sched_active = {
+    .cc = { POWER_ON_PERIOD, POWER_ON_EVENT1, POWER_ON_EVENT2, POWER_ON_EVENT3 },
+    .offset = {
+        POWER_ON_PERIOD,
+        STIM_US_TO_TICKS(EVENT1_OFFSET_US),
+        STIM_US_TO_TICKS(EVENT2_OFFSET_US),
+        STIM_US_TO_TICKS(EVENT3_OFFSET_US),
+    },
+};
+static bool sched_staged_valid;
+static bool sched_pending;
+static uint8_t sched_deferred;      // CC channels to write after the clear
+static uint32_t ended_period_ticks = POWER_ON_PERIOD; // expected length of the period that ended at the last COMPARE0
+
+static int schedule_to_ticks(const stim_schedule *sched, struct stim_ticks *ticks) {
+    uint64_t end = (uint64_t)sched->event1_offset_us + sched->event2_offset_us +
+                   sched->event3_offset_us + STIM_MIN_OFFSET_US;
+
+    if (sched->event1_offset_us < STIM_MIN_OFFSET_US ||
+        sched->event2_offset_us < STIM_MIN_OFFSET_US ||
+        sched->event3_offset_us < STIM_MIN_OFFSET_US ||
+        end > sched->period_us ||
+        STIM_US_TO_TICKS(sched->period_us) > UINT32_MAX ||
+        !period_fits_acq(STIM_US_TO_TICKS(sched->period_us))) {
+        return -EINVAL;
+    }
+
+    ticks->offset[0] = STIM_US_TO_TICKS(sched->period_us);
+    ticks->offset[1] = STIM_US_TO_TICKS(sched->event1_offset_us);
+    ticks->offset[2] = STIM_US_TO_TICKS(sched->event2_offset_us);
+    ticks->offset[3] = STIM_US_TO_TICKS(sched->event3_offset_us);
+    ticks->cc[0] = ticks->offset[0];
+    ticks->cc[1] = ticks->offset[1];
+    ticks->cc[2] = ticks->cc[1] + ticks->offset[2];
+    ticks->cc[3] = ticks->cc[2] + ticks->offset[3];
+    return 0;
+}
+
+#if defined(CONFIG_STIM_OVERRUN_ABORT)
+// The timer is stopped, the staged schedule becomes active and the first
+// event 0 comes one period later, as after power-on
+static void schedule_restart(void) {
+    sched_active = sched_staged;
+    sched_staged_valid = false;
+    sched_pending = false;
+    ended_period_ticks = sched_active.offset[0];
+    for (int i = 0; i < 4; i++) {
+        nrf_timer_cc_set(timer_inst.p_reg, (nrf_timer_cc_channel_t)i, sched_active.cc[i]);
+    }
+    expected_event = 0;
+    main_event_seen = false;
+    nrfx_timer_clear(&timer_inst);
+    atomic_set(&stim_aborted, 0);
+    nrfx_timer_enable(&timer_inst);
+}
+#endif
+
+int stim_schedule_set(const stim_schedule *sched) {
+    struct stim_ticks ticks;
+    int err = schedule_to_ticks(sched, &ticks);
+
+    // The burst engine owns the stimulation timer, see burst_set
+    if (IS_ENABLED(CONFIG_STIM_BURST)) {
+        return -ENOTSUP;
+    }
+    if (err) {
+        return err;
+    }
+
+    // Latest request wins if several arrive within one period
+    unsigned int key = irq_lock();
+    sched_staged = ticks;
+    sched_staged_valid = true;
+    sched_us = *sched;
+#if defined(CONFIG_STIM_OVERRUN_ABORT)
+    if (atomic_get(&stim_aborted)) {
+        schedule_restart();
+    }
+#endif
+    irq_unlock(key);
+    return 0;
+}
+
+// Last event of the period. A CC value behind the counter only matches
+// again after the COMPARE0 clear, so it can be written right away.
+static void schedule_stage_next(void) {
+    if (!sched_staged_valid) {
+        return;
+    }
+    sched_next = sched_staged;
+    sched_staged_valid = false;
+    sched_pending = true;
+    sched_deferred = 0;
+
+    uint32_t now = timer_capture(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL4);
+    for (int i = 1; i < 4; i++) {
+        if (sched_next.cc[i] <= now) {
+            nrf_timer_cc_set(timer_inst.p_reg, (nrf_timer_cc_channel_t)i, sched_next.cc[i]);
+        } else {
+            sched_deferred |= BIT(i);
+        }
+    }
+#if defined(CONFIG_STIM_HW_SEQUENCER)
+    // The sequencer normally sleeps through COMPARE0
+    nrfx_timer_compare_int_enable(&timer_inst, NRF_TIMER_CC_CHANNEL0);
+#endif
+}
+
+// COMPARE0 clear: the period that starts now runs on the new schedule
+static void schedule_swap(void) {
+    if (!sched_pending) {
+        return;
+    }
+    ended_period_ticks = sched_active.offset[0];
+    sched_active = sched_next;
+    sched_pending = false;
+    nrf_timer_cc_set(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL0, sched_active.cc[0]);
+    for (int i = 1; i < 4; i++) {
+        if (sched_deferred & BIT(i)) {
+            nrf_timer_cc_set(timer_inst.p_reg, (nrf_timer_cc_channel_t)i, sched_active.cc[i]);
+        }
+    }
+#if defined(CONFIG_STIM_HW_SEQUENCER)
+    nrfx_timer_compare_int_disable(&timer_inst, NRF_TIMER_CC_CHANNEL0);
+#endif
+    stats_count(STATS_RECONFIG, 1);
+}
+#endif
+
+void stim_schedule_get(stim_schedule *sched) {
+    unsigned int key = irq_lock();
+    *sched = sched_us;
+    irq_unlock(key);
 }
 
 void timer_init(){
-    atomic_set(&counter, 0);
-    atomic_set(&error,0);
-    uint32_t base_frequency = NRF_TIMER_BASE_FREQUENCY_GET(timer_inst.p_reg);    
-    timer_freq_hz = base_frequency;
-    printf("Timer frequency: %lu Hz\n", timer_freq_hz);
-    
-    nrfx_timer_config_t config = NRFX_TIMER_DEFAULT_CONFIG(base_frequency);
+    stats_reset();
+    printf("Timer frequency: %d Hz\n", STIM_TIMER_FREQ_HZ);
+
+    nrfx_timer_config_t config = NRFX_TIMER_DEFAULT_CONFIG(STIM_TIMER_FREQ_HZ);
     config.bit_width = NRF_TIMER_BIT_WIDTH_32;
     config.p_context = &timer_inst;  // Pass timer instance as context for measurements
     nrfx_err_t status = nrfx_timer_init(&timer_inst, &config, timer_handler);
@@ -47,117 +515,659 @@ void timer_init(){
     if(status != NRFX_SUCCESS){
         printf("Timer initialization failed with error: %d\n", status);
     }
-    uint32_t event1_ticks = nrfx_timer_us_to_ticks(&timer_inst, EVENT1_OFFSET_US);
-    uint32_t event2_ticks = nrfx_timer_us_to_ticks(&timer_inst, (EVENT1_OFFSET_US + EVENT2_OFFSET_US));
-    uint32_t event3_ticks = nrfx_timer_us_to_ticks(&timer_inst, (EVENT1_OFFSET_US + EVENT2_OFFSET_US + EVENT3_OFFSET_US));
-    nrfx_timer_extended_compare(&timer_inst, NRF_TIMER_CC_CHANNEL0, 
-                                nrfx_timer_us_to_ticks(&timer_inst, STIM_TIMER),
-                                NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, true);
-    nrfx_timer_extended_compare(&timer_inst, NRF_TIMER_CC_CHANNEL1, event1_ticks, 0, true);
-    nrfx_timer_extended_compare(&timer_inst, NRF_TIMER_CC_CHANNEL2, event2_ticks, 0, true);
-    nrfx_timer_extended_compare(&timer_inst, NRF_TIMER_CC_CHANNEL3, event3_ticks, 0, true);
+
+    // The power-on plan and schedule are compile-time constants
+#if defined(CONFIG_STIM_IDLE)
+    // The RTC starts the timer, see idle_init
+    idle_init();
+#elif defined(CONFIG_STIM_TIMELINE)
+    nrfx_timer_extended_compare(&timer_inst, NRF_TIMER_CC_CHANNEL0, plan_active->period,
+                                NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, false);
+    nrfx_timer_extended_compare(&timer_inst, NRF_TIMER_CC_CHANNEL1, plan_active->step[0].cc,
+                                0, true);
+#elif defined(CONFIG_STIM_BURST)
+    if (burst_init(&timer_inst) != 0) {
+        printf("Burst engine initialization failed\n");
+    }
+#else
+    // In sequencer mode the edges come from DPPI, the CPU only wakes up on
+    // COMPARE1/COMPARE3 to collect the captures and refill the next frame
+    bool sw_events = !IS_ENABLED(CONFIG_STIM_HW_SEQUENCER);
+    nrfx_timer_extended_compare(&timer_inst, NRF_TIMER_CC_CHANNEL0, sched_active.cc[0],
+                                NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, sw_events);
+    nrfx_timer_extended_compare(&timer_inst, NRF_TIMER_CC_CHANNEL1, sched_active.cc[1], 0, true);
+    nrfx_timer_extended_compare(&timer_inst, NRF_TIMER_CC_CHANNEL2, sched_active.cc[2], 0, sw_events);
+    nrfx_timer_extended_compare(&timer_inst, NRF_TIMER_CC_CHANNEL3, sched_active.cc[3], 0, true);
+#if defined(CONFIG_STIM_HW_SEQUENCER)
+    if (sequencer_init(&timer_inst, &measurement_timer) != 0) {
+        printf("Sequencer initialization failed\n");
+    }
+#endif
+#if defined(CONFIG_STIM_WAVEFORM)
+    if (waveform_init(&timer_inst) != 0) {
+        printf("Waveform engine initialization failed\n");
+    }
+#endif
+#endif
+#if defined(CONFIG_STIM_ACQ)
+    if (acq_init(&timer_inst, &measurement_timer) != 0) {
+        printf("Acquisition initialization failed\n");
+    }
+#endif
+#if !defined(CONFIG_STIM_IDLE)
     nrfx_timer_enable(&timer_inst);
     printf("Timer status: %s\n", nrfx_timer_is_enabled(&timer_inst) ? "enabled" : "disabled");
+#endif
+}
+
+// The measurement timer wraps every 2^32 ticks, about 268 s. COMPARE4
+// matches at 0 after each wrap and its interrupt counts the wraps, which
+// become the upper half of the timestamps.
+static volatile uint32_t meas_wraps;
+
+static void measurement_timer_handler(nrf_timer_event_t event_type, void *p_context) {
+    meas_wraps++;
 }
 
 nrfx_timer_t measurement_timer_init() {
-    nrfx_timer_config_t config = NRFX_TIMER_DEFAULT_CONFIG(NRF_TIMER_BASE_FREQUENCY_GET(measurement_timer.p_reg));
+    nrfx_timer_config_t config = NRFX_TIMER_DEFAULT_CONFIG(STIM_TIMER_FREQ_HZ);
     config.bit_width = NRF_TIMER_BIT_WIDTH_32;
-    nrfx_err_t err = nrfx_timer_init(&measurement_timer, &config, NULL); // No handler needed
+    nrfx_err_t err = nrfx_timer_init(&measurement_timer, &config, measurement_timer_handler);
+    nrfx_timer_extended_compare(&measurement_timer, NRF_TIMER_CC_CHANNEL4, 0, 0, true);
+#if !defined(CONFIG_STIM_IDLE)
+    // In idle mode a free running timer would keep the HF clock on
     nrfx_timer_enable(&measurement_timer);
+#endif
     return measurement_timer;
 }
 
+#if defined(CONFIG_STIM_IDLE)
+// Same time base as the stimulation timer windows. Between windows the
+// counter is stopped and this returns the end of the last window. The RTC
+// restarts the counter in hardware before the interrupt moves
+// window_start, so a set RTC COMPARE0 event means the counter already
+// belongs to window_next. If the interrupt or a restart comes in between
+// the reads, the generation or the event changes and they are read again,
+// so timestamps never run backwards.
+uint64_t timer_timestamp(void) {
+    uint64_t base;
+    uint32_t now;
+    atomic_val_t gen;
+    bool restarted;
+
+    do {
+        gen = atomic_get(&window_gen);
+        restarted = nrf_rtc_event_check(rtc_inst.p_reg, NRF_RTC_EVENT_COMPARE_0);
+        now = timer_capture(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL3);
+        base = restarted ? window_next : window_start;
+    } while (restarted != nrf_rtc_event_check(rtc_inst.p_reg, NRF_RTC_EVENT_COMPARE_0) ||
+             gen != atomic_get(&window_gen));
+
+    return base + now;
+}
+#else
+// A wrap that the interrupt has not counted yet, because the caller runs
+// at or above its priority, shows as a pending COMPARE4 with the counter
+// in the lower half. If the interrupt runs in between the wrap count
+// changes and the counter is read again.
+uint64_t timer_timestamp(void) {
+    uint32_t wraps, now;
+    bool pending;
+
+    do {
+        wraps = meas_wraps;
+        now = timer_capture(measurement_timer.p_reg, NRF_TIMER_CC_CHANNEL2);
+        pending = nrf_timer_event_check(measurement_timer.p_reg, NRF_TIMER_EVENT_COMPARE4);
+    } while (wraps != meas_wraps);
+
+    if (pending && now < BIT(31)) {
+        wraps++;
+    }
+    return ((uint64_t)wraps << 32) | now;
+}
+#endif
+
+uint64_t timer_extend(uint32_t tick) {
+    uint64_t now = timer_timestamp();
+
+    return now - (uint32_t)((uint32_t)now - tick);
+}
+
+#if defined(CONFIG_STIM_TIMELINE)
+// DAC word of an entry for the trace, 0 if it sends none
+static uint16_t step_dac_word(const struct stim_step *step) {
+    uint8_t frame[DAC_TX_LEN];
+
+    if (step->dac == STIM_DAC_NONE) {
+        return 0;
+    }
+    if (step->flags & STIM_ENTRY_DAC_STAGED) {
+        spi_dac_staged(step->dac, frame);
+        return dac_frame_code(step->dac, frame);
+    }
+    return dac_frame_code(step->dac, step->frame);
+}
+
+static uint32_t break_at;           // counter at the clear half of a split entry
+
+// late is the distance of the step to its compare value in timer ticks,
+// now the counter at the ISR
+static void record_step(const struct stim_step *step, uint32_t late, uint32_t now) {
+    uint32_t index = step->entry;
+
+    // The entry was recorded with its clear half, what is left is the gap
+    if (step->flags & STIM_STEP_MAKE) {
+        stats_record(STATS_DEAD_TIME, now - break_at);
+        return;
+    }
+
+    if (IS_ENABLED(CONFIG_STIM_TRACE)) {
+        trace_put(TRACE_EVENT0 + index, 0, step_dac_word(step), timer_timestamp());
+    }
+
+    stats_record(index, late);
+    evlog_put_verbose(EVLOG_EVENT, index, late);
+    if (late > MALFORMED_TOLERANCE_TICKS) {
+        stats_count(STATS_MALFORMED, 1);
+        evlog_put(EVLOG_MALFORMED, index, late);
+    }
+}
+
+#if defined(CONFIG_STIM_ZLI)
+// Direct zero-latency entry. CC2 captures the counter before the nrfx
+// dispatch, so the IRQ latency covers only the hardware entry. Nothing
+// below calls into the kernel, and a ZLI never reschedules.
+ISR_DIRECT_DECLARE(timer_zli_isr)
+{
+    nrf_timer_task_trigger(timer_inst.p_reg, nrf_timer_capture_task_get(NRF_TIMER_CC_CHANNEL2));
+    NRFX_TIMER_INST_HANDLER_GET(TIMER_INST_IDX)();
+    return 0;
+}
+
+// Same level as the stimulation timer, so a timestamp taken there never
+// sees the wrap count change under it
+ISR_DIRECT_DECLARE(measurement_zli_isr)
+{
+    NRFX_TIMER_INST_HANDLER_GET(MEAS_TIMER_INST_IDX)();
+    return 0;
+}
+#endif
+
+// A dead time shorter than the ISR makes the set half run from the loop,
+// which is not a missed entry, the dead time stats show the real gap.
+// Returns true for an overrun.
+static inline bool step_missed(const struct stim_step *step, uint32_t late) {
+    if (step->flags & STIM_STEP_MAKE) {
+        return false;
+    }
+    stats_count(STATS_MISSED, 1);
+    stats_overrun(step->entry);
+    evlog_put(EVLOG_OVERRUN, step->entry, late);
+    return true;
+}
+
+// Switch pins first, then the DAC frame
+static inline void step_run(const struct stim_step *step) {
+    stim_port_write(step->pin_set, step->pin_clear);
+    if (DEAD_TIME_TICKS && step->pin_clear) {
+        break_at = timer_capture(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL2);
+    }
+    if (step->dac != STIM_DAC_NONE) {
+        if (step->flags & STIM_ENTRY_DAC_STAGED) {
+            spi_dac_write(step->dac);
+        } else {
+            spi_dac_write_frame(step->dac, step->frame);
+        }
+    }
+}
+
+// A late clear delays the set half, the dead time counts from the write
+static inline uint32_t step_cc(const struct stim_step *step, uint32_t cc) {
+    if ((step->flags & STIM_STEP_MAKE) && (int32_t)(break_at + DEAD_TIME_TICKS - cc) > 0) {
+        return break_at + DEAD_TIME_TICKS;
+    }
+    return cc;
+}
+
+#if defined(CONFIG_STIM_IDLE)
+// Counter 0 of the next window is at RTC tick rtc. The window times are
+// changed with interrupts locked, see timer_timestamp.
+static void idle_until(uint64_t rtc) {
+    unsigned int key = irq_lock();
+
+    window_next = rtc_to_ticks(rtc);
+    atomic_inc(&window_gen);
+    irq_unlock(key);
+    nrfx_rtc_cc_set(&rtc_inst, 0, rtc & IDLE_RTC_MASK, false);
+}
+
+// The RTC COMPARE0 event marks a restart that window_start does not
+// include yet
+static void window_open(void) {
+    unsigned int key = irq_lock();
+
+    window_start = window_next;
+    nrf_rtc_event_clear(rtc_inst.p_reg, NRF_RTC_EVENT_COMPARE_0);
+    atomic_inc(&window_gen);
+    irq_unlock(key);
+}
+
+// COMPARE1, the only interrupt of the stimulation timer
+static void timer_handler(nrf_timer_event_t event_type, void * p_context)
+{
+    uint32_t now = IS_ENABLED(CONFIG_STIM_ZLI) ?
+                   nrf_timer_cc_get(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL2) :
+                   timer_capture(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL2);
+
+    // Equal unless the timer was restarted by the RTC for this interrupt
+    window_open();
+    stats_count(STATS_WAKEUPS, 1);
+    stats_record(STATS_LATENCY, now - cc_next);
+
+    for (;;) {
+        uint32_t index = step_next;
+        uint32_t cc = cc_next;
+
+        struct stim_plan *staged = index == 0 ? atomic_ptr_clear(&plan_staged) : NULL;
+        if (staged) {
+            plan_active = staged;
+            stats_count(STATS_RECONFIG, 1);
+        }
+        if (index == 0) {
+            stats_count(STATS_PERIODS, 1);
+        }
+
+        const struct stim_plan *plan = plan_active;
+        const struct stim_step *step = &plan->step[index];
+
+        step_run(step);
+
+        step_next = index + 1 < plan->count ? index + 1 : 0;
+        if (step_next == 0) {
+            period_start += plan->period;
+        }
+        uint64_t due = period_start + plan->step[step_next].due;
+        record_step(step, now - cc, now);
+
+        now = timer_capture(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL2);
+        if ((int64_t)(due - (window_start + now)) > (int64_t)IDLE_MIN_GAP_TICKS) {
+            // Stop until the margin before the next entry. The counter at
+            // the stop is the length of the window that ends here.
+            nrf_timer_task_trigger(timer_inst.p_reg, NRF_TIMER_TASK_STOP);
+            now = timer_capture(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL2);
+            stats_count(STATS_ACTIVE_US, now / (STIM_TIMER_FREQ_HZ / 1000000));
+
+            idle_until(ticks_to_rtc(due - IDLE_MARGIN_TICKS));
+            cc_next = due - window_next;
+            nrf_timer_cc_set(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL1, cc_next);
+            return;
+        }
+
+        cc_next = step_cc(&plan->step[step_next], due - window_start);
+        nrf_timer_cc_set(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL1, cc_next);
+        now = timer_capture(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL2);
+        if ((int32_t)(now - cc_next) < 0) {
+            return;
+        }
+        nrf_timer_event_clear(timer_inst.p_reg, NRF_TIMER_EVENT_COMPARE1);
+        step_missed(&plan->step[step_next], now - cc_next);
+    }
+}
+
+// No RTC interrupt is enabled, the compare only reaches the timer
+// through DPPI
+static void rtc_handler(nrfx_rtc_int_type_t int_type) {
+}
+
+static int idle_init(void) {
+    nrfx_rtc_config_t config = NRFX_RTC_DEFAULT_CONFIG;
+    uint8_t ch;
+
+    if (nrfx_rtc_init(&rtc_inst, &config, rtc_handler) != NRFX_SUCCESS ||
+        nrfx_gppi_channel_alloc(&ch) != NRFX_SUCCESS) {
+        printf("Idle mode initialization failed\n");
+        return -EIO;
+    }
+    nrfx_gppi_event_endpoint_setup(ch, nrfx_rtc_event_address_get(&rtc_inst, NRF_RTC_EVENT_COMPARE_0));
+    nrfx_gppi_task_endpoint_setup(ch, nrfx_timer_task_address_get(&timer_inst, NRF_TIMER_TASK_CLEAR));
+    nrfx_gppi_task_endpoint_setup(ch, nrfx_timer_task_address_get(&timer_inst, NRF_TIMER_TASK_START));
+    nrfx_gppi_channels_enable(BIT(ch));
+
+    // The first window opens a few RTC ticks from now, the first period
+    // starts one margin later
+    nrfx_rtc_counter_clear(&rtc_inst);
+    nrfx_rtc_enable(&rtc_inst);
+    idle_until(nrfx_rtc_counter_get(&rtc_inst) + 4);
+    window_start = window_next;
+    period_start = window_start + IDLE_MARGIN_TICKS;
+    cc_next = IDLE_MARGIN_TICKS;
+    nrfx_timer_extended_compare(&timer_inst, NRF_TIMER_CC_CHANNEL1, cc_next, 0, true);
+    printf("Idle mode: RTC restarts the timer %d us before entries more than %d us apart\n",
+           CONFIG_STIM_IDLE_MARGIN_US, CONFIG_STIM_IDLE_MIN_GAP_US);
+    return 0;
+}
+#else
+// The next step was due before CC1 could be armed for it. Returns true if
+// the ISR runs it right away. An overrun into the next period always
+// does, unless the policy aborts, the first entry takes over a staged
+// plan.
+static bool step_overrun(const struct stim_step *next, uint32_t late) {
+    if (!step_missed(next, late)) {
+        return true;
+    }
+#if defined(CONFIG_STIM_OVERRUN_SKIP)
+    if (step_next != 0) {
+        // CC1 waits for the first entry of the next period
+        stim_port_write(0, STIM_PORT_PINS);
+        step_next = 0;
+        nrf_timer_cc_set(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL1, plan_active->step[0].cc);
+        return false;
+    }
+#elif defined(CONFIG_STIM_OVERRUN_SHIFT)
+    if (step_next != 0) {
+        // The late entry runs now, the rest of the period and its end
+        // move by the same amount
+        plan_shift += late;
+        nrf_timer_cc_set(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL0, plan_active->period + plan_shift);
+    }
+#elif defined(CONFIG_STIM_OVERRUN_ABORT)
+    stim_abort();
+    return false;
+#endif
+    return true;
+}
+
+// COMPARE1, the only interrupt of the stimulation timer
+static void timer_handler(nrf_timer_event_t event_type, void * p_context)
+{
+    uint32_t now = IS_ENABLED(CONFIG_STIM_ZLI) ?
+                   nrf_timer_cc_get(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL2) :
+                   timer_capture(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL2);
+
+    stats_count(STATS_WAKEUPS, 1);
+    // Entry 0 is due at 0 in every plan, so the active plan is right
+    // even when a staged one takes over below
+    const struct stim_step *first = &plan_active->step[step_next];
+    stats_record(STATS_LATENCY, now - step_cc(first, first->due + (step_next ? plan_shift : 0)));
+
+    for (;;) {
+        uint32_t index = step_next;
+
+        struct stim_plan *staged = index == 0 ? atomic_ptr_clear(&plan_staged) : NULL;
+        if (staged) {
+            plan_active = staged;
+            nrf_timer_cc_set(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL0, plan_active->period);
+            stats_count(STATS_RECONFIG, 1);
+        }
+        if (index == 0) {
+            stats_count(STATS_PERIODS, 1);
+        }
+        if (index == 0 && plan_shift) {
+            // The shifted period ended, this one has its normal length
+            plan_shift = 0;
+            nrf_timer_cc_set(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL0, plan_active->period);
+        }
+
+        const struct stim_plan *plan = plan_active;
+        const struct stim_step *step = &plan->step[index];
+
+        step_run(step);
+
+        step_next = index + 1 < plan->count ? index + 1 : 0;
+        const struct stim_step *next = &plan->step[step_next];
+        uint32_t cc = step_cc(next, next->cc + plan_shift);
+        nrf_timer_cc_set(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL1, cc);
+        record_step(step, now - step->due - plan_shift, now);
+
+        // CC1 only matches if it was written ahead of the counter. After
+        // the clear the counter is below the entry that just ran.
+        now = timer_capture(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL2);
+        bool missed = step_next == 0 ? now < step->due : now >= cc;
+        if (!missed) {
+            return;
+        }
+        // Run the entry from here, a match right at the write is dropped
+        nrf_timer_event_clear(timer_inst.p_reg, NRF_TIMER_EVENT_COMPARE1);
+        if (!step_overrun(next, step_next == 0 ? now : now - cc)) {
+            return;
+        }
+    }
+}
+#endif
+#else
+// DAC word that goes out with a pulse event, 0 for the switch events
+static uint16_t event_dac_word(int event) {
+    uint8_t frame[DAC_TX_LEN];
+
+    if (event != 0 && event != 2) {
+        return 0;
+    }
+    spi_dac_staged(event == 0 ? DAC1 : DAC2, frame);
+    return dac_frame_code(event == 0 ? DAC1 : DAC2, frame);
+}
+
+// Error of an event against the distance to the previous event expected
+// by the schedule the event belongs to
+static void record_event(int event, uint64_t now, uint32_t expected) {
+    uint64_t prev = event == 0 ? prev_main_event_time : event_time[event - 1];
+    int64_t diff = (int64_t)(now - prev - expected);
+    uint32_t my_error = MIN((uint64_t)(diff < 0 ? -diff : diff), UINT32_MAX);
+
+    if (IS_ENABLED(CONFIG_STIM_TRACE)) {
+        trace_put(TRACE_EVENT0 + event, 0, event_dac_word(event), now);
+    }
+
+    event_time[event] = now;
+    if (event == 0) {
+        bool first = !main_event_seen;
+        prev_main_event_time = now;
+        main_event_seen = true;
+        if (first) {
+            return;
+        }
+    }
+    stats_record(event, my_error);
+    evlog_put_verbose(EVLOG_EVENT, event, my_error);
+    if (my_error > MALFORMED_TOLERANCE_TICKS) {
+        stats_count(STATS_MALFORMED, 1);
+        evlog_put(EVLOG_MALFORMED, event, my_error);
+    }
+}
+
+// Events have to come in schedule order, anything skipped is a missed pulse
+static void check_sequence(int event) {
+    if (event != expected_event) {
+        uint32_t missed = (event - expected_event + 4) % 4;
+
+        stats_count(STATS_MISSED, missed);
+        evlog_put(EVLOG_MISSED, expected_event, missed);
+    }
+    expected_event = (event + 1) % 4;
+}
+
+#if defined(CONFIG_STIM_OVERRUN_SKIP)
+static bool period_skipped;         // rest of the period dropped after an overrun
+#endif
+
+// End of the interrupt of an event. The counter past the compare of the
+// next event means that one is due already, this interrupt ran too late
+// or too long. A counter behind the event itself went through the clear.
+static void overrun_check(int event) {
+    uint32_t now = timer_capture(timer_inst.p_reg, NRF_TIMER_CC_CHANNEL4);
+    uint32_t start = event == 0 ? 0 : sched_active.cc[event];
+    int next = (event + 1) % 4;
+    bool wrapped = now < start;
+
+    if (!wrapped && now < sched_active.cc[next]) {
+        return;
+    }
+    uint32_t late = (wrapped ? now + sched_active.cc[0] : now) - sched_active.cc[next];
+    stats_overrun(next);
+    evlog_put(EVLOG_OVERRUN, next, late);
+#if defined(CONFIG_STIM_OVERRUN_SKIP)
+    // An overrun into the next period runs late, event 0 swaps the schedule
+    if (next != 0 && !wrapped) {
+        stim_port_write(0, STIM_PORT_PINS);
+        period_skipped = true;
+        expected_event = 0;
+    }
+#elif defined(CONFIG_STIM_OVERRUN_ABORT)
+    stim_abort();
+#endif
+}
+
+#if defined(CONFIG_STIM_HW_SEQUENCER)
+// Error statistics from the measurement timer captures taken by DPPI.
+// CC0 holds the time of the last pulse event (COMPARE0 or COMPARE2), CC1 the
+// time of the last switch event (COMPARE1 or COMPARE3).
+static void hw_sequencer_handler(nrf_timer_event_t event_type) {
+    uint64_t pulse_time = timer_extend(nrfx_timer_capture_get(&measurement_timer, NRF_TIMER_CC_CHANNEL0));
+    uint64_t now = timer_extend(nrfx_timer_capture_get(&measurement_timer, NRF_TIMER_CC_CHANNEL1));
+
+    if (event_type == NRF_TIMER_EVENT_COMPARE0) {
+        // Only enabled while a new schedule is pending
+        schedule_swap();
+        return;
+    }
+
+    if (event_type == NRF_TIMER_EVENT_COMPARE1) {
+        check_sequence(0);
+        check_sequence(1);
+        record_event(0, pulse_time, ended_period_ticks);
+        ended_period_ticks = sched_active.offset[0];
+        record_event(1, now, sched_active.offset[1]);
+    } else {
+        check_sequence(2);
+        check_sequence(3);
+        record_event(2, pulse_time, sched_active.offset[2]);
+        record_event(3, now, sched_active.offset[3]);
+        schedule_stage_next();
+    }
+
+    sequencer_refill(event_type);
+}
+#endif
+
 static void timer_handler(nrf_timer_event_t event_type, void * p_context)
 {   
-    // Get reference to timer
-    atomic_inc(&counter);
-    //printf("Time handler count: %i \n", counter);
-    nrfx_timer_t *timer_inst = (nrfx_timer_t *)p_context;
-    uint32_t current_time;
-    uint32_t current_max;
-    uint32_t my_error;
+#if defined(CONFIG_STIM_HW_SEQUENCER)
+    hw_sequencer_handler(event_type);
+    return;
+#endif
+#if defined(CONFIG_STIM_WAVEFORM)
+    if (event_type == NRF_TIMER_EVENT_COMPARE5) {
+        waveform_pass_done();
+        return;
+    }
+#endif
+#if defined(CONFIG_STIM_BURST)
+    // Only COMPARE0, once per train
+    burst_train_done();
+    return;
+#endif
+#if defined(CONFIG_STIM_OVERRUN_ABORT)
+    // Events that were pending at the abort
+    if (atomic_get(&stim_aborted)) {
+        return;
+    }
+#endif
+#if defined(CONFIG_STIM_OVERRUN_SKIP)
+    if (period_skipped) {
+        if (event_type != NRF_TIMER_EVENT_COMPARE0) {
+            // A staged schedule still moves on at the last event
+            if (event_type == NRF_TIMER_EVENT_COMPARE3) {
+                schedule_stage_next();
+            }
+            return;
+        }
+        period_skipped = false;
+    }
+#endif
+    uint64_t current_time = timer_timestamp();
     
     switch(event_type) {
         case NRF_TIMER_EVENT_COMPARE0:
-            current_time = nrfx_timer_capture(&measurement_timer, NRF_TIMER_CC_CHANNEL0);
-                
-            if (prev_main_event_time > 0) {
-                // Calculate actual interval duration
-                uint32_t interval_ticks = current_time - prev_main_event_time;
-                uint32_t expected_ticks = nrfx_timer_us_to_ticks(&measurement_timer, STIM_TIMER);
-                uint32_t event0_error = abs(interval_ticks - expected_ticks);
-                
-                // Update statistics
-                atomic_add(&event0_error_counter, event0_error);
-                
-                // Track maximum error
-                current_max = atomic_get(&event0_error_max);
-                if (event0_error > current_max) {
-                    atomic_set(&event0_error_max, event0_error);
-                }
-            }
-            prev_main_event_time = current_time;
-            // Capture timestamp when main event occurs (after timer reset)
-            main_event_time = nrfx_timer_capture(timer_inst, NRF_TIMER_CC_CHANNEL4);
+            check_sequence(0);
+            record_event(0, current_time, ended_period_ticks);
+            schedule_swap();
+            ended_period_ticks = sched_active.offset[0];
 
             // Switch on 1.03
-            nrf_gpio_pin_set(NRF_GPIO_PIN_MAP(1, 3));
-            // SPI transaction on DAC 1
-            // 100 us
-            spi_write_dac1(dac1_buf_tx, dac1_buf_rx);
+            stim_port_write(STIM_PIN_BIT(STIM_PIN_1_03), 0);
+            // Queue the DAC 1 frame, CS and completion are handled by the SPIM
+#if defined(CONFIG_STIM_WAVEFORM)
+            if (!waveform_active(DAC1))
+#endif
+            spi_dac_write(DAC1);
+            overrun_check(0);
             break;
             
         case NRF_TIMER_EVENT_COMPARE1:
-            // Capture timestamp when event 1 occurs
-            current_time = nrfx_timer_capture(timer_inst, NRF_TIMER_CC_CHANNEL4);
-            // Calculate elapsed time from main event
-            uint32_t elapsed1_ticks = current_time - main_event_time;
-            my_error = abs(elapsed1_ticks-EVENT1_OFFSET_US*timer_freq_hz/1000000);
-            atomic_add(&error,my_error);
-            current_max = atomic_get(&event1_error_max);
-            if (my_error > current_max) {atomic_set(&event1_error_max, my_error);}
-
-            // Switch off 1.03
-            nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(1, 3));
-            // Switch on 1.00
-            nrf_gpio_pin_set(NRF_GPIO_PIN_MAP(1, 0));
-            // Switch on 1.01
-            nrf_gpio_pin_set(NRF_GPIO_PIN_MAP(1, 1));
+            check_sequence(1);
+            record_event(1, current_time, sched_active.offset[1]);
+
+            // Switch off 1.03 and on 1.00 and 1.01 in one write, a dead
+            // time needs the timeline
+            stim_port_write(STIM_PIN_BIT(STIM_PIN_1_00) | STIM_PIN_BIT(STIM_PIN_1_01),
+                            STIM_PIN_BIT(STIM_PIN_1_03));
             // wait 10 us
+            overrun_check(1);
             break;
             
         case NRF_TIMER_EVENT_COMPARE2:
-            // Capture timestamp when event 2 occurs
-            current_time = nrfx_timer_capture(timer_inst, NRF_TIMER_CC_CHANNEL4);
-            // Calculate elapsed time from event 1
-            my_error = abs(elapsed1_ticks-EVENT2_OFFSET_US*timer_freq_hz/1000000);
-            atomic_add(&error, my_error);
-            current_max = atomic_get(&event2_error_max);
-            if (my_error > current_max) {atomic_set(&event2_error_max, my_error);}
+            check_sequence(2);
+            record_event(2, current_time, sched_active.offset[2]);
 
             // Switch on 1.03
-            nrf_gpio_pin_set(NRF_GPIO_PIN_MAP(1, 3));
-            // SPI transaction on DAC2 
-            // 100 us
-            spi_write_dac2(dac2_buf_tx, dac2_buf_rx);
+            stim_port_write(STIM_PIN_BIT(STIM_PIN_1_03), 0);
+            // Queue the DAC 2 frame
+#if defined(CONFIG_STIM_WAVEFORM)
+            if (!waveform_active(DAC2))
+#endif
+            spi_dac_write(DAC2);
+            overrun_check(2);
             break;
             
         case NRF_TIMER_EVENT_COMPARE3:
-            // Capture timestamp when event 3 occurs
-            current_time = nrfx_timer_capture(timer_inst, NRF_TIMER_CC_CHANNEL4);
-            // Calculate elapsed time from event 2
-            my_error = abs(elapsed1_ticks-EVENT3_OFFSET_US*timer_freq_hz/1000000);
-            atomic_add(&error,my_error);
-            current_max = atomic_get(&event3_error_max);
-            if (my_error > current_max) {atomic_set(&event3_error_max, my_error);}
-            // Switch off 1.03
-            nrf_gpio_pin_clear(NRF_GPIO_PIN_MAP(1, 3));
-            // Switch on 1.00
-            nrf_gpio_pin_set(NRF_GPIO_PIN_MAP(1, 0));
-            // Switch on 1.01
-            nrf_gpio_pin_set(NRF_GPIO_PIN_MAP(1, 1));
+            check_sequence(3);
+            record_event(3, current_time, sched_active.offset[3]);
+            schedule_stage_next();
+
+            // Switch off 1.03 and on 1.00 and 1.01 in one write, a dead
+            // time needs the timeline
+            stim_port_write(STIM_PIN_BIT(STIM_PIN_1_00) | STIM_PIN_BIT(STIM_PIN_1_01),
+                            STIM_PIN_BIT(STIM_PIN_1_03));
             // wait 10 us
+            overrun_check(3);
+            break;
+
+        default:
             break;
     }
-}
\ No newline at end of file
+}
+#endif
+
+#if defined(CONFIG_STIM_RECONFIG_STRESS)
+// Flips between the default schedule and a 3/4 scaled copy at 1 kHz so
+// the STATS_RECONFIG, STATS_MISSED and STATS_MALFORMED counters can be checked
+// against a constant stream of updates
+static void reconfig_stress_thread(void) {
+    stim_schedule base, scaled;
+
+    stim_schedule_get(&base);
+    scaled = (stim_schedule) {
+        .period_us = base.period_us / 4 * 3,
+        .event1_offset_us = base.event1_offset_us / 4 * 3,
+        .event2_offset_us = base.event2_offset_us / 4 * 3,
+        .event3_offset_us = base.event3_offset_us / 4 * 3,
+    };
+
+    for (bool flip = false; ; flip = !flip) {
+        stim_schedule_set(flip ? &scaled : &base);
+        k_msleep(1);
+    }
+}
+
+K_THREAD_DEFINE(reconfig_stress_id, 1024, reconfig_stress_thread, NULL, NULL, NULL,
+                K_LOWEST_APPLICATION_THREAD_PRIO, 0, 1000);
+#endif
@@ -4,8 +4,11 @@
 #include <nrfx_timer.h>
 #include <zephyr/kernel.h>
 #include <zephyr/device.h>
+#include <hal/nrf_gpio.h>
 
 #define TIMER_INST_IDX 0
+#define MEAS_TIMER_INST_IDX 1
+// Power-on schedule, changed at runtime with stim_schedule_set
 //This is the time between stim
 #define STIM_TIMER 4000000
 
@@ -16,17 +19,91 @@
 // This is the time between SPI transac on DAC2 and switching 1.03 off
 #define EVENT3_OFFSET_US 1000000 // x3: Time after EVENT2
 
+// TIMER0 and TIMER1 count at 16 MHz, so a time converts to ticks with a
+// multiplication by a constant
+#define STIM_TIMER_FREQ_HZ 16000000
+#define STIM_US_TO_TICKS(us) ((uint64_t)(us) * (STIM_TIMER_FREQ_HZ / 1000000))
+
+// Smallest gap between two events. Part of the schedule swap is done in
+// the COMPARE0 interrupt, which has to run before the first new event.
+#define STIM_MIN_OFFSET_US 50
+
+// Electrode switch pins
+#define STIM_PIN_1_03 NRF_GPIO_PIN_MAP(1, 3)
+#define STIM_PIN_1_00 NRF_GPIO_PIN_MAP(1, 0)
+#define STIM_PIN_1_01 NRF_GPIO_PIN_MAP(1, 1)
+
+// The switch pins share one port and are driven as a mask. SCK (1.02) is
+// on the same port and can not be part of a mask.
+#define STIM_PORT NRF_P1
+#define STIM_PIN_BIT(pin) BIT((pin) & 0x1F)
+#define STIM_PORT_PINS (STIM_PIN_BIT(STIM_PIN_1_03) | STIM_PIN_BIT(STIM_PIN_1_00) | \
+                        STIM_PIN_BIT(STIM_PIN_1_01))
+
+// Switch two pin groups of STIM_PORT at once. Both masks go out in one OUT
+// write, so all pins change on the same clock edge. Only the stimulation
+// interrupts may drive STIM_PORT outputs, other writers would race the
+// read-modify-write. SPIM and GPIOTE pins ignore OUT.
+static inline void stim_port_write(uint32_t set, uint32_t clear) {
+    nrf_gpio_port_out_write(STIM_PORT, (nrf_gpio_port_out_read(STIM_PORT) & ~clear) | set);
+}
+
+// Event 1 and event 3 offsets are the widths of the two pulses
+typedef struct {
+    uint32_t period_us;
+    uint32_t event1_offset_us;
+    uint32_t event2_offset_us;
+    uint32_t event3_offset_us;
+} stim_schedule;
+
+#if defined(CONFIG_STIM_TIMELINE)
+#define STIM_MAX_ENTRIES CONFIG_STIM_TIMELINE_MAX_ENTRIES
+#define STIM_DAC_NONE 0xFF
+// Send the staged frame of the DAC instead of dac_word
+#define STIM_ENTRY_DAC_STAGED BIT(0)
+
+// One action of a period. pin_clear is applied before pin_set, both are
+// STIM_PORT masks within STIM_PORT_PINS.
+typedef struct {
+    uint32_t offset_us;     // from the start of the period
+    uint32_t pin_set;
+    uint32_t pin_clear;
+    uint8_t dac;            // enum dac_id or STIM_DAC_NONE
+    uint8_t flags;
+    uint16_t dac_word;      // DAC code, see STIM_DAC_CHIP
+} stim_entry;
+
+// Entries are sorted by offset and the first one is at offset 0. Two
+// entries, and the last entry and the end of the period, are at least
+// STIM_MIN_OFFSET_US apart.
 typedef struct {
-    uint32_t event1_max;
-    uint32_t event2_max;
-    uint32_t event3_max;
-    uint32_t event0_error;
-    uint32_t event0_max;
-    uint32_t myerror;
-    uint32_t mycounter;
-} error_data;
+    uint32_t period_us;
+    uint32_t count;
+    stim_entry entry[STIM_MAX_ENTRIES];
+} stim_timeline;
+
+// Staged like a schedule, the latest timeline or schedule set within a
+// period is applied at the start of the next one
+int stim_timeline_set(const stim_timeline *timeline);
+// Last timeline set, or the schedule as a timeline before the first one
+void stim_timeline_get(stim_timeline *timeline);
+#endif
+
+#if defined(CONFIG_STIM_ZLI)
+// Zero-latency entries of the stimulation and measurement timers, for
+// IRQ_DIRECT_CONNECT
+void timer_zli_isr(void);
+void measurement_zli_isr(void);
+#endif
 
 void timer_init();
-void get_error_data(error_data *data);
+int stim_schedule_set(const stim_schedule *sched);
+// Last schedule set with stim_schedule_set
+void stim_schedule_get(stim_schedule *sched);
+// Measurement timer ticks since boot, extended to 64 bits so they never
+// wrap. Only call from the stimulation interrupt priority or below.
+uint64_t timer_timestamp(void);
+// A measurement timer capture from the last 2^32 ticks as a timestamp
+uint64_t timer_extend(uint32_t tick);
 nrfx_timer_t measurement_timer_init();
 #endif
\ No newline at end of file
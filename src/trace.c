@@ -0,0 +1,134 @@
+#include <zephyr/kernel.h>
+#include <bluetooth/services/nus.h>
+#include <string.h>
+#include "trace.h"
+#include "BLE.h"
+#if defined(CONFIG_STIM_GATT)
+#include "stim_gatt.h"
+#endif
+
+#define TRACE_RING_SIZE CONFIG_STIM_TRACE_RING_SIZE
+#define TRACE_FRAME_MAX 244     // largest NUS payload with a 247 byte ATT MTU
+
+BUILD_ASSERT((TRACE_RING_SIZE & (TRACE_RING_SIZE - 1)) == 0, "Trace ring size must be a power of two");
+
+// Single producer, single consumer. timer_handler and spim_handler both
+// write, but they run at the same interrupt priority and never preempt
+// each other, so together they are the one producer. Only the producer
+// moves trace_head and only the drain thread moves trace_tail.
+static struct trace_record trace_ring[TRACE_RING_SIZE];
+static atomic_t trace_head;
+static atomic_t trace_tail;
+static atomic_t trace_dropped;
+
+void trace_put(uint8_t type, int8_t status, uint16_t dac_word, uint64_t tick) {
+    atomic_val_t head = atomic_get(&trace_head);
+
+    if (head - atomic_get(&trace_tail) == TRACE_RING_SIZE) {
+        atomic_inc(&trace_dropped);
+        return;
+    }
+    trace_ring[head & (TRACE_RING_SIZE - 1)] = (struct trace_record) {
+        .type = type,
+        .status = status,
+        .dac_word = dac_word,
+        .tick = tick,
+    };
+    atomic_set(&trace_head, head + 1);
+}
+
+// The trace thread holds a reference on conn from the ready check to the
+// last send of a flush
+#if defined(CONFIG_STIM_GATT)
+// Frames go to the trace characteristic, only while it is subscribed
+static bool trace_link_ready(struct bt_conn *conn) {
+    ARG_UNUSED(conn);
+    return stim_gatt_subscribed(STIM_GATT_TRACE);
+}
+
+static uint16_t trace_link_payload(struct bt_conn *conn) {
+    ARG_UNUSED(conn);
+    return stim_gatt_max_payload();
+}
+
+static int trace_link_send(struct bt_conn *conn, const uint8_t *frame, uint16_t len) {
+    ARG_UNUSED(conn);
+    return stim_gatt_notify(STIM_GATT_TRACE, frame, len);
+}
+#else
+static bool trace_link_ready(struct bt_conn *conn) {
+    ARG_UNUSED(conn);
+    return true;
+}
+
+static uint16_t trace_link_payload(struct bt_conn *conn) {
+    return bt_nus_get_mtu(conn);
+}
+
+static int trace_link_send(struct bt_conn *conn, const uint8_t *frame, uint16_t len) {
+    ARG_UNUSED(conn);
+    return nus_send(frame, len, K_NO_WAIT);
+}
+#endif
+
+static void trace_thread(void) {
+    static uint8_t frame[TRACE_FRAME_MAX];
+    struct trace_frame_header *hdr = (struct trace_frame_header *)frame;
+    struct trace_record *rec = (struct trace_record *)&frame[sizeof(*hdr)];
+    uint8_t seq = 0;
+    uint32_t overflow = 0;
+
+    hdr->sync[0] = TRACE_SYNC0;
+    hdr->sync[1] = TRACE_SYNC1;
+
+    for (;;) {
+        k_msleep(CONFIG_STIM_TRACE_FLUSH_MS);
+        overflow += atomic_clear(&trace_dropped);
+
+        struct bt_conn *conn = current_conn_get();
+
+        if (!conn) {
+            continue;
+        }
+        if (!trace_link_ready(conn)) {
+            bt_conn_unref(conn);
+            continue;
+        }
+
+        size_t max = (MIN(trace_link_payload(conn), sizeof(frame)) - sizeof(*hdr)) /
+                     sizeof(*rec);
+        atomic_val_t tail = atomic_get(&trace_tail);
+        atomic_val_t avail = atomic_get(&trace_head) - tail;
+
+        while (avail > 0 || overflow) {
+            size_t n = 0;
+
+            // Losses are reported in-band, ahead of the records that follow them
+            if (overflow) {
+                rec[n++] = (struct trace_record) {
+                    .type = TRACE_OVERFLOW,
+                    .tick = overflow,
+                };
+            }
+            while (n < max && avail > 0) {
+                rec[n++] = trace_ring[tail & (TRACE_RING_SIZE - 1)];
+                tail++;
+                avail--;
+            }
+
+            hdr->seq = seq;
+            hdr->count = n;
+            if (trace_link_send(conn, frame, sizeof(*hdr) + n * sizeof(*rec))) {
+                // Out of buffers, retry these records on the next flush
+                break;
+            }
+            seq++;
+            overflow = 0;
+            atomic_set(&trace_tail, tail);
+        }
+        bt_conn_unref(conn);
+    }
+}
+
+K_THREAD_DEFINE(trace_thread_id, 1024, trace_thread, NULL, NULL, NULL,
+                K_LOWEST_APPLICATION_THREAD_PRIO, 0, 0);
@@ -0,0 +1,37 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <zephyr/kernel.h>
+
+enum trace_type {
+    TRACE_EVENT0 = 0,       // stimulation events 0..3, timeline entries 0..63
+    TRACE_EVENT1,
+    TRACE_EVENT2,
+    TRACE_EVENT3,
+    TRACE_SPI_DONE = 0x40,  // | DAC id, DAC frame clocked out
+    TRACE_OVERFLOW = 0xFF,  // tick holds the number of records dropped
+};
+
+// Little endian on the wire
+struct trace_record {
+    uint8_t type;
+    int8_t status;          // 0 or negative errno
+    uint16_t dac_word;
+    uint64_t tick;          // timer_timestamp
+} __packed;
+
+// Notifications start with this header followed by count records
+#define TRACE_SYNC0 0xA5
+#define TRACE_SYNC1 0x5A
+struct trace_frame_header {
+    uint8_t sync[2];
+    uint8_t seq;
+    uint8_t count;
+} __packed;
+
+#if defined(CONFIG_STIM_TRACE)
+void trace_put(uint8_t type, int8_t status, uint16_t dac_word, uint64_t tick);
+#else
+static inline void trace_put(uint8_t type, int8_t status, uint16_t dac_word, uint64_t tick) {}
+#endif
+#endif
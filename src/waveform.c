@@ -0,0 +1,205 @@
+#include <nrfx_timer.h>
+#include <helpers/nrfx_gppi.h>
+#include <zephyr/kernel.h>
+#include <math.h>
+#include "waveform.h"
+#include "timer.h"
+#include "spi.h"
+
+// Arbitrary waveform engine.
+//
+// Each DAC owns a table of precomputed frames that is played once per
+// stimulation period, DAC1 from COMPARE0 and DAC2 from COMPARE2:
+//
+//   stim COMPARE0/2   -> ch_start  -> sample timer START
+//   sample COMPARE0   -> ch_sample -> SPIM START, CLR CS of the playing DAC
+//   stim COMPARE5     -> ch_stop   -> sample timer STOP and CLEAR
+//
+// The SPIM walks the table with TX post-increment, SPIM END releases CS
+// (see spi.c). The stop compare is placed half a sample after the last
+// sample, so exactly count frames go out. The only CPU work is one
+// interrupt per pass on COMPARE5 to point the SPIM at the next table.
+// The first sample is output one sample period after the trigger event.
+
+static nrfx_timer_t sample_timer = NRFX_TIMER_INSTANCE(WAVE_TIMER_INST_IDX);
+static nrfx_timer_t *stim;
+
+// Two tables per DAC, waveform_load fills the back one and the pass-done
+// interrupt swaps it in, so a table is never rewritten while it is played
+static uint8_t wave_frames[DAC_COUNT][2][WAVE_MAX_SAMPLES][DAC_TX_LEN];
+
+BUILD_ASSERT((uint64_t)WAVE_SAMPLE_RATE_HZ * DAC_TX_LEN * 8 <= SPIM_FREQ_HZ,
+             "The SPIM cannot send a DAC transfer per sample");
+static uint16_t wave_count[DAC_COUNT][2];
+static uint8_t wave_front[DAC_COUNT];
+static atomic_t wave_pending;       // bit per DAC, back table is ready
+static bool wave_enabled[DAC_COUNT];
+
+static uint32_t sample_ticks;
+static enum dac_id playing;
+static uint8_t ch_start, ch_sample, ch_stop;
+
+static const nrf_timer_cc_channel_t trigger_cc[DAC_COUNT] = {
+    [DAC1] = NRF_TIMER_CC_CHANNEL0,
+    [DAC2] = NRF_TIMER_CC_CHANNEL2,
+};
+
+// DAC1 plays right after the COMPARE0 clear, DAC2 from the CC2 value of
+// the period that is running (the schedule can change at runtime)
+static uint32_t trigger_ticks(enum dac_id dac) {
+    return dac == DAC1 ? 0 : nrfx_timer_capture_get(stim, NRF_TIMER_CC_CHANNEL2);
+}
+
+// A pass has to be over before the switch event that follows its trigger
+static uint32_t window_ticks(enum dac_id dac) {
+    stim_schedule sched;
+
+    stim_schedule_get(&sched);
+    return nrfx_timer_us_to_ticks(stim, dac == DAC1 ? sched.event1_offset_us : sched.event3_offset_us);
+}
+
+static void wave_arm(enum dac_id dac) {
+    int front;
+
+    if (atomic_test_and_clear_bit(&wave_pending, dac)) {
+        wave_front[dac] ^= 1;
+    }
+    front = wave_front[dac];
+
+    nrfx_gppi_task_endpoint_clear(ch_sample, spi_dac_cs_clr_task_address(playing));
+    nrfx_gppi_task_endpoint_setup(ch_sample, spi_dac_cs_clr_task_address(dac));
+    playing = dac;
+
+    spi_dac_list_arm(wave_frames[dac][front][0]);
+    nrfx_timer_compare(stim, NRF_TIMER_CC_CHANNEL5,
+                       trigger_ticks(dac) + wave_count[dac][front] * sample_ticks + sample_ticks / 2,
+                       true);
+}
+
+int waveform_init(nrfx_timer_t *stim_timer) {
+    stim = stim_timer;
+    sample_ticks = NRF_TIMER_BASE_FREQUENCY_GET(sample_timer.p_reg) / WAVE_SAMPLE_RATE_HZ;
+
+    nrfx_timer_config_t config = NRFX_TIMER_DEFAULT_CONFIG(NRF_TIMER_BASE_FREQUENCY_GET(sample_timer.p_reg));
+    config.bit_width = NRF_TIMER_BIT_WIDTH_32;
+    nrfx_err_t status = nrfx_timer_init(&sample_timer, &config, NULL);
+    if (status != NRFX_SUCCESS) {
+        printf("Waveform timer initialization failed with error: %d\n", status);
+        return -EIO;
+    }
+    nrfx_timer_extended_compare(&sample_timer, NRF_TIMER_CC_CHANNEL0, sample_ticks,
+                                NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK, false);
+
+    if (nrfx_gppi_channel_alloc(&ch_start) != NRFX_SUCCESS ||
+        nrfx_gppi_channel_alloc(&ch_sample) != NRFX_SUCCESS ||
+        nrfx_gppi_channel_alloc(&ch_stop) != NRFX_SUCCESS) {
+        printf("DPPI channel allocation failed\n");
+        return -ENOMEM;
+    }
+
+    nrfx_gppi_task_endpoint_setup(ch_start, nrfx_timer_task_address_get(&sample_timer, NRF_TIMER_TASK_START));
+
+    nrfx_gppi_event_endpoint_setup(ch_sample,
+        nrfx_timer_compare_event_address_get(&sample_timer, NRF_TIMER_CC_CHANNEL0));
+    nrfx_gppi_task_endpoint_setup(ch_sample, spi_start_task_address());
+
+    nrfx_gppi_event_endpoint_setup(ch_stop,
+        nrfx_timer_compare_event_address_get(stim, NRF_TIMER_CC_CHANNEL5));
+    nrfx_gppi_task_endpoint_setup(ch_stop, nrfx_timer_task_address_get(&sample_timer, NRF_TIMER_TASK_STOP));
+    nrfx_gppi_task_endpoint_setup(ch_stop, nrfx_timer_task_address_get(&sample_timer, NRF_TIMER_TASK_CLEAR));
+
+    printf("Waveform engine: %d S/s, %lu ticks per sample\n", WAVE_SAMPLE_RATE_HZ, sample_ticks);
+    return 0;
+}
+
+int waveform_load(enum dac_id dac, const uint16_t *samples, size_t count) {
+    if (count == 0 || count > WAVE_MAX_SAMPLES ||
+        (count + 1) * sample_ticks >= window_ticks(dac)) {
+        return -EINVAL;
+    }
+    // The previous load has not been picked up by a pass yet
+    if (atomic_test_bit(&wave_pending, dac)) {
+        return -EBUSY;
+    }
+
+    int back = wave_front[dac] ^ 1;
+    for (size_t i = 0; i < count; i++) {
+        dac_frame(dac, samples[i], wave_frames[dac][back][i]);
+    }
+    wave_count[dac][back] = count;
+
+    if (wave_enabled[dac]) {
+        atomic_set_bit(&wave_pending, dac);
+    } else {
+        wave_front[dac] = back;
+    }
+    return 0;
+}
+
+// Once started the engine owns the SPIM. A DAC without a table plays its
+// staged frame as a one sample table, so both DACs keep their update.
+int waveform_start(void) {
+    for (int i = 0; i < DAC_COUNT; i++) {
+        if (wave_count[i][wave_front[i]] == 0) {
+            uint8_t frame[DAC_TX_LEN];
+            uint16_t sample;
+
+            spi_dac_staged(i, frame);
+            sample = dac_frame_code(i, frame);
+            waveform_load(i, &sample, 1);
+        }
+        nrfx_gppi_event_endpoint_setup(ch_start, nrfx_timer_compare_event_address_get(stim, trigger_cc[i]));
+        wave_enabled[i] = true;
+    }
+
+    playing = DAC1;
+    wave_arm(DAC1);
+    nrfx_gppi_channels_enable(BIT(ch_start) | BIT(ch_sample) | BIT(ch_stop));
+    return 0;
+}
+
+bool waveform_active(enum dac_id dac) {
+    return wave_enabled[dac];
+}
+
+// Stim timer COMPARE5, the sample timer has already been stopped in hardware
+void waveform_pass_done(void) {
+    wave_arm((playing + 1) % DAC_COUNT);
+}
+
+size_t waveform_ramp(uint16_t *out, size_t count, uint16_t from, uint16_t to) {
+    for (size_t i = 0; i < count; i++) {
+        out[i] = from + ((int32_t)(to - from) * (int32_t)i) / (int32_t)MAX(count - 1, 1);
+    }
+    return count;
+}
+
+size_t waveform_sine(uint16_t *out, size_t count, uint16_t amplitude, uint32_t cycles) {
+    if (amplitude > WAVE_MAX_AMPLITUDE) {
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+        float phase = 2.0f * (float)M_PI * cycles * i / count;
+        out[i] = WAVE_MIDSCALE + (int32_t)lroundf(amplitude * sinf(phase));
+    }
+    return count;
+}
+
+// Cathodic phase decaying with tau, followed by an anodic phase of the same
+// shape. Both phases use the same rounded levels, so the net charge, i.e.
+// the sum of the codes around midscale, is exactly zero.
+size_t waveform_biphasic_exp(uint16_t *out, size_t count, uint16_t amplitude,
+                             size_t phase_len, float tau_samples) {
+    if (2 * phase_len > count || phase_len == 0 || amplitude > WAVE_MAX_AMPLITUDE) {
+        return 0;
+    }
+    for (size_t i = 0; i < phase_len; i++) {
+        int32_t level = (int32_t)lroundf(amplitude * expf(-(float)i / tau_samples));
+        out[i] = WAVE_MIDSCALE - level;
+        out[phase_len + i] = WAVE_MIDSCALE + level;
+    }
+    for (size_t i = 2 * phase_len; i < count; i++) {
+        out[i] = WAVE_MIDSCALE;
+    }
+    return count;
+}
@@ -0,0 +1,28 @@
+#ifndef WAVEFORM_H
+#define WAVEFORM_H
+
+#include <nrfx_timer.h>
+#include <zephyr/kernel.h>
+#include "spi.h"
+
+#define WAVE_TIMER_INST_IDX 2
+#define WAVE_MAX_SAMPLES CONFIG_STIM_WAVEFORM_MAX_SAMPLES
+#define WAVE_SAMPLE_RATE_HZ CONFIG_STIM_WAVEFORM_SAMPLE_RATE
+// DAC code for 0 V output of the bipolar shapes and their largest
+// amplitude, so that midscale +/- amplitude stays a valid code
+#define WAVE_MIDSCALE 0x8000
+#define WAVE_MAX_AMPLITUDE (WAVE_MIDSCALE - 1)
+
+int waveform_init(nrfx_timer_t *stim_timer);
+int waveform_load(enum dac_id dac, const uint16_t *samples, size_t count);
+int waveform_start(void);
+bool waveform_active(enum dac_id dac);
+void waveform_pass_done(void);
+
+// Table generators, all return the number of samples written to out, 0
+// for an amplitude above WAVE_MAX_AMPLITUDE or a shape that does not fit
+size_t waveform_ramp(uint16_t *out, size_t count, uint16_t from, uint16_t to);
+size_t waveform_sine(uint16_t *out, size_t count, uint16_t amplitude, uint32_t cycles);
+size_t waveform_biphasic_exp(uint16_t *out, size_t count, uint16_t amplitude,
+                             size_t phase_len, float tau_samples);
+#endif